@@ -0,0 +1,233 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <string>
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <utility>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+#include "CallGraph.h"
+
+using namespace std;
+
+
+/*--------------------------------------------------------------------------*/
+/* Tarjan's algorithm without recursion, deep call chains in generated      */
+/* code would blow the stack otherwise                                      */
+/*--------------------------------------------------------------------------*/
+static int findComponents(const CALLGRAPH& g, vector<int>& components)
+{
+	int n = (int)g.nodes.size();
+
+	vector<int> index(n, -1), low(n, 0), next(n, 0);
+	vector<int> stack, path;
+	vector<bool> onstack(n, false);
+
+	int counter = 0;
+	int ncomponents = 0;
+
+	components.assign(n, -1);
+
+	for (int root = 0; root < n; root++)
+	{
+		if (index[root] != -1)
+			continue;
+
+		path.push_back(root);
+
+		while (!path.empty())
+		{
+			int v = path.back();
+
+			if (index[v] == -1)
+			{
+				index[v] = low[v] = counter++;
+				next[v] = g.offsets[v];
+				stack.push_back(v);
+				onstack[v] = true;
+			}
+
+			if (next[v] < g.offsets[v+1])
+			{
+				int w = g.callees[next[v]++];
+
+				if (index[w] == -1)
+					path.push_back(w);
+				else if (onstack[w])
+					low[v] = min(low[v], index[w]);
+
+				continue;
+			}
+
+			// All edges visited, close the component if v is a root
+
+			if (low[v] == index[v])
+			{
+				int w;
+				do
+				{
+					w = stack.back();
+					stack.pop_back();
+					onstack[w] = false;
+					components[w] = ncomponents;
+				}
+				while (w != v);
+
+				ncomponents++;
+			}
+
+			path.pop_back();
+
+			if (!path.empty())
+				low[path.back()] = min(low[path.back()], low[v]);
+		}
+	}
+
+	return ncomponents;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Build the caller -> callee graph from a list of call edges               */
+/*--------------------------------------------------------------------------*/
+void BuildCallGraph(CALLTREE* tree, vector<CALLEDGE>& edges)
+{
+	CALLGRAPH& g = tree->graph;
+
+	g.nodes.assign(tree->methods.size(), NULL);
+
+	for (auto& m : tree->methods)
+		g.nodes[m.second->id] = m.second;
+
+	sort(edges.begin(), edges.end(), 
+		[](const CALLEDGE& a, const CALLEDGE& b) {
+			if (a.first->id != b.first->id)
+				return a.first->id < b.first->id;
+			return a.second->id < b.second->id;
+		});
+
+	int n = (int)g.nodes.size();
+
+	g.offsets.assign(n + 1, 0);
+	g.callees.clear();
+	g.sites.clear();
+
+	// Duplicated edges collapse into one with the number of sites
+
+	for (size_t i = 0; i < edges.size(); i++)
+	{
+		int a = edges[i].first->id;
+		int b = edges[i].second->id;
+
+		if (i > 0 && edges[i-1].first->id == a && edges[i-1].second->id == b)
+		{
+			g.sites.back()++;
+			continue;
+		}
+
+		g.callees.push_back(b);
+		g.sites.push_back(1);
+		g.offsets[a+1]++;
+	}
+
+	for (int i = 0; i < n; i++)
+		g.offsets[i+1] += g.offsets[i];
+
+	// A method is recursive if it calls itself or shares its 
+	// component with some other method
+
+	vector<int> components;
+	vector<int> sizes(findComponents(g, components), 0);
+
+	for (int i = 0; i < n; i++)
+		sizes[components[i]]++;
+
+	for (int i = 0; i < n; i++)
+	{
+		METHOD* m = g.nodes[i];
+		m->recursive = sizes[components[i]] > 1;
+
+		for (int e = g.offsets[i]; e < g.offsets[i+1]; e++)
+			if (g.callees[e] == i)
+				m->recursive = true;
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Number of calls between local methods after the repetition, each copy    */
+/* of a caller carries all the call sites of the original body              */
+/*--------------------------------------------------------------------------*/
+int64 PredictCallSites(const CALLTREE* tree)
+{
+	const CALLGRAPH& g = tree->graph;
+	int64 total = 0;
+
+	for (size_t i = 0; i < g.nodes.size(); i++)
+	{
+		int64 copies = 1 + g.nodes[i]->repeats;
+
+		for (int e = g.offsets[i]; e < g.offsets[i+1]; e++)
+			total += copies * g.sites[e];
+	}
+
+	return total;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Trim the repetitions until the predicted call sites fit in maxsites,     */
+/* starting from the callers that contribute more sites per copy            */
+/*--------------------------------------------------------------------------*/
+int64 BoundCallTree(CALLTREE* tree, int64 maxsites)
+{
+	const CALLGRAPH& g = tree->graph;
+	int64 total = PredictCallSites(tree);
+
+	if (maxsites <= 0 || total <= maxsites)
+		return total;
+
+	vector<pair<int64, METHOD*> > callers;
+
+	for (size_t i = 0; i < g.nodes.size(); i++)
+	{
+		int64 out = 0;
+
+		for (int e = g.offsets[i]; e < g.offsets[i+1]; e++)
+			out += g.sites[e];
+
+		if (out > 0 && g.nodes[i]->repeats > 0)
+			callers.push_back(make_pair(out, g.nodes[i]));
+	}
+
+	sort(callers.begin(), callers.end(),
+		[](const pair<int64, METHOD*>& a, const pair<int64, METHOD*>& b) {
+			if (a.first != b.first)
+				return a.first > b.first;
+			return a.second->id < b.second->id;
+		});
+
+	for (auto& c : callers)
+	{
+		if (total <= maxsites)
+			break;
+
+		METHOD* m = c.second;
+
+		int64 need = (total - maxsites + c.first - 1) / c.first;
+		int64 cut = need < m->repeats ? need : m->repeats;
+
+		m->repeats -= (int)cut;
+		total -= cut * c.first;
+	}
+
+	return total;
+}
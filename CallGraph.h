@@ -0,0 +1,24 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <utility>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+
+using namespace std;
+
+typedef pair<METHOD*, METHOD*> CALLEDGE;
+
+void BuildCallGraph(CALLTREE* tree, vector<CALLEDGE>& edges);
+int64 PredictCallSites(const CALLTREE* tree);
+int64 BoundCallTree(CALLTREE* tree, int64 maxsites);
@@ -12,6 +12,7 @@
 #include "clang/Tooling/Tooling.h"
 #include "clang/Tooling/Refactoring.h"
 #include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
 #include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/ASTMatchers/ASTMatchFinder.h"
 #include "clang/Lex/Lexer.h"
@@ -22,9 +23,20 @@
 #include <iostream>
 #include <unordered_map>
 #include <stdexcept>
+#include <sstream>
+#include <vector>
+#include <set>
+#include <limits>
+#include <climits>
+#include <cmath>
 
 #include "Crowbar.h"
 #include "CallTree.h"
+#include "CallGraph.h"
+#include "NameFilter.h"
+#include "KNRConverter.h"
+#include "LocationCache.h"
+#include "Trace.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -34,52 +46,36 @@ using namespace std;
 
 
 /*--------------------------------------------------------------------------*/
-/* Convert a location to the absolute position inside the source file       */
+/* Size of a body in AST nodes, casts and parentheses left out, and the     */
+/* number of calls it makes                                                 */
 /*--------------------------------------------------------------------------*/
-void getAbsoluteLocation(const FullSourceLoc& l, int64* pBegin, int64* pEnd,
-		const LangOptions& lopt)
+class BodyMeter : public RecursiveASTVisitor<BodyMeter>
 {
-	const SourceManager& sm = l.getManager();
-
-	// I need to know the starting point of the file
-	FileID f = l.getFileID();
-	SourceLocation fl = sm.getLocForStartOfFile(f);
-
-	SourceRange lr = SourceRange(l);
-	SourceLocation b = SourceLocation(lr.getBegin());
-	SourceLocation _e = SourceLocation(lr.getEnd());
-	FullSourceLoc e(clang::Lexer::getLocForEndOfToken(_e, 0, sm, lopt), sm);
-
-	const char* fstart = sm.getCharacterData(fl);
-	const char* lbegin = sm.getCharacterData(b);
-	const char* lend = sm.getCharacterData(e);
-
-	*pBegin = (int64)(lbegin-fstart);
-	*pEnd = (int64)(lend-fstart);
-}
+public:
 
+	int nodes;
+	int calls;
 
-/*--------------------------------------------------------------------------*/
-/* Convert a location to the absolute position inside the source file       */
-/*--------------------------------------------------------------------------*/
-void getAbsoluteLocation(const FullSourceLoc& lb, const FullSourceLoc& le, 
-		int64* pBegin, int64* pEnd, const LangOptions& lopt)
-{
-	const SourceManager& sm = lb.getManager();
+	BodyMeter() :
+		nodes(0),
+		calls(0)
+	{
+	}
 
-	// I need to know the starting point of the file
-	FileID f = lb.getFileID();
-	SourceLocation fl = sm.getLocForStartOfFile(f);
-	
-	FullSourceLoc e(clang::Lexer::getLocForEndOfToken(le, 0, sm, lopt), sm);
+	bool VisitStmt(Stmt* s)
+	{
+		if (!isa<ImplicitCastExpr>(s) && !isa<ParenExpr>(s))
+			this->nodes++;
 
-	const char* fstart = sm.getCharacterData(fl);
-	const char* lbegin = sm.getCharacterData(lb);
-	const char* lend = sm.getCharacterData(e);
+		return true;
+	}
 
-	*pBegin = (int64)(lbegin-fstart);
-	*pEnd = (int64)(lend-fstart);
-}
+	bool VisitCallExpr(CallExpr* e)
+	{
+		this->calls++;
+		return true;
+	}
+};
 
 
 /*--------------------------------------------------------------------------*/
@@ -90,7 +86,113 @@ class TreeFinder : public MatchFinder::MatchCallback
 private:
 
 	const LangOptions* lopt;
+	NAMEFILTER* filter;
+	bool mainonly;
 	unordered_map<string, METHOD*> methods;
+	LocationCache locations;
+
+	// K&R headers are converted here instead of in a parse of their own
+	bool knr;
+	vector<pair<METHOD*, Replacement> > knrfixes;
+
+	// Names of the methods and of their repetitions, used to tell 
+	// which copy of a method encloses a call
+	unordered_map<string, pair<METHOD*, int> > callers;
+
+	// Constant arguments are only needed to specialize the copies
+	bool specialize;
+
+	// Call edges by name, resolved only after the whole source was 
+	// seen since a call may come before the callee definition
+	bool edges;
+	unordered_map<string, int> names;
+	vector<pair<int, int> > pending;
+	unordered_map<int, unordered_map<string, int64> > firstcalls;
+
+	// References to each name and how many of them are direct calls,
+	// the others take the address of the method
+	unordered_map<int, int> refs;
+	unordered_map<int, int> direct;
+
+	// Methods in the order they were found and the files read by the
+	// translation units, so the facts can be cached
+	vector<METHOD*> order;
+	set<string> files;
+	bool seen;
+
+	// Numbers of the calls and the calls found by the method pass
+	CallCounter counter;
+	vector<CALLFACT> calls;
+
+	int intern(const string& name)
+	{
+		auto n = this->names.find(name);
+		if (n != this->names.end())
+			return n->second;
+
+		int i = (int)this->names.size();
+		this->names[name] = i;
+		return i;
+	}
+
+	int runEdge(const CallExpr *md, const FunctionDecl* caller, 
+			SourceManager &sm, ASTContext &ctx)
+	{
+		const FunctionDecl* dcallee = md->getDirectCallee();
+
+		if (dcallee == 0)
+			return 0;
+
+		int b = this->intern(dcallee->getNameAsString());
+		this->direct[b]++;
+
+		SourceLocation l = sm.getExpansionLoc(md->getLocStart());
+		string file = sm.getFilename(l).str();
+		int64 offset = (int64)sm.getFileOffset(l);
+
+		// The call sites as the calls pass would find them, whether the
+		// callee makes it to the tree is only known later
+
+		int ordinal = this->counter.next(md, caller, file);
+
+		if (ordinal >= 0)
+		{
+			CALLFACT f;
+			f.callee = dcallee->getNameAsString();
+			f.from = caller == 0 ? string() : caller->getNameAsString();
+			f.file = file;
+			f.ordinal = ordinal;
+			f.main = sm.isInMainFile(md->getLocStart());
+
+			this->locations.getAbsoluteLocation(
+					FullSourceLoc(md->getLocStart(), sm), 
+					FullSourceLoc(md->getLocEnd(), sm),
+					&f.location.begin, &f.location.end);
+
+			this->getConstants(md, dcallee, sm, ctx, &f.constants);
+			this->calls.push_back(f);
+		}
+
+		auto& calls = this->firstcalls[b];
+		auto f = calls.find(file);
+
+		if (f == calls.end() || offset < f->second)
+			calls[file] = offset;
+
+		if (caller == 0)
+			return 0;
+
+		int a = this->intern(caller->getNameAsString());
+
+		this->pending.push_back(make_pair(a, b));
+		return 0;
+	}
+
+	int runRef(const DeclRefExpr *md)
+	{
+		this->refs[this->intern(md->getDecl()->getNameAsString())]++;
+		return 0;
+	}
 
 	int runFD(const FunctionDecl *md, SourceManager &sm)
 	{
@@ -100,39 +202,101 @@ private:
 		if (!md->isThisDeclarationADefinition())
 			return 0;
 
+		if (this->mainonly && !sm.isInMainFile(md->getLocation()))
+			return 0;
+
 		DeclarationNameInfo info = md->getNameInfo();
 		
 		FullSourceLoc b(md->getLocStart(), sm), _e(md->getLocEnd(), sm);
-		FullSourceLoc e(clang::Lexer::getLocForEndOfToken(_e, 0, sm, *this->lopt), sm);
+		FullSourceLoc e(this->locations.getLocForEndOfToken(_e, sm), sm);
 		
 		SourceRange nameRange = SourceRange(info.getLoc());
 		FullSourceLoc d(nameRange.getBegin(), sm), _f(nameRange.getEnd(), sm);
-		FullSourceLoc f(clang::Lexer::getLocForEndOfToken(_f, 0, sm, *this->lopt), sm);
+		FullSourceLoc f(this->locations.getLocForEndOfToken(_f, sm), sm);
 
-		string start(sm.getCharacterData(b), sm.getCharacterData(d)-sm.getCharacterData(b));
 		string name(sm.getCharacterData(d), sm.getCharacterData(f)-sm.getCharacterData(d));
-		string end(sm.getCharacterData(f), sm.getCharacterData(e)-sm.getCharacterData(f));
 
-		if (this->methods.find(name) != this->methods.end())
+		string params;
+		bool knr = this->knr && ConvertKNRHeader(md, sm, *this->lopt, 
+				this->locations, &params);
+
+		// Filtered methods never make it to the tree, but their 
+		// K&R header still has to be fixed
+
+		bool accepted = FilterAccepts(this->filter, name);
+
+		if (accepted && this->methods.find(name) != this->methods.end())
 		{
 			message("Redefinition of method " + name);
-			return 1;
+			accepted = false;
+		}
+
+		if (!accepted && !knr)
+			return 0;
+
+		string start(sm.getCharacterData(b), sm.getCharacterData(d)-sm.getCharacterData(b));
+		string end;
+
+		if (knr)
+		{
+			FullSourceLoc pb(md->getBody()->getLocStart(), sm);
+			end = params + "\n" + string(sm.getCharacterData(pb), 
+				sm.getCharacterData(e)-sm.getCharacterData(pb));
+
+			CharSourceRange range = CharSourceRange::
+				getCharRange(SourceRange(b, e));
+
+			Replacement r(sm, range, start + name + end);
+			this->knrfixes.push_back(make_pair((METHOD*)NULL, r));
+
+			if (!accepted)
+				return 0;
+		}
+		else
+		{
+			end = string(sm.getCharacterData(f), sm.getCharacterData(e)-sm.getCharacterData(f));
 		}
 
 		METHOD* m = new METHOD();
 		m->pre = start;
 		m->name = name;
 		m->post = end;
+		m->proto = params;
+		m->file = sm.getFilename(sm.getExpansionLoc(md->getLocation())).str();
+
+		m->body = string::npos;
+		SourceLocation lb = md->getBody()->getLocStart();
 
-		getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm), 
+		if (!lb.isMacroID())
+		{
+			size_t n = (size_t)(sm.getCharacterData(e) - sm.getCharacterData(lb));
+			if (n <= end.size())
+				m->body = end.size() - n;
+		}
+
+		BodyMeter meter;
+		meter.TraverseStmt(md->getBody());
+
+		m->nodes = meter.nodes;
+		m->leaf = meter.calls == 0;
+		m->inlined = md->isInlineSpecified();
+		m->internal = md->getStorageClass() == SC_Static;
+		m->addressed = false;
+		m->kind = MC_Other;
+
+		if (knr)
+			this->knrfixes.back().first = m;
+
+		this->locations.getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm), 
 				FullSourceLoc(md->getLocEnd(), sm), 
-				&m->location.begin, &m->location.end, *this->lopt);
+				&m->location.begin, &m->location.end);
 
 		m->sm = &sm;
 		m->range = CharSourceRange::
 			getTokenRange(SourceRange(info.getLoc()));
 
 		this->methods[name] = m;
+		this->order.push_back(m);
 
 		// For debugging purposes
 		// cout << start << "|" << name << "|" << end << endl;
@@ -140,8 +304,96 @@ private:
 		return 0;
 	}
 
-	int runCE(const CallExpr *md, SourceManager &sm)
+	// Methods of the tree by declaration, so each callee is looked up
+	// by name only once per translation unit (NULL if not in the tree)
+	unordered_map<const FunctionDecl*, METHOD*> resolved;
+
+	METHOD* resolve(const FunctionDecl* dcallee)
+	{
+		const FunctionDecl* c = dcallee->getCanonicalDecl();
+
+		auto r = this->resolved.find(c);
+		if (r != this->resolved.end())
+			return r->second;
+
+		auto method = this->methods.find(c->getNameInfo().getAsString());
+		METHOD* m = method == this->methods.end() ? NULL : method->second;
+
+		this->resolved[c] = m;
+		return m;
+	}
+
+	// A parameter that can't be turned into a local of the body: one
+	// written by a macro, one with a default argument (which would
+	// end up in the initializer) or one whose type depends on the 
+	// other parameters, which may be the ones removed
+
+	static bool isFixedParam(const ParmVarDecl* p)
+	{
+		return !p->getLocation().isMacroID() && !p->hasDefaultArg() &&
+			!p->getType()->isVariablyModifiedType() &&
+			!p->getOriginalType()->isVariablyModifiedType();
+	}
+
+	// Integer constants passed to the parameters of integer type, as
+	// literals with the value of the argument before any conversion.
+	// Enumerations are left out, C++ does not convert integers to them
+	void getConstants(const CallExpr *md, const FunctionDecl* dcallee, 
+			SourceManager &sm, ASTContext &ctx, vector<string>* constants)
 	{
+		if (dcallee->isVariadic() || md->getLocStart().isMacroID() ||
+				md->getNumArgs() != dcallee->getNumParams())
+			return;
+
+		// The parameters of the copies are rewritten as text
+		const FunctionDecl* definition = dcallee->getDefinition();
+
+		for (unsigned i = 0; i < dcallee->getNumParams(); i++)
+		{
+			if (!isFixedParam(dcallee->getParamDecl(i)) ||
+					(definition != NULL && 
+					 !isFixedParam(definition->getParamDecl(i))))
+				return;
+		}
+
+		for (unsigned i = 0; i < md->getNumArgs(); i++)
+		{
+			const Expr* a = md->getArg(i);
+			string value;
+			APSInt v;
+
+			QualType t = dcallee->getParamDecl(i)->getType();
+
+			if (t->isIntegerType() && !t->isEnumeralType() &&
+					a->EvaluateAsInt(v, ctx) && v.getMinSignedBits() <= 64)
+			{
+				stringstream ss;
+
+				if (v.isSigned() && 
+						v.getSExtValue() > numeric_limits<int64>::min())
+				{
+					int64 x = v.getSExtValue();
+					ss << x << (x >= INT_MIN && x <= INT_MAX ? "" : "LL");
+				}
+				else if (v.isUnsigned())
+				{
+					uint64_t x = v.getZExtValue();
+					ss << x << (x <= (uint64_t)INT_MAX ? "" : "ULL");
+				}
+
+				value = ss.str();
+			}
+
+			constants->push_back(value);
+		}
+	}
+
+	int runCE(const CallExpr *md, const FunctionDecl* caller, 
+			SourceManager &sm, ASTContext &ctx)
+	{
+		if (this->edges)
+			return this->runEdge(md, caller, sm, ctx);
+
 		const FunctionDecl* dcallee = md->getDirectCallee();
 
 		// Only care about callees that can be determined at 
@@ -149,28 +401,60 @@ private:
 		if (dcallee == 0)
 			return 0;
 
-		DeclarationNameInfo info = dcallee->getNameInfo();
-		std::string name = info.getAsString();
+		// Every call is numbered, whether it is collected or not
+		string file = sm.getFilename(sm.getExpansionLoc(md->getLocStart())).str();
+		int ordinal = this->counter.next(md, caller, file);
+
+		METHOD* m = this->resolve(dcallee);
 
 		// Maybe it's calling external code, if it has no 
 		// local body then the call is irrelevant
-		auto method = this->methods.find(name);
-		if (method == this->methods.end())
+		if (m == NULL)
+			return 0;
+
+		if (this->mainonly && !sm.isInMainFile(md->getLocStart()))
 			return 0;
 
+		// Only the repeated methods have somewhere to redirect to
+		if (m->repeats == 0)
+		{
+			m->skipped++;
+			return 0;
+		}
+
 		const Decl* callee = md->getCalleeDecl();
 
 		CALLSITE* s = new CALLSITE();
 		
-		getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm), 
+		this->locations.getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm), 
 				FullSourceLoc(md->getLocEnd(), sm),
-				&s->location.begin, &s->location.end, *this->lopt);
+				&s->location.begin, &s->location.end);
 
+		s->file = file;
 		s->sm = &sm;
 		s->range = CharSourceRange::
 			getTokenRange(SourceRange(callee->getLocation()));
 
-		method->second->calls.push_back(s);
+		s->caller = NULL;
+		s->clone = 0;
+		s->from = caller == 0 ? string() : caller->getNameAsString();
+		s->ordinal = ordinal;
+		s->callee = m;
+
+		if (caller != 0)
+		{
+			auto c = this->callers.find(caller->getNameAsString());
+			if (c != this->callers.end())
+			{
+				s->caller = c->second.first;
+				s->clone = c->second.second;
+			}
+		}
+
+		if (this->specialize)
+			this->getConstants(md, dcallee, sm, ctx, &s->constants);
+
+		m->calls.push_back(s);
 
 		// For debugging purposes
 		// cout << name << endl;
@@ -180,45 +464,252 @@ private:
 
 public:
 
-	TreeFinder(const LangOptions* lopt) : lopt(lopt)
+	TreeFinder(const LangOptions* lopt, NAMEFILTER* filter, bool mainonly, 
+			bool knr, bool specialize, bool edges) : 
+		lopt(lopt),
+		filter(filter),
+		mainonly(mainonly),
+		locations(lopt),
+		knr(knr),
+		specialize(specialize),
+		edges(edges),
+		seen(false)
 	{
 
 	}
 
-	const unordered_map<string, METHOD*>& getMethods()
+	void setMethods(unordered_map<string, METHOD*>& methods)
 	{
-		return this->methods;
+		this->methods = methods;
+
+		for (auto& m : methods)
+		{
+			METHOD* p = m.second;
+			this->callers[p->name] = make_pair(p, 0);
+
+			for (int i = 1; i <= p->repeats; i++)
+			{
+				stringstream ss;
+				ss << 'r' << i << '_' << p->name;
+				this->callers[ss.str()] = make_pair(p, i);
+			}
+		}
 	}
 
-	void setMethods(unordered_map<string, METHOD*>& methods)
+	void getFacts(TUFACTS* facts)
 	{
-		this->methods = methods;
+		vector<string> byid(this->names.size());
+
+		for (auto& n : this->names)
+			byid[n.second] = n.first;
+
+		facts->methods = this->order;
+
+		for (auto& k : this->knrfixes)
+		{
+			facts->knrfixes.push_back(make_pair(k.first == NULL ? 
+				string() : k.first->name, k.second));
+		}
+
+		for (auto& e : this->pending)
+			facts->edges.push_back(make_pair(byid[e.first], byid[e.second]));
+
+		for (auto& c : this->firstcalls)
+			facts->firstcalls[byid[c.first]] = c.second;
+
+		for (auto& r : this->refs)
+			facts->refs[byid[r.first]] = r.second;
+
+		for (auto& d : this->direct)
+			facts->direct[byid[d.first]] = d.second;
+
+		facts->files.assign(this->files.begin(), this->files.end());
+		facts->calls.swap(this->calls);
+	}
+
+	virtual void onStartOfTranslationUnit()
+	{
+		// The declarations die with the previous translation unit
+		this->resolved.clear();
+		this->locations.clear();
+		this->counter.clear();
+		this->seen = false;
 	}
 
 	virtual void run(const MatchFinder::MatchResult &Result) 
 	{
 		SourceManager &sm = Result.Context->getSourceManager();
+
+		// The whole unit was read before anything is matched
+		if (this->edges && !this->seen)
+		{
+			for (auto i = sm.fileinfo_begin(); i != sm.fileinfo_end(); ++i)
+				this->files.insert(i->first->getName());
+
+			this->seen = true;
+		}
+
 		if (const FunctionDecl *md = Result.Nodes.getNodeAs<clang::FunctionDecl>("id"))
 			this->runFD(md, sm);
 		else if (const CallExpr *md = Result.Nodes.getNodeAs<clang::CallExpr>("id"))
-			this->runCE(md, sm);
+			this->runCE(md, Result.Nodes.getNodeAs<clang::FunctionDecl>("caller"), 
+					sm, *Result.Context);
+		else if (const DeclRefExpr *md = Result.Nodes.getNodeAs<clang::DeclRefExpr>("ref"))
+			this->runRef(md);
 	}
 };
 
-int BuildCallTreeMethods(ClangTool& tool, const LangOptions* lopt, CALLTREE** ppTree)
+/*--------------------------------------------------------------------------*/
+/* Calls bound to their enclosing method definition, if any                 */
+/*--------------------------------------------------------------------------*/
+StatementMatcher CallerMatcher()
+{
+	return callExpr(anyOf(
+			hasAncestor(functionDecl(isDefinition()).bind("caller")),
+			anything())).bind("id");
+}
+
+/*--------------------------------------------------------------------------*/
+/* Run the method pass, the methods and calls are only collected            */
+/*--------------------------------------------------------------------------*/
+int CollectCallTreeFacts(ClangTool& tool, const LangOptions* lopt, 
+		NAMEFILTER* filter, bool mainonly, bool knr, TUFACTS* facts)
 {
 	MatchFinder matchFinder;
-	TreeFinder treeFinder(lopt);
+	TreeFinder treeFinder(lopt, filter, mainonly, knr, false, true);
 
 	DeclarationMatcher methodMatcher = functionDecl().bind("id");
 	matchFinder.addMatcher(methodMatcher, &treeFinder);
 
-	assert_tool(tool.run(newFrontendActionFactory(&matchFinder).get()));
+	// The call edges are cheap to collect in the same pass and they
+	// allow bounding the repetition before anything is rewritten
+	matchFinder.addMatcher(CallerMatcher(), &treeFinder);
 
-	// Dump everything to ppTree
-	
-	*ppTree = new CALLTREE();
-	(*ppTree)->methods = treeFinder.getMethods();
+	// So are the references that take the address of a method
+	StatementMatcher refMatcher = declRefExpr(to(functionDecl())).bind("ref");
+	matchFinder.addMatcher(refMatcher, &treeFinder);
+
+	assert_tool(tool.run(newTracedActionFactory(&matchFinder, "methods").get()));
+
+	treeFinder.getFacts(facts);
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Build the tree from the facts of the translation units, in the order     */
+/* they were parsed, the first definition of a name wins                    */
+/*--------------------------------------------------------------------------*/
+void BuildCallTreeFacts(const vector<TUFACTS*>& facts, NAMEFILTER* filter, 
+		bool mainonly, CALLTREE** ppTree)
+{
+	CALLTREE* tree = new CALLTREE();
+	tree->mainonly = mainonly;
+	tree->specialize = false;
+
+	unordered_map<string, unordered_map<string, int64> > firstcalls;
+	unordered_map<string, int> refs, direct;
+
+	for (auto f : facts)
+	{
+		unordered_map<string, METHOD*> accepted;
+
+		for (auto m : f->methods)
+		{
+			bool accept = FilterAccepts(filter, m->name);
+
+			if (accept && tree->methods.find(m->name) != tree->methods.end())
+			{
+				message("Redefinition of method " + m->name);
+				accept = false;
+			}
+
+			if (!accept)
+			{
+				delete m;
+				continue;
+			}
+
+			tree->methods[m->name] = m;
+			accepted[m->name] = m;
+		}
+
+		f->methods.clear();
+
+		for (auto& k : f->knrfixes)
+		{
+			auto a = accepted.find(k.first);
+			tree->knrfixes.push_back(make_pair(
+				a == accepted.end() ? (METHOD*)NULL : a->second, k.second));
+		}
+
+		for (auto& c : f->firstcalls)
+		{
+			auto& calls = firstcalls[c.first];
+
+			for (auto& o : c.second)
+			{
+				auto e = calls.find(o.first);
+				if (e == calls.end() || o.second < e->second)
+					calls[o.first] = o.second;
+			}
+		}
+
+		for (auto& r : f->refs)
+			refs[r.first] += r.second;
+
+		for (auto& d : f->direct)
+			direct[d.first] += d.second;
+
+		tree->calls.insert(tree->calls.end(), f->calls.begin(), 
+				f->calls.end());
+		f->calls.clear();
+	}
+
+	int id = 0;
+	for (auto& m : tree->methods)
+	{
+		m.second->id = id++;
+		m.second->repeats = 0;
+		m.second->skipped = 0;
+		m.second->addressed = refs[m.first] > direct[m.first];
+
+		auto c = firstcalls.find(m.first);
+		if (c != firstcalls.end())
+			m.second->firstcalls = c->second;
+	}
+
+	// Calls from or to external code do not make an edge
+
+	vector<CALLEDGE> edges;
+
+	for (auto f : facts)
+	{
+		for (auto& e : f->edges)
+		{
+			auto a = tree->methods.find(e.first);
+			auto b = tree->methods.find(e.second);
+
+			if (a != tree->methods.end() && b != tree->methods.end())
+				edges.push_back(make_pair(a->second, b->second));
+		}
+	}
+
+	BuildCallGraph(tree, edges);
+
+	*ppTree = tree;
+}
+
+
+int BuildCallTreeMethods(ClangTool& tool, const LangOptions* lopt, 
+		NAMEFILTER* filter, bool mainonly, bool knr, CALLTREE** ppTree)
+{
+	TUFACTS facts;
+	assert_phase(CollectCallTreeFacts(tool, lopt, filter, mainonly, knr, 
+			&facts));
+
+	BuildCallTreeFacts(vector<TUFACTS*>(1, &facts), filter, mainonly, ppTree);
 
 	return 0;
 }
@@ -226,19 +717,181 @@ int BuildCallTreeMethods(ClangTool& tool, const LangOptions* lopt, CALLTREE** pp
 int BuildCallTreeCalls(ClangTool& tool, const LangOptions* lopt, CALLTREE* ppTree)
 {
 	MatchFinder matchFinder;
-	TreeFinder treeFinder(lopt);
+	TreeFinder treeFinder(lopt, NULL, ppTree->mainonly, false, 
+			ppTree->specialize, false);
 
 	// Use the existing tree	
 	treeFinder.setMethods(ppTree->methods);
 
-	StatementMatcher callMatcher = callExpr().bind("id");
-	matchFinder.addMatcher(callMatcher, &treeFinder);
+	for (auto& m : ppTree->methods)
+		m.second->skipped = 0;
 
-	assert_tool(tool.run(newFrontendActionFactory(&matchFinder).get()));
+	matchFinder.addMatcher(CallerMatcher(), &treeFinder);
+
+	assert_tool(tool.run(newTracedActionFactory(&matchFinder, "calls").get()));
 	
 	return 0;
 }
 
+/*--------------------------------------------------------------------------*/
+/* Fill the tree with the calls the method pass found, as the calls pass    */
+/* would find them in the repeated sources: the calls of a definition come  */
+/* again in each of its copies, right after it. The copies must not have    */
+/* been placed elsewhere                                                    */
+/*--------------------------------------------------------------------------*/
+void BuildCallTreeCallFacts(CALLTREE* tree)
+{
+	for (auto& m : tree->methods)
+		m.second->skipped = 0;
+
+	const vector<CALLFACT>& calls = tree->calls;
+
+	for (size_t i = 0; i < calls.size(); )
+	{
+		// The calls of a definition, numbered from 0
+
+		size_t j = i + 1;
+
+		while (j < calls.size() && !calls[j].from.empty() && 
+				calls[j].ordinal > 0 && calls[j].from == calls[i].from && 
+				calls[j].file == calls[i].file)
+			j++;
+
+		auto c = calls[i].from.empty() ? tree->methods.end() : 
+			tree->methods.find(calls[i].from);
+
+		METHOD* caller = c == tree->methods.end() ? NULL : c->second;
+		int copies = caller == NULL ? 0 : caller->repeats;
+
+		for (int k = 0; k <= copies; k++)
+		{
+			for (size_t x = i; x < j; x++)
+			{
+				const CALLFACT& f = calls[x];
+
+				auto method = tree->methods.find(f.callee);
+				if (method == tree->methods.end())
+					continue;
+
+				METHOD* m = method->second;
+
+				if (tree->mainonly && !f.main)
+					continue;
+
+				if (m->repeats == 0)
+				{
+					m->skipped++;
+					continue;
+				}
+
+				CALLSITE* s = new CALLSITE();
+				s->location = f.location;
+				s->file = f.file;
+				s->sm = NULL;
+				s->caller = caller;
+				s->clone = k;
+				s->ordinal = f.ordinal;
+				s->callee = m;
+
+				if (k == 0)
+				{
+					s->from = f.from;
+				}
+				else
+				{
+					stringstream ss;
+					ss << 'r' << k << '_' << f.from;
+					s->from = ss.str();
+				}
+
+				if (tree->specialize)
+					s->constants = f.constants;
+
+				m->calls.push_back(s);
+			}
+		}
+
+		i = j;
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Key of a call that is the same in the original and in the repeated       */
+/* sources                                                                  */
+/*--------------------------------------------------------------------------*/
+string CallSiteKey(const string& file, const string& from, int ordinal)
+{
+	stringstream ss;
+	ss << file << '\n' << from << '\n' << ordinal;
+	return ss.str();
+}
+
+
+void CallCounter::clear()
+{
+	this->definitions.clear();
+	this->files.clear();
+}
+
+
+int CallCounter::next(const CallExpr* call, const FunctionDecl* caller, 
+		const string& file)
+{
+	const FunctionDecl* callee = call->getDirectCallee();
+
+	if (callee == NULL || callee->getBuiltinID() != 0)
+		return -1;
+
+	if (caller != NULL)
+		return this->definitions[caller]++;
+
+	return this->files[file]++;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Classify the methods by how much inlining they would lose to the copies, */
+/* small leaves the compiler may drop once inlined are checked first        */
+/*--------------------------------------------------------------------------*/
+void ClassifyMethods(CALLTREE* tree, int smallsize)
+{
+	for (auto& i : tree->methods)
+	{
+		METHOD* m = i.second;
+
+		if (m->leaf && m->nodes <= smallsize && (m->inlined || m->internal))
+			m->kind = MC_Small;
+		else if (m->inlined)
+			m->kind = MC_Inline;
+		else if (m->addressed)
+			m->kind = MC_Addressed;
+		else
+			m->kind = MC_Other;
+	}
+}
+
+const char* MethodClassName(MethodClass c)
+{
+	static const char* names[MC_Count] = {
+		"small", "inline", "addressed", "other"
+	};
+
+	return c >= 0 && c < MC_Count ? names[c] : "";
+}
+
+/*--------------------------------------------------------------------------*/
+/* Number of items a -max-select or -max-redirect limit allows out of       */
+/* count, percentages are given as negative limits                          */
+/*--------------------------------------------------------------------------*/
+int64 ResolveLimit(int limit, int64 count)
+{
+	int64 n = limit < 0 ? 
+		(int64)round((double)-limit / 100.0 * (double)count) : limit;
+
+	return n > count ? count : n;
+}
+
 void DestroyCallTree(CALLTREE** ppTree)
 {
 	for(auto& method : (*ppTree)->methods)
@@ -37,13 +37,75 @@ struct FILERANGE
 	int64 begin, end;
 };
 
+struct METHOD;
+
+// How eager the compiler is to inline a method, a method is of the
+// first class it fits
+enum MethodClass
+{
+	MC_Small,
+	MC_Inline,
+	MC_Addressed,
+	MC_Other,
+	MC_Count,
+};
+
 struct CALLSITE
 {
 	FILERANGE location;
+	string file;
 	CharSourceRange range;
 	SourceManager* sm;
 
+	// Enclosing method of the call and which copy of it (0 is the
+	// original, n is rn_), caller is NULL outside a known method
+	METHOD* caller;
+	int clone;
+
+	// Name of the enclosing definition as it is written (empty outside
+	// any) and the number of the call in it, see CallCounter
+	string from;
+	int ordinal;
+
+	METHOD* callee;
+
 	int redirect;
+
+	// Integer constant passed as each argument (empty if it is not one),
+	// only collected to specialize the copies
+	vector<string> constants;
+};
+
+// A call found by the method pass, by name since the tree is not built
+// yet. The calls of a definition are together and in order
+struct CALLFACT
+{
+	string callee;
+	string from;
+	string file;
+	int ordinal;
+	bool main;
+	FILERANGE location;
+	vector<string> constants;
+};
+
+// Numbers the direct calls of each definition (or of each file, outside 
+// any) in the order they are matched. The text of a copy is the text of
+// its original, so the n-th call of a copy is the n-th call of the
+// original however far the copy was moved. Builtins are not counted,
+// the copies may have calls to them the original doesn't
+class CallCounter
+{
+private:
+
+	unordered_map<const FunctionDecl*, int> definitions;
+	unordered_map<string, int> files;
+
+public:
+
+	void clear();
+	int next(const CallExpr* call, const FunctionDecl* caller, 
+			const string& file);
 };
 
 struct METHOD
@@ -56,16 +118,108 @@ struct METHOD
 	CharSourceRange range;
 	SourceManager* sm;
 
+	int id;
 	int repeats;
+
+	// Calls itself or is in a cycle of calls with other methods
+	bool recursive;
+
+	// Calls to the method that were not collected because it was not
+	// repeated, they could never be redirected anyway
+	int skipped;
+
+	// Parameter list of a converted K&R definition, empty otherwise
+	string proto;
+
+	// Offset of the body in post, npos if it comes from a macro
+	size_t body;
+
+	// Size of the body in AST nodes, its storage, whether it calls
+	// anything and whether its address is taken anywhere
+	int nodes;
+	bool inlined;
+	bool internal;
+	bool leaf;
+	bool addressed;
+	MethodClass kind;
+
+	// File of the definition and offset of the first call in each
+	// file, a copy referenced before its definition needs a prototype
+	string file;
+	unordered_map<string, int64> firstcalls;
 	
 	vector<CALLSITE*> calls;
 };
 
+// Caller -> callee graph in CSR form, the edges of node i are in 
+// [offsets[i], offsets[i+1]) and sites counts the calls of each edge
+struct CALLGRAPH
+{
+	vector<METHOD*> nodes;
+	vector<int> offsets;
+	vector<int> callees;
+	vector<int> sites;
+};
+
 struct CALLTREE
 {
 	unordered_map<string,METHOD*> methods;
+	CALLGRAPH graph;
+
+	// Only the main file of each translation unit may be rewritten
+	bool mainonly;
+
+	// Collect the constant arguments of the calls
+	bool specialize;
+
+	// K&R definitions converted during the method pass, the method is
+	// NULL when the definition did not make it to the tree
+	vector<pair<METHOD*, Replacement> > knrfixes;
+
+	// Calls found by the method pass in the original sources
+	vector<CALLFACT> calls;
+};
+
+// What the method pass takes from the sources, enough to build the tree
+// without parsing them again, the methods are referred to by name since
+// a call may come before the definition
+struct TUFACTS
+{
+	// In the order they were found, moved to the tree when it is built
+	vector<METHOD*> methods;
+
+	// K&R fixes and the method they belong to (empty if not in the tree)
+	vector<pair<string, Replacement> > knrfixes;
+
+	// Caller and callee of each call, and where each method is first
+	// called in each file
+	vector<pair<string, string> > edges;
+	unordered_map<string, unordered_map<string, int64> > firstcalls;
+
+	// References to each method and how many of them are direct calls
+	unordered_map<string, int> refs;
+	unordered_map<string, int> direct;
+
+	// Every file the translation units read
+	vector<string> files;
+
+	// Every counted call, to a method of the tree or not
+	vector<CALLFACT> calls;
 };
 
-int BuildCallTreeMethods(ClangTool& tool, const LangOptions* lopt, CALLTREE** ppTree);
+struct NAMEFILTER;
+
+int BuildCallTreeMethods(ClangTool& tool, const LangOptions* lopt, 
+		NAMEFILTER* filter, bool mainonly, bool knr, CALLTREE** ppTree);
+int CollectCallTreeFacts(ClangTool& tool, const LangOptions* lopt, 
+		NAMEFILTER* filter, bool mainonly, bool knr, TUFACTS* facts);
+void BuildCallTreeFacts(const vector<TUFACTS*>& facts, NAMEFILTER* filter, 
+		bool mainonly, CALLTREE** ppTree);
 int BuildCallTreeCalls(ClangTool& tool, const LangOptions* lopt, CALLTREE* ppTree);
+void BuildCallTreeCallFacts(CALLTREE* tree);
+string CallSiteKey(const string& file, const string& from, int ordinal);
+StatementMatcher CallerMatcher();
+void ClassifyMethods(CALLTREE* tree, int smallsize);
+const char* MethodClassName(MethodClass c);
+int64 ResolveLimit(int limit, int64 count);
 void DestroyCallTree(CALLTREE** ppTree);
@@ -30,8 +30,12 @@
 
 #include <stdlib.h>
 #include <time.h>
+#include <unistd.h>
 
 #include <unordered_set>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <vector>
 
 #include "Crowbar.h"
@@ -39,6 +43,18 @@
 #include "Repeater.h"
 #include "Redirector.h"
 #include "KNRConverter.h"
+#include "Prefilter.h"
+#include "NameFilter.h"
+#include "Workers.h"
+#include "Splitter.h"
+#include "Indexer.h"
+#include "Output.h"
+#include "Trace.h"
+#include "Streamer.h"
+#include "Pipeline.h"
+#include "FactCache.h"
+#include "Verifier.h"
+#include "SymbolIndex.h"
 
 using namespace std;
 using namespace llvm;
@@ -52,12 +68,6 @@ typedef int64_t int64;
 /* Help Setup                                                               */
 /*--------------------------------------------------------------------------*/
 
-enum RedirectMode
-{
-	RM_Total,
-	RM_PerMethod,
-};
-
 static cl::OptionCategory CrowbarCat("Crowbar", "Code Refactoring Tool");
 
 static cl::opt<bool> ListOpt ("list", 
@@ -68,14 +78,41 @@ static cl::opt<bool> CallsOpt ("calls",
 		cl::desc("List all methods with a body and their call sites"),
 		cl::cat(CrowbarCat));
 
+static cl::opt<string> IndexOutOpt("index-out", 
+		cl::desc("File where -list and -calls are written (standard output if empty)"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<IndexFormat> IndexFormatOpt("index-format", 
+		cl::desc("Format of the -list and -calls output:"),
+		cl::values(
+			clEnumValN(IF_Text, "text", "name,begin-end lines grouped by file"),
+			clEnumValN(IF_Binary, "binary", "compact binary index"),
+			clEnumValEnd),
+		cl::init(IF_Text), cl::cat(CrowbarCat));
+
+static cl::opt<int> IndexThreadsOpt("index-threads", 
+		cl::desc("Number of processes used by -list and -calls (0 for one per core)"),
+		cl::init(0), cl::cat(CrowbarCat));
+
 static cl::opt<bool> KNROpt("knr", 
 		cl::desc("Enable K&R header fix for methods"),
 		cl::init(false), cl::value_desc("pattern"),
 		cl::cat(CrowbarCat));
 
 static cl::opt<string> SelectOpt("select", 
-		cl::desc("Regex pattern to select methods"),
-		cl::init("*"), cl::value_desc("pattern"),
+		cl::desc("Comma separated glob patterns (* and ?) to select methods (* if neither -select nor -select-file is given)"),
+		cl::init(""), cl::value_desc("pattern"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> SelectFileOpt("select-file", 
+		cl::desc("File with glob patterns to select methods, one per line"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> ExcludeFileOpt("exclude-file", 
+		cl::desc("File with glob patterns to exclude methods, one per line"),
+		cl::init(""), cl::value_desc("filename"),
 		cl::cat(CrowbarCat));
 
 static cl::opt<string> MaxSelectOpt("max-select", 
@@ -86,17 +123,29 @@ static cl::opt<int> MaxRepeatOpt("max-repeat",
 		cl::desc("Maximum number of repetitions for selected methods"),
 		cl::init(5), cl::cat(CrowbarCat));
 
+static cl::opt<int> MaxCallSitesOpt("max-callsites", 
+		cl::desc("Maximum number of calls between methods after the repetition (0 for no limit)"),
+		cl::init(0), cl::cat(CrowbarCat));
+
 static cl::opt<int> SRSeedOpt("srseed", 
 		cl::desc("Seed used to select method repetitions"),
 		cl::init(4), cl::cat(CrowbarCat)); /*Chosen by a fair dice roll*/
 
-/*static cl::opt<RedirectMode> RedirectModeOpt("redirect-mode", 
+static cl::opt<RedirectMode> RedirectModeOpt("redirect-mode", 
 		cl::desc("Select redirection mode:"),
 		cl::values(
 			clEnumValN(RM_Total, "total", "max-redirect applied over all methods"),
-            clEnumValN(RM_PerMethod, "per-method", "max-redirect applied for each method individually"),
-            clEnumValEnd),
-		cl::init(RM_PerMethod), cl::cat(CrowbarCat));*/
+			clEnumValN(RM_PerMethod, "per-method", "max-redirect applied for each method individually"),
+			clEnumValEnd),
+		cl::init(RM_PerMethod), cl::cat(CrowbarCat));
+
+static cl::opt<RedirectPolicy> RedirectPolicyOpt("redirect-policy", 
+		cl::desc("Select the copy each redirected call goes to:"),
+		cl::values(
+			clEnumValN(RP_Random, "random", "a random copy for each call"),
+			clEnumValN(RP_Affinity, "affinity", "the same copy for all the calls of a caller to a method"),
+			clEnumValEnd),
+		cl::init(RP_Random), cl::cat(CrowbarCat));
 
 static cl::opt<string> MaxRedirectOpt("max-redirect", 
 		cl::desc("Maximum number of calls per method to be redirected (absolute or %)"),
@@ -106,32 +155,188 @@ static cl::opt<int> RESeedOpt("reseed",
 		cl::desc("Seed used to select call redirections"),
 		cl::init(4), cl::cat(CrowbarCat)); /*Chosen by a fair dice roll*/
 
+static cl::opt<bool> RNGCompatOpt("rng-compat", 
+		cl::desc("Draw the random numbers of the calls to methods that were not repeated, as older versions did"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<bool> CloneColdOpt("clone-cold", 
+		cl::desc("Mark the repetitions as cold"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<bool> CloneNoInlineOpt("clone-noinline", 
+		cl::desc("Mark the repetitions as noinline"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> CloneSectionOpt("clone-section", 
+		cl::desc("Section where the repetitions are placed"),
+		cl::init(""), cl::value_desc("section"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<bool> CloneOriginalOpt("clone-original", 
+		cl::desc("Apply the repetition attributes to the original method too"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<ClonePlacement> ClonePlacementOpt("clone-placement", 
+		cl::desc("Select where the repetitions are written:"),
+		cl::values(
+			clEnumValN(CP_Original, "original", "right after the original method"),
+			clEnumValN(CP_Caller, "caller", "after the caller that calls them the most (needs -redirect-policy=affinity)"),
+			clEnumValEnd),
+		cl::init(CP_Original), cl::cat(CrowbarCat));
+
+static cl::opt<string> ProfileOpt("profile", 
+		cl::desc("File with name,count lines, methods below -hot-threshold are marked cold and the others hot"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<int> HotThresholdOpt("hot-threshold", 
+		cl::desc("Minimum number of calls in the profile for a method to be hot"),
+		cl::init(1), cl::cat(CrowbarCat));
+
+static cl::opt<PrototypeMode> PrototypesOpt("prototypes", 
+		cl::desc("Select which prototypes of the repetitions are written:"),
+		cl::values(
+			clEnumValN(PM_Minimal, "minimal", "only where a repetition may be called before its definition"),
+			clEnumValN(PM_All, "all", "for every repetition and declaration"),
+			clEnumValEnd),
+		cl::init(PM_Minimal), cl::cat(CrowbarCat));
+
+static cl::opt<bool> CountersOpt("counters", 
+		cl::desc("Count the calls of the repeated methods and of their copies at run time (link CrowbarCounters.c)"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<bool> SpecializeOpt("specialize", 
+		cl::desc("Specialize the repetitions for the integer constants passed by all of their redirected calls"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> ClassPolicyOpt("class-policy", 
+		cl::desc("Comma separated class=policy pairs, the classes are small, inline, addressed and other, the policies free, inlinable and skip"),
+		cl::init(""), cl::value_desc("list"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<int> SmallSizeOpt("small-size", 
+		cl::desc("Maximum size in AST nodes of a small method"),
+		cl::init(16), cl::cat(CrowbarCat));
+
+static cl::opt<int> SplitOpt("split", 
+		cl::desc("Move the repetitions to this number of generated sibling sources (0 keeps them in place)"),
+		cl::init(0), cl::cat(CrowbarCat));
+
+static cl::opt<bool> StreamOpt("stream", 
+		cl::desc("Write the repeated sources in source order without parsing them again (no final check)"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<int> WorkersOpt("workers", 
+		cl::desc("Number of worker processes, each translation unit is processed independently"),
+		cl::init(0), cl::cat(CrowbarCat));
+
+static cl::opt<int> RetriesOpt("retries", 
+		cl::desc("Number of retries for a translation unit whose worker failed"),
+		cl::init(1), cl::cat(CrowbarCat));
+
+static cl::opt<string> ShardOpt("shard", 
+		cl::desc("Only process the sources of shard i out of N, each one on its own as the workers do (merge the logs with crowbar-merge)"),
+		cl::init(""), cl::value_desc("i/N"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> TimingsOpt("timings", 
+		cl::desc("File with the processing time of each translation unit, used to schedule the workers"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> QuarantineOpt("quarantine", 
+		cl::desc("File listing the translation units that failed in every retry"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> OutputDirOpt("output-dir", 
+		cl::desc("Directory where the transformed sources are written (in place if empty)"),
+		cl::init(""), cl::value_desc("directory"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> ManifestOpt("manifest", 
+		cl::desc("File listing the hashes of the inputs and outputs of every file"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> SymbolIndexOpt("symbol-index", 
+		cl::desc("File where the index of the copies and of the original lines of the transformed files is written (for crowbar-symbolize)"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> CacheDirOpt("cache-dir", 
+		cl::desc("Directory where the methods and calls found in each source are cached for the next runs"),
+		cl::init(""), cl::value_desc("directory"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<string> TraceOpt("trace", 
+		cl::desc("File where a Chrome trace of the phases of every translation unit is written"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(CrowbarCat));
+
+static cl::opt<int> PrefetchOpt("prefetch", 
+		cl::desc("Number of translation units read ahead of the parser (0 disables it)"),
+		cl::init(4), cl::cat(CrowbarCat));
+
+static cl::opt<int> WriteThreadsOpt("write-threads", 
+		cl::desc("Number of threads writing the output files (0 writes them in order)"),
+		cl::init(4), cl::cat(CrowbarCat));
+
+static cl::opt<VerifyMode> VerifyOpt("verify", 
+		cl::desc("Select which sources are parsed again to check the changes:"),
+		cl::values(
+			clEnumValN(VM_None, "none", "none of them"),
+			clEnumValN(VM_Changed, "changed", "the ones that are or include a changed file"),
+			clEnumValN(VM_All, "all", "all of them"),
+			clEnumValEnd),
+		cl::init(VM_Changed), cl::cat(CrowbarCat));
+
+static cl::opt<int> VerifyThreadsOpt("verify-threads", 
+		cl::desc("Number of processes checking the sources (0 for one per core, 1 checks them in this process)"),
+		cl::init(0), cl::cat(CrowbarCat));
+
 static cl::opt<bool> GenOpt("gen", 
 		cl::desc("Gentlemen"),
 		cl::cat(CrowbarCat));
 
 /*--------------------------------------------------------------------------*/
-/* Print a method and its position in the source file                       */
+/* Parsed arguments shared by all phases                                    */
 /*--------------------------------------------------------------------------*/
-void printMethod(const METHOD* m)
+struct SETTINGS
 {
-	cout << m->name << ',' << m->location.begin 
-		<< '-' << m->location.end << endl;
-}
+	LangOptions lopt;
+	NAMEFILTER* filter;
 
+	int maxselect;
+	int maxredirect;
+	int maxrepeat;
+	int64 maxcallsites;
 
-/*--------------------------------------------------------------------------*/
-/* Print the positions of all method's calls                                */
-/*--------------------------------------------------------------------------*/
-void printCalls(const METHOD* m)
-{
-	cout << m->name;
+	int srseed;
+	int reseed;
+	RedirectMode redirectmode;
+	RedirectPolicy redirectpolicy;
+	bool rngcompat;
 
-	for (const auto& call : m->calls)
-		cout << ',' << call->location.begin << '-' << call->location.end;
+	int split;
+	bool specialize;
+	int smallsize;
+	CLONEOPTIONS copts;
 
-	cout << endl;
-}
+	string outdir;
+	string manifest;
+	string cachedir;
+	string symbolindex;
+
+	int prefetch;
+	int writers;
+
+	VerifyMode verify;
+	int verifythreads;
+
+	bool knr;
+	bool mainonly;
+};
 
 
 /*--------------------------------------------------------------------------*/
@@ -142,6 +347,9 @@ bool tryParseStringArg(string arg, int* v, bool* p)
 	const char* pstart = arg.c_str();
 	const char* pend = pstart + arg.size();
 
+	if (arg.empty())
+		return false;
+
 	if(*(arg.rbegin()) == '%')
 	{
 		*p = true;
@@ -152,6 +360,10 @@ bool tryParseStringArg(string arg, int* v, bool* p)
 		*p = false;
 	}
 
+	// strtol takes an empty number as 0
+	if (pend == pstart)
+		return false;
+
 	char* e;
 	*v = (int)strtol(pstart, &e, 10);
 
@@ -159,6 +371,205 @@ bool tryParseStringArg(string arg, int* v, bool* p)
 }
 
 
+/*--------------------------------------------------------------------------*/
+/* Parse the i/N shard argument, shards are numbered from 0                 */
+/*--------------------------------------------------------------------------*/
+static bool tryParseShard(string arg, int* shard, int* shards)
+{
+	size_t slash = arg.find('/');
+	if (slash == string::npos || slash == 0 || slash + 1 == arg.size())
+		return false;
+
+	bool pc;
+
+	if (!tryParseStringArg(arg.substr(0, slash), shard, &pc) || pc ||
+			!tryParseStringArg(arg.substr(slash + 1), shards, &pc) || pc)
+		return false;
+
+	return *shards > 0 && *shard >= 0 && *shard < *shards;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Parse the class=policy pairs, the classes left out are free              */
+/*--------------------------------------------------------------------------*/
+static bool tryParseClassPolicy(string arg, MethodPolicy* policies)
+{
+	static const char* names[] = { "free", "inlinable", "skip" };
+
+	for (int c = 0; c < MC_Count; c++)
+		policies[c] = MP_Free;
+
+	stringstream sp(arg);
+	string p;
+
+	while (getline(sp, p, ','))
+	{
+		if (p.empty())
+			continue;
+
+		size_t eq = p.find('=');
+		if (eq == string::npos)
+			return false;
+
+		int c = 0, q = 0;
+
+		while (c < MC_Count && p.substr(0, eq) != 
+				MethodClassName((MethodClass)c))
+			c++;
+
+		while (q < 3 && p.substr(eq + 1) != names[q])
+			q++;
+
+		if (c == MC_Count || q == 3)
+			return false;
+
+		policies[c] = (MethodPolicy)q;
+	}
+
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Run all phases over a list of sources                                    */
+/*--------------------------------------------------------------------------*/
+static int runCrowbar(CompilationDatabase& compilations, 
+		const vector<string>& sources, SETTINGS& s)
+{
+	bool repeat = s.maxrepeat > 0 && s.maxselect != 0;
+
+	// The phases only change the files in memory, every tool sees
+	// the changes of the previous ones
+
+	OutputStage output(s.outdir, s.writers);
+	CALLTREE* pTree = NULL;
+
+	// Files written by -split and the source each one came from
+	map<string, string> siblings;
+
+	// The sources are read ahead while the previous ones are parsed
+
+	Prefetcher prefetch(sources, s.prefetch, !s.mainonly, s.lopt);
+
+	// K&R Fix, it is folded into the method pass when there is one,
+	// otherwise only the sources that seem to have K&R are parsed
+
+	if (s.knr && !repeat)
+	{
+		vector<string> knrsources;
+
+		for (const auto& source : sources)
+		{
+			INCLUDEPATHS paths;
+			GetIncludePaths(compilations, source, &paths);
+
+			if (HasKNRHeaders(source, s.lopt, !s.mainonly, paths))
+				knrsources.push_back(source);
+		}
+
+		if (!knrsources.empty())
+		{
+			RefactoringTool tool(compilations, knrsources);
+			assert_phase(FixKNRNotation(tool, &s.lopt, s.mainonly));
+			assert_phase(output.apply(tool.getReplacements()));
+		}
+	}
+	
+	if (repeat)
+	{
+		// Create the tree with the method list
+	
+		RefactoringTool tool(compilations, sources);
+
+		if (s.cachedir.empty())
+		{
+			assert_phase(BuildCallTreeMethods(tool, &s.lopt, s.filter, 
+					s.mainonly, s.knr, &pTree));
+		}
+		else
+		{
+			assert_phase(BuildCallTreeCached(compilations, sources, &s.lopt, 
+					s.filter, s.mainonly, s.knr, s.cachedir, &pTree));
+		}
+
+		pTree->specialize = s.specialize;
+		ClassifyMethods(pTree, s.smallsize);
+
+		// Repeat the methods
+
+		assert_phase(RepeatCallTree(tool, &s.lopt, pTree, s.srseed, 
+				s.maxselect, s.maxrepeat, s.maxcallsites, &s.copts));
+
+		if (s.copts.stream)
+		{
+			// The calls come from the original sources and the files
+			// are written as the copies are generated, the repeated
+			// sources are never held in memory nor parsed
+
+			ClangTool tool2(compilations, sources);
+			assert_phase(StreamCallTree(tool2, &s.lopt, pTree, 
+					tool.getReplacements(), s.reseed, s.maxredirect, 
+					s.redirectmode, s.redirectpolicy, s.rngcompat, &s.copts, 
+					&output));
+
+			return output.commit(sources, s.manifest);
+		}
+
+		assert_phase(output.apply(tool.getReplacements()));
+
+		if (s.maxredirect != 0)
+		{
+			// Fill the tree with the updated call list. The copies of
+			// a definition follow it with the same calls, so the calls
+			// found by the method pass are enough unless the copies
+			// were placed elsewhere
+
+			RefactoringTool tool2(compilations, sources);
+			output.mapFiles(tool2);
+
+			if (s.copts.placement == CP_Original)
+				BuildCallTreeCallFacts(pTree);
+			else
+				assert_phase(BuildCallTreeCalls(tool2, &s.lopt, pTree));
+
+			// Now redirect the calls
+			
+			assert_phase(RedirectCallTree(tool2, &s.lopt, pTree, 
+					s.reseed, s.maxredirect, s.redirectmode, s.redirectpolicy, 
+					s.rngcompat));
+			assert_phase(output.apply(tool2.getReplacements()));
+		}
+
+		if (s.split > 0)
+		{
+			// Move the repetitions to their own translation units
+
+			RefactoringTool tool4(compilations, sources);
+			output.mapFiles(tool4);
+			assert_phase(SplitCallTree(tool4, &s.lopt, pTree, s.split, 
+					&output, &siblings));
+			assert_phase(output.apply(tool4.getReplacements()));
+		}
+	}
+
+	// Check if everything is working, the sources that did not change
+	// parsed fine before
+
+	assert_phase(VerifySources(compilations, sources, siblings, &output, 
+			s.verify, s.verifythreads, s.lopt));
+
+	// The originals are read before the commit overwrites them
+
+	if (!s.symbolindex.empty())
+		assert_phase(AppendSymbolIndex(s.symbolindex, pTree, &output));
+
+	// Only now the changes reach the disk
+
+	return output.commit(sources, s.manifest);
+}
+
+
 /*--------------------------------------------------------------------------*/
 /* main                                                                     */
 /*--------------------------------------------------------------------------*/
@@ -168,7 +579,6 @@ int main(int argc, const char **argv)
 	GenOpt.setHiddenFlag(cl::ReallyHidden);
 
 	CommonOptionsParser optionsParser(argc, argv, CrowbarCat, 0);
-	LangOptions lopt;
 
 	optbase_0();
 
@@ -211,81 +621,254 @@ int main(int argc, const char **argv)
 		return 3;
 	}
 
+	int64 maxcallsites = MaxCallSitesOpt;
+
+	if (maxcallsites < 0)
+	{
+		error("max-callsites is not in a valid number form");
+		return 4;
+	}
+
 	int srseed = SRSeedOpt;
 	int reseed = RESeedOpt;
 	string pattern = SelectOpt;
 
+	// Everything is selected unless some pattern is given, a * would
+	// make the patterns of the select file useless
+
+	if (pattern.empty() && SelectFileOpt.empty())
+		pattern = "*";
+
+	// Compile the method filter
+
+	NAMEFILTER filter;
+
+	stringstream sp(pattern);
+	string p;
+
+	while (getline(sp, p, ','))
+	{
+		if (!p.empty())
+			filter.select.add(p);
+	}
+
+	if (!SelectFileOpt.empty())
+		assert_phase(filter.select.load(SelectFileOpt));
+
+	if (!ExcludeFileOpt.empty())
+		assert_phase(filter.exclude.load(ExcludeFileOpt));
+
+	if (WorkersOpt < 0 || RetriesOpt < 0 || SplitOpt < 0 || 
+			PrefetchOpt < 0 || WriteThreadsOpt < 0 || VerifyThreadsOpt < 0)
+	{
+		error("workers, retries, split, prefetch, write-threads and verify-threads must not be negative");
+		return 3;
+	}
+
+	if (StreamOpt && (SplitOpt > 0 || SpecializeOpt))
+	{
+		error("stream can't be used with split or specialize");
+		return 3;
+	}
+
+	if (ClonePlacementOpt == CP_Caller && (RedirectPolicyOpt != RP_Affinity || 
+			StreamOpt || SplitOpt > 0))
+	{
+		error("clone-placement=caller needs redirect-policy=affinity and can't be used with stream or split");
+		return 3;
+	}
+
+	if (CountersOpt && (StreamOpt || SplitOpt > 0))
+	{
+		error("counters can't be used with stream or split");
+		return 3;
+	}
+
+	if (!SymbolIndexOpt.empty() && StreamOpt)
+	{
+		error("symbol-index can't be used with stream");
+		return 3;
+	}
+
+	// The budget of the total mode would be spent by each worker and
+	// shard on its own sources
+
+	if (RedirectModeOpt == RM_Total && (WorkersOpt > 1 || !ShardOpt.empty()))
+	{
+		error("redirect-mode=total can't be used with workers or shard");
+		return 3;
+	}
+
+	MethodPolicy policies[MC_Count];
+
+	if (!tryParseClassPolicy(ClassPolicyOpt, policies))
+	{
+		error("class-policy is not a list of class=policy pairs");
+		return 3;
+	}
+
+	int shard = 0, shards = 0;
+
+	if (!ShardOpt.empty() && !tryParseShard(ShardOpt, &shard, &shards))
+	{
+		error("shard is not in the i/N form with 0 <= i < N");
+		return 3;
+	}
+
+	if (!TraceOpt.empty())
+		TraceOpen(TraceOpt);
+
+	// Listing is read-only, it does not go through any phase
+
+	if (ListOpt || CallsOpt)
+	{
+		INDEXOPTIONS iopts;
+		iopts.methods = ListOpt;
+		iopts.calls = CallsOpt;
+		iopts.threads = IndexThreadsOpt;
+		iopts.out = IndexOutOpt;
+		iopts.format = IndexFormatOpt;
+
+		LangOptions lopt;
+		int r = IndexSources(compilations, sources, &lopt, &filter, &iopts);
+
+		TraceClose();
+		return r;
+	}
+
+	PROFILE profile;
+
+	if (!ProfileOpt.empty())
+		assert_phase(LoadProfile(ProfileOpt, &profile));
+
+	SETTINGS settings;
+	settings.filter = &filter;
+	settings.maxselect = maxselect;
+	settings.maxredirect = maxredirect;
+	settings.maxrepeat = maxrepeat;
+	settings.maxcallsites = maxcallsites;
+	settings.srseed = srseed;
+	settings.reseed = reseed;
+	settings.redirectmode = RedirectModeOpt;
+	settings.redirectpolicy = RedirectPolicyOpt;
+	settings.rngcompat = RNGCompatOpt;
+	settings.split = SplitOpt;
+	settings.specialize = SpecializeOpt;
+	settings.copts.cold = CloneColdOpt;
+	settings.copts.noinline = CloneNoInlineOpt;
+	settings.copts.section = CloneSectionOpt;
+	settings.copts.original = CloneOriginalOpt;
+	settings.copts.profile = ProfileOpt.empty() ? NULL : &profile;
+	settings.copts.hot = HotThresholdOpt;
+	settings.copts.prototypes = PrototypesOpt;
+	settings.copts.stream = StreamOpt;
+	settings.copts.counters = CountersOpt;
+	settings.copts.placement = ClonePlacementOpt;
+	settings.copts.reseed = reseed;
+	settings.smallsize = SmallSizeOpt;
+
+	for (int c = 0; c < MC_Count; c++)
+		settings.copts.policies[c] = policies[c];
+	settings.knr = KNROpt;
+	settings.mainonly = false;
+	settings.outdir = OutputDirOpt;
+	settings.manifest = ManifestOpt;
+	settings.cachedir = CacheDirOpt;
+	settings.symbolindex = SymbolIndexOpt;
+	settings.prefetch = PrefetchOpt;
+	settings.writers = WriteThreadsOpt;
+	settings.verify = VerifyOpt;
+	settings.verifythreads = VerifyThreadsOpt;
+
 	// Dump the options for the record
 	
-	cout << "!options," 
-		 << (maxselect > 0 ? maxselect : -maxselect) 
-		 << (maxselect > 0 ? "" : "%") << "," 
-		 << (maxredirect > 0 ? maxredirect : -maxredirect) 
-		 << (maxredirect > 0 ? "" : "%") << ","
+	stringstream so;
+	so << "!options," 
+		 << (maxselectpc ? -maxselect : maxselect) 
+		 << (maxselectpc ? "%" : "") << "," 
+		 << (maxredirectpc ? -maxredirect : maxredirect) 
+		 << (maxredirectpc ? "%" : "") << ","
 		 << maxrepeat << "," 
 		 << srseed << ","
 		 << reseed << ","
 		 << pattern << endl;
 
-	// K&R Fix
-	
-	if (KNROpt)
+	if (shards > 0)
+		so << "!shard," << shard << ',' << shards << endl;
+
+	cout << so.str();
+
+	// The manifest records the whole command line, any option may
+	// change the outputs
+
+	if (!settings.manifest.empty())
 	{
-		RefactoringTool tool(compilations, sources);
-		assert_phase(FixKNRNotation(tool, &lopt));
+		unlink((settings.manifest + ".part").c_str());
+
+		so << "!command";
+		for (int i = 0; i < argc; i++)
+			so << ',' << argv[i];
+		so << endl;
 	}
-	
-	if (maxrepeat > 0 && maxselect > 0)
-	{
-		// Create the tree with the method list
-	
-		RefactoringTool tool(compilations, sources);
 
-		CALLTREE* pTree = NULL;
-		assert_phase(BuildCallTreeMethods(tool, &lopt, &pTree));
+	if (!settings.symbolindex.empty())
+		unlink((settings.symbolindex + ".part").c_str());
 
-		// Repeat the methods
+	int result;
+
+	if (shards > 0)
+	{
+		// Every unit is processed on its own so the shards give the
+		// same result as a single run with workers, the position of
+		// a unit in the whole list orders the merged log
 
-		assert_phase(RepeatCallTree(tool, &lopt, pTree, srseed, maxselect, maxrepeat));
+		vector<string> mine;
+		unordered_map<string, size_t> position;
 
-		if (maxredirect > 0)
+		for (size_t i = 0; i < sources.size(); i++)
 		{
-			// Fill the tree with the updated call list
+			if (ShardOf(sources[i], shards) == shard)
+			{
+				mine.push_back(sources[i]);
+				position[sources[i]] = i;
+			}
+		}
 
-			RefactoringTool tool2(compilations, sources);
-			assert_phase(BuildCallTreeCalls(tool2, &lopt, pTree));
+		settings.mainonly = true;
 
-			// Now redirect the calls
-			
-			assert_phase(RedirectCallTree(tool2, &lopt, pTree, reseed, maxredirect));
-		}
+		result = RunWorkers(mine, max((int)WorkersOpt, 1), RetriesOpt, 
+			TimingsOpt, QuarantineOpt, [&](const vector<string>& tu) {
+				cout << "!tu," << position[tu[0]] << ',' << tu[0] << endl;
+				return runCrowbar(compilations, tu, settings);
+			});
 	}
-
-	// List methods
-	
-	/*if (ListOpt)
+	else if (WorkersOpt > 1)
 	{
-		for (const auto& m : pTree->methods)
-			printMethod(m.second);
-	}
+		// Every worker processes a single TU on its own, so headers
+		// are left alone to avoid workers racing to rewrite them
 
-	// List calls
+		settings.mainonly = true;
 
-	if (CallsOpt)
+		result = RunWorkers(sources, WorkersOpt, RetriesOpt, TimingsOpt, 
+			QuarantineOpt, [&](const vector<string>& tu) {
+				return runCrowbar(compilations, tu, settings);
+			});
+	}
+	else
 	{
-		for (const auto& m : pTree->methods)
-		{
-			if (m.second->calls.size() > 0)
-				printCalls(m.second);
-		}
-	}*/
+		result = runCrowbar(compilations, sources, settings);
+	}
+
+	if (!settings.manifest.empty())
+		FinishManifest(settings.manifest, so.str());
 
-	// Check if everything is working
+	if (!settings.symbolindex.empty() && 
+			FinishSymbolIndex(settings.symbolindex))
+		result = 1;
 
-	ClangTool tool3(compilations, sources);
-	MatchFinder matchFinder;
-	assert_tool(tool3.run(newFrontendActionFactory(&matchFinder).get()));
+	TraceClose();
 
-	return 0;
+	return result;
 }
 
+
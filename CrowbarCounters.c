@@ -0,0 +1,56 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* Runtime of the -counters option, link it with the transformed program.
+   The counters of every copy end up in the crowbar_counters section and
+   are appended at exit to the file in CROWBAR_COUNTERS (crowbar.counters
+   by default) as name,count lines, which -profile takes as they are. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+struct crowbar_counter
+{
+	const char* name;
+	unsigned long long count;
+} __attribute__((aligned(16)));
+
+/* Defined by the linker when some object has the section */
+extern struct crowbar_counter __start_crowbar_counters[] __attribute__((weak));
+extern struct crowbar_counter __stop_crowbar_counters[] __attribute__((weak));
+
+static void __attribute__((destructor)) crowbar_dump_counters(void)
+{
+	const char* path = getenv("CROWBAR_COUNTERS");
+	struct crowbar_counter* c;
+	FILE* f;
+
+	if (__start_crowbar_counters == NULL)
+		return;
+
+	if (path == NULL || *path == '\0')
+		path = "crowbar.counters";
+
+	f = fopen(path, "a");
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "[Crowbar] Unable to write the counters to %s\n", path);
+		return;
+	}
+
+	for (c = __start_crowbar_counters; c < __stop_crowbar_counters; c++)
+	{
+		unsigned long long n = __atomic_load_n(&c->count, __ATOMIC_RELAXED);
+
+		if (c->name != NULL && n > 0)
+			fprintf(f, "%s,%llu\n", c->name, n);
+	}
+
+	fclose(f);
+}
@@ -0,0 +1,428 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+// Declares llvm::cl::extrahelp.
+#include "llvm/Support/CommandLine.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "Crowbar.h"
+
+using namespace std;
+using namespace llvm;
+
+/*--------------------------------------------------------------------------*/
+/* Help Setup                                                               */
+/*--------------------------------------------------------------------------*/
+
+static cl::OptionCategory MergeCat("crowbar-merge",
+		"Merge the logs and manifests of the shards of a Crowbar run");
+
+static cl::list<string> LogsOpt(cl::Positional,
+		cl::desc("<shard logs>"),
+		cl::ZeroOrMore, cl::cat(MergeCat));
+
+static cl::opt<string> OutOpt("o",
+		cl::desc("File where the merged log is written (standard output if empty)"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(MergeCat));
+
+static cl::list<string> ManifestOpt("manifest",
+		cl::desc("Manifest of a shard, once for each shard"),
+		cl::value_desc("filename"),
+		cl::ZeroOrMore, cl::cat(MergeCat));
+
+static cl::opt<string> ManifestOutOpt("manifest-out",
+		cl::desc("File where the merged manifest is written"),
+		cl::init(""), cl::value_desc("filename"),
+		cl::cat(MergeCat));
+
+// Log of a translation unit, as it would be in a run with workers
+struct TUBLOCK
+{
+	string source;
+	string text;
+	string from;
+};
+
+// Header lines shared by logs and manifests
+struct SHARDHEADER
+{
+	string path;
+	string options;
+	string command;
+	int shard;
+	int shards;
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Take the !options, !shard and !command lines of a file                   */
+/*--------------------------------------------------------------------------*/
+static bool readHeader(const string& line, SHARDHEADER* header)
+{
+	if (line.compare(0, 9, "!options,") == 0)
+	{
+		header->options = line;
+		return true;
+	}
+
+	if (line.compare(0, 9, "!command,") == 0)
+	{
+		header->command = line;
+		return true;
+	}
+
+	if (line.compare(0, 7, "!shard,") == 0)
+	{
+		if (sscanf(line.c_str() + 7, "%d,%d", &header->shard,
+				&header->shards) != 2)
+		{
+			header->shards = -1;
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* The files must come from the same options and cover every shard once     */
+/*--------------------------------------------------------------------------*/
+static int checkShards(const vector<SHARDHEADER>& headers, const string& kind)
+{
+	int result = 0;
+
+	if (headers.empty())
+		return 0;
+
+	int shards = headers[0].shards;
+	vector<string> seen(shards > 0 ? shards : 0);
+
+	for (auto& h : headers)
+	{
+		if (h.shards <= 0 || h.shard < 0 || h.shard >= h.shards)
+		{
+			error(h.path + " is not the " + kind + " of a shard");
+			result = 1;
+			continue;
+		}
+
+		if (h.options != headers[0].options || h.shards != shards)
+		{
+			error(h.path + " was not made with the options of " +
+					headers[0].path);
+			result = 1;
+			continue;
+		}
+
+		if (!seen[h.shard].empty())
+		{
+			error(h.path + " is the same shard as " + seen[h.shard]);
+			result = 1;
+			continue;
+		}
+
+		seen[h.shard] = h.path;
+	}
+
+	for (size_t s = 0; s < seen.size(); s++)
+	{
+		if (seen[s].empty())
+		{
+			stringstream ss;
+			ss << "The " << kind << " of shard " << s << '/' << shards
+				<< " is missing";
+			error(ss.str());
+			result = 1;
+		}
+	}
+
+	return result;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Split a shard log into the logs of its translation units                 */
+/*--------------------------------------------------------------------------*/
+static int readLog(const string& path, SHARDHEADER* header,
+		map<size_t, TUBLOCK>* blocks)
+{
+	ifstream f(path.c_str(), ios::in | ios::binary);
+
+	if (!f)
+	{
+		error("Unable to read " + path);
+		return 1;
+	}
+
+	header->path = path;
+	header->shard = -1;
+	header->shards = 0;
+
+	TUBLOCK* current = NULL;
+	string line;
+
+	while (getline(f, line))
+	{
+		if (current == NULL && readHeader(line, header))
+			continue;
+
+		if (line.compare(0, 4, "!tu,") == 0)
+		{
+			size_t comma = line.find(',', 4);
+
+			if (comma == string::npos)
+			{
+				error("Malformed unit in " + path + ": " + line);
+				return 1;
+			}
+
+			size_t index = (size_t)strtoull(line.c_str() + 4, NULL, 10);
+			current = &(*blocks)[index];
+
+			if (!current->from.empty())
+			{
+				error(line.substr(comma + 1) + " appears twice in " + path);
+				return 1;
+			}
+
+			current->source = line.substr(comma + 1);
+			current->from = path;
+			continue;
+		}
+
+		// Whatever the coordinator printed before the first unit is
+		// repeated by every shard
+		if (current != NULL)
+			current->text += line + '\n';
+	}
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Merge the shard logs in the order of the whole source list, the result   */
+/* is the log of a single run with workers                                  */
+/*--------------------------------------------------------------------------*/
+static int mergeLogs(const vector<string>& paths, const string& out)
+{
+	vector<SHARDHEADER> headers(paths.size());
+	map<size_t, TUBLOCK> merged;
+	int result = 0;
+
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		map<size_t, TUBLOCK> blocks;
+		assert_phase(readLog(paths[i], &headers[i], &blocks));
+
+		for (auto& b : blocks)
+		{
+			auto m = merged.find(b.first);
+
+			if (m == merged.end())
+			{
+				merged[b.first] = b.second;
+			}
+			else if (m->second.source != b.second.source ||
+					m->second.text != b.second.text)
+			{
+				error("Conflicting logs for " + b.second.source + " in " +
+						m->second.from + " and " + b.second.from);
+				result = 1;
+			}
+		}
+	}
+
+	assert_phase(checkShards(headers, "log"));
+
+	if (result)
+		return result;
+
+	stringstream ss;
+	ss << headers[0].options << '\n';
+
+	for (auto& b : merged)
+		ss << b.second.text;
+
+	if (out.empty())
+	{
+		cout << ss.str();
+		cout.flush();
+		return 0;
+	}
+
+	ofstream f(out.c_str(), ios::out | ios::binary | ios::trunc);
+	f << ss.str();
+
+	if (!f)
+	{
+		error("Unable to write " + out);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* The command line of the shards without the shard argument                */
+/*--------------------------------------------------------------------------*/
+static string stripShard(const string& command)
+{
+	stringstream sc(command);
+	string arg, result;
+	bool skip = false;
+
+	while (getline(sc, arg, ','))
+	{
+		if (skip)
+		{
+			skip = false;
+			continue;
+		}
+
+		if (arg == "-shard" || arg == "--shard")
+		{
+			skip = true;
+			continue;
+		}
+
+		if (arg.compare(0, 7, "-shard=") == 0 ||
+				arg.compare(0, 8, "--shard=") == 0)
+			continue;
+
+		result += result.empty() ? arg : "," + arg;
+	}
+
+	return result;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Merge the shard manifests, a file listed by several shards must have     */
+/* the same input and output in all of them                                 */
+/*--------------------------------------------------------------------------*/
+static int mergeManifests(const vector<string>& paths, const string& out)
+{
+	vector<SHARDHEADER> headers(paths.size());
+
+	// Entry line and the manifest it came from, by target
+	map<string, pair<string, string> > entries;
+	int result = 0;
+
+	for (size_t i = 0; i < paths.size(); i++)
+	{
+		ifstream f(paths[i].c_str(), ios::in | ios::binary);
+
+		if (!f)
+		{
+			error("Unable to read " + paths[i]);
+			return 1;
+		}
+
+		SHARDHEADER& h = headers[i];
+		h.path = paths[i];
+		h.shard = -1;
+		h.shards = 0;
+
+		string line;
+
+		while (getline(f, line))
+		{
+			if (line.empty() || readHeader(line, &h))
+				continue;
+
+			size_t comma = line.find(',');
+			string target = line.substr(0, comma);
+
+			auto e = entries.find(target);
+
+			if (e == entries.end())
+			{
+				entries[target] = make_pair(line, paths[i]);
+			}
+			else if (e->second.first != line)
+			{
+				error("Conflicting edits to " + target + " in " +
+						e->second.second + " and " + paths[i]);
+				result = 1;
+			}
+		}
+	}
+
+	assert_phase(checkShards(headers, "manifest"));
+
+	if (result)
+		return result;
+
+	vector<string> lines;
+	for (auto& e : entries)
+		lines.push_back(e.second.first);
+
+	sort(lines.begin(), lines.end());
+
+	ofstream f(out.c_str(), ios::out | ios::binary | ios::trunc);
+	f << headers[0].options << '\n';
+
+	if (!headers[0].command.empty())
+		f << stripShard(headers[0].command) << '\n';
+
+	for (auto& l : lines)
+		f << l << '\n';
+
+	if (!f)
+	{
+		error("Unable to write " + out);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* main                                                                     */
+/*--------------------------------------------------------------------------*/
+
+int main(int argc, const char **argv)
+{
+	cl::ParseCommandLineOptions(argc, argv,
+			"Merge the logs and manifests of the shards of a Crowbar run\n");
+
+	if (LogsOpt.empty() && ManifestOpt.empty())
+	{
+		error("Nothing to merge, give the shard logs or manifests");
+		return 3;
+	}
+
+	if (!ManifestOpt.empty() && ManifestOutOpt.empty())
+	{
+		error("manifest needs manifest-out");
+		return 3;
+	}
+
+	if (!LogsOpt.empty())
+		assert_phase(mergeLogs(LogsOpt, OutOpt));
+
+	if (!ManifestOpt.empty())
+		assert_phase(mergeManifests(ManifestOpt, ManifestOutOpt));
+
+	return 0;
+}
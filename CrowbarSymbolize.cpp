@@ -0,0 +1,438 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+// Declares llvm::cl::extrahelp.
+#include "llvm/Support/CommandLine.h"
+
+#include <cstdlib>
+#include <cctype>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "Crowbar.h"
+#include "SymbolIndex.h"
+
+using namespace std;
+using namespace llvm;
+
+/*--------------------------------------------------------------------------*/
+/* Help Setup                                                               */
+/*--------------------------------------------------------------------------*/
+
+static cl::OptionCategory SymbolizeCat("crowbar-symbolize",
+		"Map the copies and transformed lines in stack traces back to the original sources");
+
+static cl::list<string> InputsOpt(cl::Positional,
+		cl::desc("<reports> (standard input if none)"),
+		cl::ZeroOrMore, cl::cat(SymbolizeCat));
+
+static cl::list<string> IndexOpt("index",
+		cl::desc("Index written by -symbol-index, once for each index (shards)"),
+		cl::value_desc("filename"),
+		cl::OneOrMore, cl::cat(SymbolizeCat));
+
+static cl::opt<string> OutputDirOpt("output-dir",
+		cl::desc("Directory where each rewritten report is written (standard output if empty)"),
+		cl::init(""), cl::value_desc("directory"),
+		cl::cat(SymbolizeCat));
+
+// The words of the index are little endian whatever the host is
+static uint32_t le32(uint32_t w)
+{
+	const unsigned char* b = (const unsigned char*)&w;
+	return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 | 
+		(uint32_t)b[3] << 24;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* An index mapped in memory, searched in place                             */
+/*--------------------------------------------------------------------------*/
+class MappedIndex
+{
+private:
+
+	const char* base;
+	size_t size;
+
+	const SYMINDEXHEADER* header;
+	const SYMINDEXFILE* files;
+	const SYMINDEXRUN* runs;
+	const SYMINDEXSYMBOL* symbols;
+	const char* strings;
+
+public:
+
+	MappedIndex() :
+		base(NULL),
+		size(0)
+	{
+	}
+
+	~MappedIndex()
+	{
+		if (this->base != NULL)
+			munmap((void*)this->base, this->size);
+	}
+
+	int open(const string& path)
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		struct stat st;
+
+		if (fd < 0 || fstat(fd, &st) != 0)
+		{
+			error("Unable to open index " + path);
+
+			if (fd >= 0)
+				close(fd);
+
+			return 1;
+		}
+
+		this->size = (size_t)st.st_size;
+
+		void* p = this->size < sizeof(SYMINDEXHEADER) ? MAP_FAILED :
+			mmap(NULL, this->size, PROT_READ, MAP_SHARED, fd, 0);
+
+		close(fd);
+
+		if (p == MAP_FAILED)
+		{
+			error(path + " is not a symbol index");
+			return 1;
+		}
+
+		this->base = (const char*)p;
+		this->header = (const SYMINDEXHEADER*)p;
+
+		const SYMINDEXHEADER* h = this->header;
+		size_t need = sizeof(SYMINDEXHEADER) +
+			(size_t)le32(h->files) * sizeof(SYMINDEXFILE) +
+			(size_t)le32(h->runs) * sizeof(SYMINDEXRUN) +
+			(size_t)le32(h->symbols) * sizeof(SYMINDEXSYMBOL) + 
+			le32(h->strings);
+
+		if (memcmp(h->magic, SYMINDEX_MAGIC, 4) != 0 ||
+				le32(h->version) != SYMINDEX_VERSION || need != this->size ||
+				le32(h->strings) == 0 || this->base[this->size - 1] != '\0')
+		{
+			error(path + " is not a symbol index of this version");
+			return 1;
+		}
+
+		this->files = (const SYMINDEXFILE*)(h + 1);
+		this->runs = (const SYMINDEXRUN*)(this->files + le32(h->files));
+		this->symbols = (const SYMINDEXSYMBOL*)(this->runs + le32(h->runs));
+		this->strings = (const char*)(this->symbols + le32(h->symbols));
+
+		return 0;
+	}
+
+	// String at an offset, as it is stored in the index
+	const char* str(uint32_t word) const
+	{
+		uint32_t offset = le32(word);
+		return offset < le32(this->header->strings) ? 
+			this->strings + offset : "";
+	}
+
+	// First copy with the name, NULL if it is not a copy
+	const SYMINDEXSYMBOL* findSymbol(const string& name) const
+	{
+		const SYMINDEXSYMBOL* b = this->symbols;
+		const SYMINDEXSYMBOL* e = b + le32(this->header->symbols);
+
+		auto s = lower_bound(b, e, name,
+			[this](const SYMINDEXSYMBOL& s, const string& n) {
+				return strcmp(this->str(s.clone), n.c_str()) < 0;
+			});
+
+		return s != e && name == this->str(s->clone) ? s : NULL;
+	}
+
+	// The file with the path, or whose path ends with it
+	const SYMINDEXFILE* findFile(const string& path) const
+	{
+		const SYMINDEXFILE* b = this->files;
+		const SYMINDEXFILE* e = b + le32(this->header->files);
+
+		auto f = lower_bound(b, e, path,
+			[this](const SYMINDEXFILE& f, const string& p) {
+				return strcmp(this->str(f.path), p.c_str()) < 0;
+			});
+
+		if (f != e && path == this->str(f->path))
+			return f;
+
+		string tail = "/" + path;
+
+		for (f = b; f != e; ++f)
+		{
+			const char* p = this->str(f->path);
+			size_t n = strlen(p);
+
+			if (n > tail.size() && tail == p + n - tail.size())
+				return f;
+		}
+
+		return NULL;
+	}
+
+	// Original of a line of a transformed file, false if it has none
+	bool mapLine(const SYMINDEXFILE* f, uint32_t line, const char** path,
+			uint32_t* origline) const
+	{
+		const SYMINDEXRUN* b = this->runs + le32(f->first);
+		const SYMINDEXRUN* e = b + le32(f->count);
+
+		auto r = upper_bound(b, e, line,
+			[](uint32_t l, const SYMINDEXRUN& r) { return l < le32(r.line); });
+
+		if (r == b)
+			return false;
+
+		--r;
+
+		if (le32(r->origline) == 0)
+			return false;
+
+		*path = this->str(r->file);
+		*origline = le32(r->origline);
+
+		if (le32(r->kind) == SR_Exact)
+			*origline += line - le32(r->line);
+
+		return true;
+	}
+};
+
+
+static vector<MappedIndex*> indexes;
+
+// Files found by the paths of the reports, (index, file) pairs
+static unordered_map<string, pair<const MappedIndex*, const SYMINDEXFILE*> >
+	foundFiles;
+
+
+static bool isIdent(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write a text with the names of the copies replaced by their originals    */
+/*--------------------------------------------------------------------------*/
+static void writeNames(ostream& out, const string& text)
+{
+	size_t i = 0;
+
+	while (i < text.size())
+	{
+		if (!isIdent(text[i]))
+		{
+			out << text[i++];
+			continue;
+		}
+
+		size_t j = i;
+		while (j < text.size() && isIdent(text[j]))
+			j++;
+
+		string name = text.substr(i, j - i);
+		const SYMINDEXSYMBOL* s = NULL;
+
+		// Only rN_ names can be copies
+		if (name.size() > 3 && name[0] == 'r' && isdigit(name[1]))
+		{
+			for (auto x : indexes)
+			{
+				s = x->findSymbol(name);
+
+				if (s != NULL)
+				{
+					out << x->str(s->original);
+					break;
+				}
+			}
+		}
+
+		if (s == NULL)
+			out << name;
+
+		i = j;
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write a path:line[:column] word with the original path and line, false   */
+/* if it is not the location of a transformed file                          */
+/*--------------------------------------------------------------------------*/
+static bool writeLocation(ostream& out, const string& word)
+{
+	size_t colon = word.find(':');
+
+	while (colon != string::npos && (colon == 0 || colon + 1 >= word.size() ||
+				!isdigit(word[colon + 1])))
+		colon = word.find(':', colon + 1);
+
+	if (colon == string::npos)
+		return false;
+
+	string path = word.substr(0, colon);
+
+	auto f = foundFiles.find(path);
+
+	if (f == foundFiles.end())
+	{
+		pair<const MappedIndex*, const SYMINDEXFILE*> found(NULL, NULL);
+
+		for (auto x : indexes)
+		{
+			found.second = x->findFile(path);
+
+			if (found.second != NULL)
+			{
+				found.first = x;
+				break;
+			}
+		}
+
+		f = foundFiles.insert(make_pair(path, found)).first;
+	}
+
+	if (f->second.first == NULL)
+		return false;
+
+	char* end;
+	uint32_t line = (uint32_t)strtoul(word.c_str() + colon + 1, &end, 10);
+
+	const char* origpath;
+	uint32_t origline;
+
+	if (!f->second.first->mapLine(f->second.second, line, &origpath,
+				&origline))
+		return false;
+
+	out << origpath << ':' << origline << end;
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Rewrite a report line by line, the words are split at blanks and at the  */
+/* brackets and quotes that usually surround names and locations            */
+/*--------------------------------------------------------------------------*/
+static void symbolize(istream& in, ostream& out)
+{
+	static const char* delimiters = " \t()[]<>\"'=,";
+	string line;
+
+	while (getline(in, line))
+	{
+		size_t i = 0;
+
+		while (i < line.size())
+		{
+			size_t j = line.find_first_of(delimiters, i);
+
+			if (j == i)
+			{
+				out << line[i++];
+				continue;
+			}
+
+			if (j == string::npos)
+				j = line.size();
+
+			string word = line.substr(i, j - i);
+
+			if (!writeLocation(out, word))
+				writeNames(out, word);
+
+			i = j;
+		}
+
+		out << '\n';
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* main                                                                     */
+/*--------------------------------------------------------------------------*/
+
+int main(int argc, const char **argv)
+{
+	cl::ParseCommandLineOptions(argc, argv,
+			"Map the copies and transformed lines in stack traces back to the original sources\n");
+
+	for (auto& i : IndexOpt)
+	{
+		indexes.push_back(new MappedIndex());
+		assert_phase(indexes.back()->open(i));
+	}
+
+	if (InputsOpt.empty())
+	{
+		symbolize(cin, cout);
+		return 0;
+	}
+
+	int result = 0;
+
+	for (auto& i : InputsOpt)
+	{
+		ifstream in(i.c_str(), ios::in | ios::binary);
+
+		if (!in)
+		{
+			error("Unable to read " + i);
+			result = 1;
+			continue;
+		}
+
+		if (OutputDirOpt.empty())
+		{
+			symbolize(in, cout);
+			continue;
+		}
+
+		string dir = OutputDirOpt;
+		size_t slash = i.rfind('/');
+		string target = dir + "/" +
+			(slash == string::npos ? i : i.substr(slash + 1));
+
+		ofstream out(target.c_str(), ios::out | ios::binary | ios::trunc);
+		symbolize(in, out);
+		out.close();
+
+		if (!out)
+		{
+			error("Unable to write " + target);
+			result = 1;
+		}
+	}
+
+	cout.flush();
+
+	return result;
+}
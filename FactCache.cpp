@@ -0,0 +1,523 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Refactoring.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+#include "Output.h"
+#include "Prefilter.h"
+#include "FactCache.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// Bumped whenever the facts or their layout change
+static const char* cacheVersion = "crowbar-facts 3";
+
+// Hashes of the files already read in this run, most sources share
+// their headers
+static unordered_map<string, string> fileHashes;
+
+
+/*--------------------------------------------------------------------------*/
+/* Strings are written with their length, they span many lines              */
+/*--------------------------------------------------------------------------*/
+static void putString(ostream& out, const string& s)
+{
+	out << s.size() << ':' << s << '\n';
+}
+
+static void putNumber(ostream& out, int64 n)
+{
+	out << n << '\n';
+}
+
+static bool getString(istream& in, string* s)
+{
+	size_t n;
+	char c;
+
+	if (!(in >> n) || !in.get(c) || c != ':')
+		return false;
+
+	s->resize(n);
+
+	if (n > 0 && !in.read(&(*s)[0], n))
+		return false;
+
+	return in.get(c) && c == '\n';
+}
+
+static bool getNumber(istream& in, int64* n)
+{
+	char c;
+	return (in >> *n) && in.get(c) && c == '\n';
+}
+
+template <typename T>
+static bool getValue(istream& in, T* v)
+{
+	int64 n;
+
+	if (!getNumber(in, &n))
+		return false;
+
+	*v = (T)n;
+	return true;
+}
+
+
+static bool readContent(const string& path, string* content)
+{
+	ifstream f(path.c_str(), ios::in | ios::binary);
+	if (!f)
+		return false;
+
+	stringstream ss;
+	ss << f.rdbuf();
+	*content = ss.str();
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Hash of a file, each file is only read once per run                      */
+/*--------------------------------------------------------------------------*/
+static bool hashOf(const string& path, string* hash)
+{
+	auto h = fileHashes.find(path);
+
+	if (h == fileHashes.end())
+	{
+		string content;
+		if (!readContent(path, &content))
+			return false;
+
+		h = fileHashes.insert(make_pair(path, HashContent(content))).first;
+	}
+
+	*hash = h->second;
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Entry of a source, from its content, its compile commands and the        */
+/* options that change what the method pass finds                           */
+/*--------------------------------------------------------------------------*/
+static string entryKey(CompilationDatabase& compilations, 
+		const string& source, bool mainonly, bool knr)
+{
+	string content;
+	if (!readContent(source, &content))
+		return "";
+
+	stringstream key;
+	putString(key, cacheVersion);
+	putString(key, getAbsolutePath(source));
+	putString(key, HashContent(content));
+	putNumber(key, mainonly);
+	putNumber(key, knr);
+
+	for (auto& c : compilations.getCompileCommands(source))
+	{
+		putString(key, c.Directory);
+
+		for (auto& a : c.CommandLine)
+			putString(key, a);
+	}
+
+	return HashContent(key.str());
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write the facts of a source along with the hash of every file it read    */
+/* and the file each of their includes was found in. A new header earlier   */
+/* in the search paths changes what an include finds without changing any   */
+/* file that was read                                                       */
+/*--------------------------------------------------------------------------*/
+static void storeFacts(const string& path, const TUFACTS& f, 
+		const INCLUDEPATHS& paths, const LangOptions* lopt)
+{
+	stringstream out, includes;
+	int64 nincludes = 0;
+
+	putString(out, cacheVersion);
+	putNumber(out, f.files.size());
+
+	for (auto& p : f.files)
+	{
+		string content;
+		if (!readContent(p, &content))
+			return;
+
+		string hash = HashContent(content);
+		fileHashes[p] = hash;
+
+		putString(out, p);
+		putString(out, hash);
+
+		vector<INCLUDE> found;
+		FindIncludes(content, *lopt, &found);
+
+		for (auto& i : found)
+		{
+			string resolved;
+			ResolveInclude(i, p, paths, &resolved);
+
+			putString(includes, p);
+			putString(includes, i.name);
+			putNumber(includes, i.angled);
+			putString(includes, resolved);
+			nincludes++;
+		}
+	}
+
+	putNumber(out, nincludes);
+	out << includes.str();
+
+	putNumber(out, f.methods.size());
+
+	for (auto m : f.methods)
+	{
+		putString(out, m->pre);
+		putString(out, m->name);
+		putString(out, m->post);
+		putString(out, m->proto);
+		putString(out, m->file);
+		putNumber(out, m->location.begin);
+		putNumber(out, m->location.end);
+		putNumber(out, m->body == string::npos ? -1 : (int64)m->body);
+		putNumber(out, m->nodes);
+		putNumber(out, m->inlined);
+		putNumber(out, m->internal);
+		putNumber(out, m->leaf);
+	}
+
+	putNumber(out, f.knrfixes.size());
+
+	for (auto& k : f.knrfixes)
+	{
+		putString(out, k.first);
+		putString(out, k.second.getFilePath().str());
+		putNumber(out, k.second.getOffset());
+		putNumber(out, k.second.getLength());
+		putString(out, k.second.getReplacementText().str());
+	}
+
+	putNumber(out, f.edges.size());
+
+	for (auto& e : f.edges)
+	{
+		putString(out, e.first);
+		putString(out, e.second);
+	}
+
+	putNumber(out, f.firstcalls.size());
+
+	for (auto& c : f.firstcalls)
+	{
+		putString(out, c.first);
+		putNumber(out, c.second.size());
+
+		for (auto& o : c.second)
+		{
+			putString(out, o.first);
+			putNumber(out, o.second);
+		}
+	}
+
+	putNumber(out, f.refs.size());
+
+	for (auto& r : f.refs)
+	{
+		putString(out, r.first);
+		putNumber(out, r.second);
+	}
+
+	putNumber(out, f.direct.size());
+
+	for (auto& d : f.direct)
+	{
+		putString(out, d.first);
+		putNumber(out, d.second);
+	}
+
+	putNumber(out, f.calls.size());
+
+	for (auto& c : f.calls)
+	{
+		putString(out, c.callee);
+		putString(out, c.from);
+		putString(out, c.file);
+		putNumber(out, c.ordinal);
+		putNumber(out, c.main);
+		putNumber(out, c.location.begin);
+		putNumber(out, c.location.end);
+		putNumber(out, c.constants.size());
+
+		for (auto& v : c.constants)
+			putString(out, v);
+	}
+
+	// Other runs may be reading the same entry
+
+	stringstream tmp;
+	tmp << path << ".tmp." << getpid();
+
+	ofstream o(tmp.str().c_str(), ios::out | ios::binary | ios::trunc);
+	o << out.str();
+	o.close();
+
+	if (!o || rename(tmp.str().c_str(), path.c_str()) != 0)
+	{
+		unlink(tmp.str().c_str());
+		error("Unable to write the cache entry " + path);
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Read the facts of a source, false if there are none or any of the files  */
+/* it read has changed                                                      */
+/*--------------------------------------------------------------------------*/
+static bool loadFacts(const string& path, const INCLUDEPATHS& paths, 
+		TUFACTS* f)
+{
+	ifstream in(path.c_str(), ios::in | ios::binary);
+	if (!in)
+		return false;
+
+	string version;
+	int64 n;
+
+	if (!getString(in, &version) || version != cacheVersion || 
+			!getNumber(in, &n))
+		return false;
+
+	for (int64 i = 0; i < n; i++)
+	{
+		string p, hash, current;
+
+		if (!getString(in, &p) || !getString(in, &hash) || 
+				!hashOf(p, &current) || current != hash)
+			return false;
+
+		f->files.push_back(p);
+	}
+
+	// Every include must still find the same file
+
+	if (!getNumber(in, &n))
+		return false;
+
+	for (int64 i = 0; i < n; i++)
+	{
+		string p, stored, resolved;
+		INCLUDE include;
+
+		if (!getString(in, &p) || !getString(in, &include.name) ||
+				!getValue(in, &include.angled) || !getString(in, &stored))
+			return false;
+
+		ResolveInclude(include, p, paths, &resolved);
+
+		if (resolved != stored)
+			return false;
+	}
+
+	if (!getNumber(in, &n))
+		return false;
+
+	bool ok = true;
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		METHOD* m = new METHOD();
+		int64 body;
+
+		ok = getString(in, &m->pre) && getString(in, &m->name) &&
+			getString(in, &m->post) && getString(in, &m->proto) &&
+			getString(in, &m->file) && 
+			getNumber(in, &m->location.begin) && 
+			getNumber(in, &m->location.end) && getNumber(in, &body) &&
+			getValue(in, &m->nodes) && getValue(in, &m->inlined) && 
+			getValue(in, &m->internal) && getValue(in, &m->leaf);
+
+		m->body = body < 0 ? string::npos : (size_t)body;
+		m->sm = NULL;
+		m->addressed = false;
+		m->kind = MC_Other;
+
+		f->methods.push_back(m);
+	}
+
+	ok = ok && getNumber(in, &n);
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		string name, file, text;
+		int64 offset, length;
+
+		ok = getString(in, &name) && getString(in, &file) && 
+			getNumber(in, &offset) && getNumber(in, &length) &&
+			getString(in, &text);
+
+		if (ok)
+		{
+			f->knrfixes.push_back(make_pair(name, Replacement(file, 
+				(unsigned)offset, (unsigned)length, text)));
+		}
+	}
+
+	ok = ok && getNumber(in, &n);
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		pair<string, string> e;
+		ok = getString(in, &e.first) && getString(in, &e.second);
+		f->edges.push_back(e);
+	}
+
+	ok = ok && getNumber(in, &n);
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		string name;
+		int64 k;
+
+		ok = getString(in, &name) && getNumber(in, &k);
+
+		for (int64 j = 0; ok && j < k; j++)
+		{
+			string file;
+			int64 offset;
+
+			ok = getString(in, &file) && getNumber(in, &offset);
+			f->firstcalls[name][file] = offset;
+		}
+	}
+
+	ok = ok && getNumber(in, &n);
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		string name;
+		ok = getString(in, &name) && getValue(in, &f->refs[name]);
+	}
+
+	ok = ok && getNumber(in, &n);
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		string name;
+		ok = getString(in, &name) && getValue(in, &f->direct[name]);
+	}
+
+	ok = ok && getNumber(in, &n);
+
+	for (int64 i = 0; ok && i < n; i++)
+	{
+		CALLFACT c;
+		int64 k;
+
+		ok = getString(in, &c.callee) && getString(in, &c.from) &&
+			getString(in, &c.file) && getValue(in, &c.ordinal) &&
+			getValue(in, &c.main) && getNumber(in, &c.location.begin) &&
+			getNumber(in, &c.location.end) && getNumber(in, &k);
+
+		for (int64 j = 0; ok && j < k; j++)
+		{
+			c.constants.push_back(string());
+			ok = getString(in, &c.constants.back());
+		}
+
+		f->calls.push_back(c);
+	}
+
+	if (!ok)
+	{
+		for (auto m : f->methods)
+			delete m;
+
+		*f = TUFACTS();
+	}
+
+	return ok;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Build the tree from the cached facts of each source, only the ones that  */
+/* changed since they were cached are parsed                                */
+/*--------------------------------------------------------------------------*/
+int BuildCallTreeCached(CompilationDatabase& compilations, 
+		const vector<string>& sources, const LangOptions* lopt, 
+		NAMEFILTER* filter, bool mainonly, bool knr, const string& dir, 
+		CALLTREE** ppTree)
+{
+	vector<TUFACTS> facts(sources.size());
+	vector<TUFACTS*> pfacts;
+	int hits = 0;
+
+	sys::fs::create_directories(dir);
+
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		string key = entryKey(compilations, sources[i], mainonly, knr);
+		string path = dir + "/" + key + ".facts";
+
+		INCLUDEPATHS paths;
+		GetIncludePaths(compilations, sources[i], &paths);
+
+		pfacts.push_back(&facts[i]);
+
+		if (!key.empty() && loadFacts(path, paths, &facts[i]))
+		{
+			hits++;
+			continue;
+		}
+
+		// The filter is applied when the tree is built, so the entry
+		// serves any selection of methods
+
+		ClangTool tool(compilations, vector<string>(1, sources[i]));
+		assert_phase(CollectCallTreeFacts(tool, lopt, NULL, mainonly, knr, 
+				&facts[i]));
+
+		if (!key.empty())
+			storeFacts(path, facts[i], paths, lopt);
+	}
+
+	stringstream ss;
+	ss << "cached facts of " << hits << " of " << sources.size() << 
+		" sources";
+	message(ss.str());
+
+	BuildCallTreeFacts(pfacts, filter, mainonly, ppTree);
+
+	return 0;
+}
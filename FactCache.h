@@ -0,0 +1,29 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+
+#pragma once
+
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Basic/LangOptions.h"
+
+#include <string>
+#include <vector>
+
+#include "CallTree.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace std;
+
+struct NAMEFILTER;
+
+int BuildCallTreeCached(CompilationDatabase& compilations, 
+		const vector<string>& sources, const LangOptions* lopt, 
+		NAMEFILTER* filter, bool mainonly, bool knr, const string& dir, 
+		CALLTREE** ppTree);
@@ -0,0 +1,549 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "clang/AST/ASTContext.h"
+#include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "clang/Basic/SourceManager.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+#include "NameFilter.h"
+#include "LocationCache.h"
+#include "Indexer.h"
+#include "Trace.h"
+#include "Workers.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// Methods and call sites found in one file, the calls are grouped by
+// callee in the order they were first seen
+struct FILEINDEX
+{
+	string path;
+	vector<pair<string, FILERANGE> > methods;
+	vector<pair<string, vector<FILERANGE> > > calls;
+	unordered_map<string, size_t> callees;
+};
+
+// Everything a translation unit found, in the order the files were seen
+struct TUINDEX
+{
+	vector<FILEINDEX> files;
+	unordered_map<string, size_t> paths;
+	bool failed;
+	bool ready;
+};
+
+// Process indexing a translation unit, its records go to a temporary file
+struct INDEXJOB
+{
+	pid_t pid;
+	size_t source;
+	int out;
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Matcher for the methods and calls of a single translation unit           */
+/*--------------------------------------------------------------------------*/
+class IndexFinder : public MatchFinder::MatchCallback
+{
+private:
+
+	NAMEFILTER* filter;
+	LocationCache locations;
+	TUINDEX* index;
+
+	FILEINDEX* getFile(SourceLocation l, SourceManager &sm)
+	{
+		string path = sm.getFilename(sm.getExpansionLoc(l)).str();
+
+		auto f = this->index->paths.find(path);
+		if (f != this->index->paths.end())
+			return &this->index->files[f->second];
+
+		this->index->paths[path] = this->index->files.size();
+		this->index->files.push_back(FILEINDEX());
+		this->index->files.back().path = path;
+		return &this->index->files.back();
+	}
+
+	int runFD(const FunctionDecl *md, SourceManager &sm)
+	{
+		if (md->isImplicit() || sm.isInSystemHeader(md->getLocation()))
+			return 0;
+
+		string name = md->getNameAsString();
+
+		if (!FilterAccepts(this->filter, name))
+			return 0;
+
+		FILERANGE r;
+		this->locations.getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm),
+				FullSourceLoc(md->getLocEnd(), sm), &r.begin, &r.end);
+
+		this->getFile(md->getLocation(), sm)->methods.push_back(
+				make_pair(name, r));
+
+		return 0;
+	}
+
+	int runCE(const CallExpr *md, SourceManager &sm)
+	{
+		const FunctionDecl* dcallee = md->getDirectCallee();
+
+		// Without the whole program at hand, the callees declared
+		// in system headers are taken as the external ones
+		if (dcallee == 0 || sm.isInSystemHeader(md->getLocStart()) ||
+				sm.isInSystemHeader(dcallee->getCanonicalDecl()->getLocation()))
+			return 0;
+
+		string name = dcallee->getNameInfo().getAsString();
+
+		if (!FilterAccepts(this->filter, name))
+			return 0;
+
+		FILERANGE r;
+		this->locations.getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm),
+				FullSourceLoc(md->getLocEnd(), sm), &r.begin, &r.end);
+
+		FILEINDEX* f = this->getFile(md->getLocStart(), sm);
+
+		auto c = f->callees.find(name);
+		if (c == f->callees.end())
+		{
+			f->callees[name] = f->calls.size();
+			f->calls.push_back(make_pair(name, vector<FILERANGE>()));
+			f->calls.back().second.push_back(r);
+		}
+		else
+		{
+			f->calls[c->second].second.push_back(r);
+		}
+
+		return 0;
+	}
+
+public:
+
+	IndexFinder(const LangOptions* lopt, NAMEFILTER* filter,
+			TUINDEX* index) :
+		filter(filter),
+		locations(lopt),
+		index(index)
+	{
+	}
+
+	virtual void onStartOfTranslationUnit()
+	{
+		this->locations.clear();
+	}
+
+	virtual void run(const MatchFinder::MatchResult &Result)
+	{
+		SourceManager &sm = Result.Context->getSourceManager();
+		if (const FunctionDecl *md = Result.Nodes.getNodeAs<clang::FunctionDecl>("id"))
+			this->runFD(md, sm);
+		else if (const CallExpr *md = Result.Nodes.getNodeAs<clang::CallExpr>("id"))
+			this->runCE(md, sm);
+	}
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Compact binary encoding, unsigned LEB128 for every number                */
+/*--------------------------------------------------------------------------*/
+static void writeNumber(ostream& out, uint64_t v)
+{
+	do
+	{
+		unsigned char b = v & 0x7F;
+		v >>= 7;
+		out.put((char)(v ? b | 0x80 : b));
+	}
+	while (v);
+}
+
+static void writeString(ostream& out, const string& s)
+{
+	writeNumber(out, s.size());
+	out.write(s.data(), s.size());
+}
+
+static bool readNumber(const string& in, size_t* p, uint64_t* v)
+{
+	*v = 0;
+
+	for (int shift = 0; *p < in.size() && shift < 64; shift += 7)
+	{
+		unsigned char b = (unsigned char)in[(*p)++];
+		*v |= (uint64_t)(b & 0x7F) << shift;
+
+		if ((b & 0x80) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static bool readString(const string& in, size_t* p, string* s)
+{
+	uint64_t n;
+
+	if (!readNumber(in, p, &n) || n > in.size() - *p)
+		return false;
+
+	*s = in.substr(*p, (size_t)n);
+	*p += (size_t)n;
+	return true;
+}
+
+static bool readRange(const string& in, size_t* p, FILERANGE* r)
+{
+	uint64_t b, e;
+
+	if (!readNumber(in, p, &b) || !readNumber(in, p, &e))
+		return false;
+
+	r->begin = (int64)b;
+	r->end = (int64)e;
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write the index of a file in one of the formats                          */
+/*--------------------------------------------------------------------------*/
+static void writeFile(ostream& out, const FILEINDEX& f,
+		const INDEXOPTIONS* iopts)
+{
+	if (iopts->format == IF_Binary)
+	{
+		out.put('F');
+		writeString(out, f.path);
+
+		for (auto& m : f.methods)
+		{
+			out.put('M');
+			writeString(out, m.first);
+			writeNumber(out, m.second.begin);
+			writeNumber(out, m.second.end);
+		}
+
+		for (auto& c : f.calls)
+		{
+			out.put('C');
+			writeString(out, c.first);
+			writeNumber(out, c.second.size());
+
+			for (auto& r : c.second)
+			{
+				writeNumber(out, r.begin);
+				writeNumber(out, r.end);
+			}
+		}
+
+		return;
+	}
+
+	out << "!file," << f.path << '\n';
+
+	if (!f.methods.empty())
+		out << "!methods\n";
+
+	for (auto& m : f.methods)
+		out << m.first << ',' << m.second.begin << '-' << m.second.end << '\n';
+
+	if (!f.calls.empty())
+		out << "!calls\n";
+
+	for (auto& c : f.calls)
+	{
+		out << c.first;
+
+		for (auto& r : c.second)
+			out << ',' << r.begin << '-' << r.end;
+
+		out << '\n';
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Read back the binary records of a translation unit written by a worker   */
+/*--------------------------------------------------------------------------*/
+static bool readIndex(const string& in, TUINDEX* index)
+{
+	FILEINDEX* f = NULL;
+	size_t p = 0;
+
+	while (p < in.size())
+	{
+		char kind = in[p++];
+
+		if (kind == 'F')
+		{
+			index->files.push_back(FILEINDEX());
+			f = &index->files.back();
+
+			if (!readString(in, &p, &f->path))
+				return false;
+
+			continue;
+		}
+
+		if (f == NULL)
+			return false;
+
+		if (kind == 'M')
+		{
+			pair<string, FILERANGE> m;
+
+			if (!readString(in, &p, &m.first) || !readRange(in, &p, &m.second))
+				return false;
+
+			f->methods.push_back(m);
+		}
+		else if (kind == 'C')
+		{
+			pair<string, vector<FILERANGE> > c;
+			uint64_t n;
+
+			if (!readString(in, &p, &c.first) || !readNumber(in, &p, &n) ||
+					n > in.size() - p)
+				return false;
+
+			c.second.resize((size_t)n);
+
+			for (auto& r : c.second)
+			{
+				if (!readRange(in, &p, &r))
+					return false;
+			}
+
+			f->calls.push_back(c);
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Fork a process to index a single source. ClangTool changes the working   */
+/* directory of the whole process for each compile command, so two tools    */
+/* can't run in threads of the same process                                 */
+/*--------------------------------------------------------------------------*/
+static int spawnIndex(CompilationDatabase& compilations, 
+		const vector<string>& sources, size_t i, const LangOptions* lopt, 
+		NAMEFILTER* filter, const INDEXOPTIONS* iopts, INDEXJOB* job)
+{
+	// The records are written to the file as they are, the output of the
+	// tool is left alone
+
+	int err = ForkCaptured("an index worker", -1, [&](int fd) {
+		TUINDEX index;
+		IndexFinder finder(lopt, filter, &index);
+		MatchFinder matchFinder;
+
+		if (iopts->methods)
+		{
+			matchFinder.addMatcher(functionDecl(isDefinition()).bind("id"),
+					&finder);
+		}
+
+		if (iopts->calls)
+			matchFinder.addMatcher(callExpr().bind("id"), &finder);
+
+		ClangTool tool(compilations, vector<string>(1, sources[i]));
+		int r = tool.run(newTracedActionFactory(&matchFinder, "index").get());
+
+		INDEXOPTIONS binary = *iopts;
+		binary.format = IF_Binary;
+
+		stringstream ss;
+		for (auto& f : index.files)
+			writeFile(ss, f, &binary);
+
+		string records = ss.str();
+
+		for (size_t w = 0; w < records.size() && !r; )
+		{
+			ssize_t n = write(fd, records.data() + w, records.size() - w);
+
+			if (n <= 0)
+				r = 1;
+			else
+				w += (size_t)n;
+		}
+
+		return r == 0 ? 0 : 1;
+	}, &job->pid, &job->out);
+
+	if (err)
+		return err;
+
+	job->source = i;
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* List the methods and call sites of every source without changing any of  */
+/* them. Each worker process parses one translation unit, and the files are */
+/* written in the order of the sources as soon as they are done, a header   */
+/* is only written by the first unit that includes it                       */
+/*--------------------------------------------------------------------------*/
+int IndexSources(CompilationDatabase& compilations,
+		const vector<string>& sources, const LangOptions* lopt,
+		NAMEFILTER* filter, const INDEXOPTIONS* iopts)
+{
+	ofstream fout;
+	ostream* out = &cout;
+
+	if (!iopts->out.empty())
+	{
+		fout.open(iopts->out.c_str(), ios::out | ios::binary | ios::trunc);
+
+		if (!fout)
+		{
+			error("Unable to open index " + iopts->out);
+			return 1;
+		}
+
+		out = &fout;
+	}
+
+	if (iopts->format == IF_Binary)
+	{
+		out->write("CRBI", 4);
+		writeNumber(*out, 1);
+	}
+
+	int nworkers = iopts->threads;
+
+	if (nworkers <= 0)
+		nworkers = (int)thread::hardware_concurrency();
+
+	if (nworkers <= 0)
+		nworkers = 1;
+
+	vector<TUINDEX> results(sources.size());
+
+	for (auto& r : results)
+	{
+		r.failed = false;
+		r.ready = false;
+	}
+
+	vector<INDEXJOB> running;
+	unordered_set<string> written;
+	size_t next = 0, done = 0;
+	int result = 0;
+
+	while (done < sources.size())
+	{
+		while (next < sources.size() && (int)running.size() < nworkers)
+		{
+			INDEXJOB job;
+			assert_phase(spawnIndex(compilations, sources, next, lopt, filter,
+					iopts, &job));
+
+			running.push_back(job);
+			next++;
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid < 0)
+		{
+			error("Lost track of the index workers");
+			return 1;
+		}
+
+		auto j = find_if(running.begin(), running.end(), 
+			[pid](const INDEXJOB& j) { return j.pid == pid; });
+
+		if (j == running.end())
+			continue;
+
+		TUINDEX& finished = results[j->source];
+
+		string records = ReadCaptured(j->out);
+
+		finished.failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0 || 
+			!readIndex(records, &finished);
+		finished.ready = true;
+
+		close(j->out);
+		running.erase(j);
+
+		// Stream the finished units in order
+
+		while (done < sources.size() && results[done].ready)
+		{
+			TUINDEX& index = results[done];
+
+			if (index.failed)
+			{
+				error("Unable to index " + sources[done]);
+				result = 1;
+			}
+
+			for (auto& f : index.files)
+			{
+				if (written.insert(f.path).second)
+					writeFile(*out, f, iopts);
+			}
+
+			out->flush();
+
+			// Nothing else needs it
+			index.files.clear();
+			index.paths.clear();
+
+			done++;
+		}
+	}
+
+	if (iopts->format == IF_Binary)
+		out->put('E');
+
+	out->flush();
+
+	return result;
+}
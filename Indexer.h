@@ -0,0 +1,42 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Basic/LangOptions.h"
+
+#include <string>
+#include <vector>
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace std;
+
+struct NAMEFILTER;
+
+enum IndexFormat
+{
+	IF_Text,
+	IF_Binary,
+};
+
+struct INDEXOPTIONS
+{
+	bool methods;
+	bool calls;
+	int threads;
+
+	// Empty for the standard output
+	string out;
+	IndexFormat format;
+};
+
+int IndexSources(CompilationDatabase& compilations, 
+		const vector<string>& sources, const LangOptions* lopt, 
+		NAMEFILTER* filter, const INDEXOPTIONS* iopts);
@@ -17,8 +17,6 @@
 #include "clang/Lex/Lexer.h"
 #include "clang/Basic/SourceManager.h"
 #include "llvm/Support/CommandLine.h"
-#include "clang/Frontend/TextDiagnosticPrinter.h"
-#include "clang/Rewrite/Core/Rewriter.h"
 
 #include <string>
 #include <iostream>
@@ -27,10 +25,13 @@
 #include <sstream>
 #include <stdlib.h>
 #include <math.h> 
-#include <list>
+#include <string.h>
 
 #include "Crowbar.h"
 #include "CallTree.h"
+#include "KNRConverter.h"
+#include "LocationCache.h"
+#include "Trace.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -40,16 +41,70 @@ using namespace std;
 
 
 /*--------------------------------------------------------------------------*/
-/* Convert a location to the absolute position inside the source file       */
+/* Build the prototype style parameter list of a K&R method definition      */
 /*--------------------------------------------------------------------------*/
-void getAbsoluteLocation(const FullSourceLoc& l, int64* pBegin, int64* pEnd,
-		const LangOptions& lopt);
+bool ConvertKNRHeader(const FunctionDecl *md, SourceManager &sm, 
+		const LangOptions& lopt, LocationCache& locations, string* params)
+{
+	DeclarationNameInfo info = md->getNameInfo();
+
+	FullSourceLoc _e(info.getEndLoc(), sm);
+	FullSourceLoc e(locations.getLocForEndOfToken(_e, sm), sm);
+	FullSourceLoc pb(md->getBody()->getLocStart(), sm);
+
+	// Try to identify K&R, the parameter declarations are the only 
+	// place a ';' can show up between the name and the body
+
+	const char* le = sm.getCharacterData(e);
+	const char* lb = sm.getCharacterData(pb);
+
+	if (lb <= le || memchr(le, ';', lb - le) == NULL)
+		return false;
+	
+	// Deal with it [glasses]
+
+	bool first = true;
+	stringstream ss;
+	ss << " (";
+
+	for (auto& p : md->params())
+	{
+		string pname = p->getNameAsString();
+		TypeSourceInfo* si = p->getTypeSourceInfo();
+
+		if (si == NULL && pname.size() == 0)
+			continue;
+
+		// Holy moly look at dis 1337 stuffz!
+		// I stole it from the guts of clang 
+		// source code...
+
+		string s;
+		QualType t = si->getType();
+		SplitQualType st = t.split();
+		PrintingPolicy pp(lopt);
+		raw_string_ostream sos(s);
+		Twine ph(pname);
+		QualType::print(st.Ty, st.Quals, 
+				sos, pp, ph);
+
+		if (first) first = false;
+		else ss << ", ";
+
+		ss << sos.str();
+	}
+
+	if (md->isVariadic())
+	{
+		ss << ", ...";
+	}
+
+	ss << ")";
+
+	*params = ss.str();
+	return true;
+}
 
-/*--------------------------------------------------------------------------*/
-/* Convert a location to the absolute position inside the source file       */
-/*--------------------------------------------------------------------------*/
-void getAbsoluteLocation(const FullSourceLoc& lb, const FullSourceLoc& le, 
-		int64* pBegin, int64* pEnd, const LangOptions& lopt);
 
 /*--------------------------------------------------------------------------*/
 /* Matcher for the methods                                                  */
@@ -59,7 +114,9 @@ class TreeKNRConverter : public MatchFinder::MatchCallback
 private:
 
 	const LangOptions* lopt;
-	list<Replacement> replacements;
+	bool mainonly;
+	Replacements* replacements;
+	LocationCache locations;
 
 	int runFD(const FunctionDecl *md, SourceManager &sm)
 	{
@@ -71,99 +128,53 @@ private:
 		if (!md->isThisDeclarationADefinition())
 			return 0;
 
-		stringstream ss;
+		if (this->mainonly && !sm.isInMainFile(md->getLocation()))
+			return 0;
+
+		string params;
+		if (!ConvertKNRHeader(md, sm, *this->lopt, this->locations, &params))
+			return 0;
+
 		DeclarationNameInfo info = md->getNameInfo();
 
 		FullSourceLoc b(md->getLocStart(), sm), _e(info.getEndLoc(), sm);
-		FullSourceLoc e(clang::Lexer::getLocForEndOfToken(_e, 0, sm, *this->lopt), sm);
+		FullSourceLoc e(this->locations.getLocForEndOfToken(_e, sm), sm);
 		string pre(sm.getCharacterData(b), sm.getCharacterData(e)-sm.getCharacterData(b));
 
 		Stmt* body = md->getBody();
-		SourceLocation bs = body->getLocStart();
-		SourceLocation ne = body->getLocEnd();
-
-		FullSourceLoc pb(bs, sm), _pe(ne, sm);
-		FullSourceLoc pe(clang::Lexer::getLocForEndOfToken(_pe, 0, sm, *this->lopt), sm);
+		FullSourceLoc pb(body->getLocStart(), sm), _pe(body->getLocEnd(), sm);
+		FullSourceLoc pe(this->locations.getLocForEndOfToken(_pe, sm), sm);
 	
 		string sbody(sm.getCharacterData(pb), sm.getCharacterData(pe)-sm.getCharacterData(pb));
 
-		// Try to identify K&R
-
-		string limbo(sm.getCharacterData(e), sm.getCharacterData(pb)-sm.getCharacterData(e));
-		if (limbo.find(";") == string::npos)
-			return 0;
-		
-		// Deal with it [glasses]
-
-		bool first = true;
-		ss << pre << " (";
+		stringstream ss;
+		ss << pre << params << endl << sbody;
 
-		for (auto& p : md->params())
-		{
-			string pname = p->getNameAsString();
-			TypeSourceInfo* si = p->getTypeSourceInfo();
-	
-			if (si == NULL && pname.size() == 0)
-				continue;
-
-			// Holy moly look at dis 1337 stuffz!
-			// I stole it from the guts of clang 
-			// source code...
-
-			string s;
-			QualType t = si->getType();
-			SplitQualType st = t.split();
-			PrintingPolicy pp(*this->lopt);
-			raw_string_ostream sos(s);
-			Twine ph(pname);
-			QualType::print(st.Ty, st.Quals, 
-					sos, pp, ph);
-
-			/*string ptype = QualType::getAsString(t.split());
-			string paux;
-
-			auto pbrackets = ptype.rfind("[");
-			if (pbrackets != string::npos)
-			{
-				paux = ptype.substr(pbrackets, string::npos);
-				ptype = ptype.substr(0, pbrackets);
-			}*/
-
-			if (first) first = false;
-			else ss << ", ";
-
-			//ss << ptype << ' ' << pname << paux;
-			ss << sos.str();
-		}
-
-		if (md->isVariadic())
-		{
-			ss << ", ...";
-		}
-
-		ss << ")" << endl << sbody;
-
-		FullSourceLoc db(md->getLocStart(), sm), _de(md->getLocEnd(), sm);
-		FullSourceLoc de(clang::Lexer::getLocForEndOfToken(_de, 0, sm, *this->lopt), sm);
+		FullSourceLoc _de(md->getLocEnd(), sm);
+		FullSourceLoc de(this->locations.getLocForEndOfToken(_de, sm), sm);
 		CharSourceRange range = CharSourceRange::
 			getTokenRange(SourceRange(md->getLocStart(), de));
 
 		string prototype = ss.str();
-		this->replacements.push_front(Replacement(sm, range, prototype));
+		this->replacements->insert(Replacement(sm, range, prototype));
 
 		return 0;
 	}
 
 public:
 
-	TreeKNRConverter(const LangOptions* lopt) : 
-		lopt(lopt)
+	TreeKNRConverter(const LangOptions* lopt, bool mainonly, 
+			Replacements* repl) : 
+		lopt(lopt),
+		mainonly(mainonly),
+		replacements(repl),
+		locations(lopt)
 	{
 	}
 
-	const list<Replacement>& getReplacements()
+	virtual void onStartOfTranslationUnit()
 	{
-		return this->replacements;
+		this->locations.clear();
 	}
 
 	virtual void run(const MatchFinder::MatchResult &Result) 
@@ -178,39 +189,15 @@ public:
 /*--------------------------------------------------------------------------*/
 /* Repeat the methods in the tree                                           */
 /*--------------------------------------------------------------------------*/
-int FixKNRNotation(RefactoringTool& tool, const LangOptions* lopt)
+int FixKNRNotation(RefactoringTool& tool, const LangOptions* lopt, bool mainonly)
 {
 	MatchFinder matchFinder;
-	TreeKNRConverter treeConverter(lopt);
+	TreeKNRConverter treeConverter(lopt, mainonly, &tool.getReplacements());
 
 	DeclarationMatcher methodMatcher = functionDecl().bind("id");
 	matchFinder.addMatcher(methodMatcher, &treeConverter);
 
-	assert_tool(tool.run(newFrontendActionFactory(&matchFinder).get()));
-
-	IntrusiveRefCntPtr<DiagnosticOptions> DiagOpts = new DiagnosticOptions();
-	TextDiagnosticPrinter DiagnosticPrinter(llvm::errs(), &*DiagOpts);
-	DiagnosticsEngine Diagnostics(
-			IntrusiveRefCntPtr<DiagnosticIDs>(new DiagnosticIDs()),
-			&*DiagOpts, &DiagnosticPrinter, false);
-	SourceManager Sources(Diagnostics, tool.getFiles());
-	Rewriter Rewrite(Sources, *lopt);
-
-	bool result = true;
-	auto replacements = treeConverter.getReplacements();
-	for (auto r = replacements.crbegin(); r != replacements.crend(); r++)
-	{
-		if (r->isApplicable())
-			result = r->apply(Rewrite) && result;
-		else 
-			result = false;
-	}
-
-	if (!result)
-		error("Failed to apply replacements!");
-
-	if (Rewrite.overwriteChangedFiles())
-		error("Failed to update sources!");
+	assert_tool(tool.run(newTracedActionFactory(&matchFinder, "knr").get()));
 
 	return 0;
 }
@@ -29,6 +29,7 @@
 
 #include "Crowbar.h"
 #include "CallTree.h"
+#include "LocationCache.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -36,4 +37,6 @@ using namespace clang::tooling;
 using namespace llvm;
 using namespace std;
 
-int FixKNRNotation(RefactoringTool& tool, const LangOptions* lopt);
+bool ConvertKNRHeader(const FunctionDecl *md, SourceManager &sm, 
+		const LangOptions& lopt, LocationCache& locations, string* params);
+int FixKNRNotation(RefactoringTool& tool, const LangOptions* lopt, bool mainonly);
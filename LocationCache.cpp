@@ -0,0 +1,150 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Lex/Lexer.h"
+#include "clang/Basic/CharInfo.h"
+#include "clang/Basic/SourceManager.h"
+
+#include <unordered_map>
+
+#include "LocationCache.h"
+
+using namespace clang;
+using namespace std;
+
+
+LocationCache::LocationCache(const LangOptions* lopt) : 
+	lopt(lopt),
+	sm(NULL)
+{
+}
+
+
+void LocationCache::clear()
+{
+	this->sm = NULL;
+	this->starts.clear();
+	this->lengths.clear();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* FileIDs and locations only mean something inside their source manager    */
+/*--------------------------------------------------------------------------*/
+void LocationCache::check(const SourceManager& sm)
+{
+	if (this->sm != &sm)
+	{
+		this->clear();
+		this->sm = &sm;
+	}
+}
+
+
+const char* LocationCache::getFileStart(FileID f, const SourceManager& sm)
+{
+	auto s = this->starts.find(f.getHashValue());
+	if (s != this->starts.end())
+		return s->second;
+
+	const char* p = sm.getCharacterData(sm.getLocForStartOfFile(f));
+	this->starts[f.getHashValue()] = p;
+	return p;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Length of the token at a file location, identifiers and closing          */
+/* punctuation (which end almost every range we care about) are measured    */
+/* directly, anything else goes through the lexer                           */
+/*--------------------------------------------------------------------------*/
+unsigned LocationCache::measureToken(SourceLocation l, const SourceManager& sm)
+{
+	auto m = this->lengths.find(l.getRawEncoding());
+	if (m != this->lengths.end())
+		return m->second;
+
+	const char* p = sm.getCharacterData(l);
+	unsigned n = 0;
+
+	if (isIdentifierHead(*p))
+	{
+		const char* q = p + 1;
+
+		while (isIdentifierBody(*q))
+			q++;
+
+		// Line splices, UCNs and the like need the real lexer, and so 
+		// do the prefixes of literals (L"", u8"", u'', R"()")
+		if (*q != '\\' && *q != '$' && *q != '"' && *q != '\'' && 
+				isASCII(*q))
+			n = (unsigned)(q - p);
+	}
+	else if (*p == ')' || *p == ']' || *p == '}' || *p == ';' || *p == ',')
+	{
+		n = 1;
+	}
+
+	if (n == 0)
+		n = Lexer::MeasureTokenLength(l, sm, *this->lopt);
+
+	this->lengths[l.getRawEncoding()] = n;
+	return n;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Same as Lexer::getLocForEndOfToken with no offset                        */
+/*--------------------------------------------------------------------------*/
+SourceLocation LocationCache::getLocForEndOfToken(SourceLocation l, 
+		const SourceManager& sm)
+{
+	// Macro locations are rare enough to go straight to the lexer
+	if (l.isInvalid() || l.isMacroID())
+		return Lexer::getLocForEndOfToken(l, 0, sm, *this->lopt);
+
+	this->check(sm);
+
+	unsigned n = this->measureToken(l, sm);
+	return n == 0 ? l : l.getLocWithOffset(n);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Convert a location to the absolute position inside the source file       */
+/*--------------------------------------------------------------------------*/
+void LocationCache::getAbsoluteLocation(const FullSourceLoc& l, 
+		int64* pBegin, int64* pEnd)
+{
+	SourceRange lr = SourceRange(l);
+	this->getAbsoluteLocation(FullSourceLoc(lr.getBegin(), l.getManager()), 
+			FullSourceLoc(lr.getEnd(), l.getManager()), pBegin, pEnd);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Convert a range to the absolute position inside the source file, both    */
+/* ends are resolved against the same cached file start                     */
+/*--------------------------------------------------------------------------*/
+void LocationCache::getAbsoluteLocation(const FullSourceLoc& lb, 
+		const FullSourceLoc& le, int64* pBegin, int64* pEnd)
+{
+	const SourceManager& sm = lb.getManager();
+	this->check(sm);
+
+	// I need to know the starting point of the file
+	const char* fstart = this->getFileStart(lb.getFileID(), sm);
+
+	SourceLocation e = this->getLocForEndOfToken(le, sm);
+
+	const char* lbegin = sm.getCharacterData(lb);
+	const char* lend = sm.getCharacterData(e);
+
+	*pBegin = (int64)(lbegin-fstart);
+	*pEnd = (int64)(lend-fstart);
+}
@@ -0,0 +1,53 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Basic/LangOptions.h"
+#include "clang/Basic/SourceManager.h"
+
+#include <unordered_map>
+
+using namespace clang;
+using namespace std;
+
+typedef int64_t int64;
+
+// Token ends and file starts already resolved for the source manager of 
+// the current translation unit, so the same location is never relexed. 
+// It must be cleared when a new translation unit starts. Each matcher
+// owns one, the phases parse different buffers with their own source 
+// managers so nothing could be shared between them anyway
+class LocationCache
+{
+private:
+
+	const LangOptions* lopt;
+	const SourceManager* sm;
+
+	unordered_map<unsigned, const char*> starts;
+	unordered_map<unsigned, unsigned> lengths;
+
+	void check(const SourceManager& sm);
+	const char* getFileStart(FileID f, const SourceManager& sm);
+	unsigned measureToken(SourceLocation l, const SourceManager& sm);
+
+public:
+
+	LocationCache(const LangOptions* lopt);
+
+	void clear();
+
+	SourceLocation getLocForEndOfToken(SourceLocation l, 
+			const SourceManager& sm);
+
+	void getAbsoluteLocation(const FullSourceLoc& l, int64* pBegin, 
+			int64* pEnd);
+	void getAbsoluteLocation(const FullSourceLoc& lb, const FullSourceLoc& le, 
+			int64* pBegin, int64* pEnd);
+};
@@ -0,0 +1,317 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "Crowbar.h"
+#include "NameFilter.h"
+
+using namespace std;
+
+// Past this number of states the DFA stops growing and the remaining
+// transitions are simulated directly on the NFA
+#define MAX_DFA_STATES 65536
+
+
+NameMatcher::NameMatcher() : all(false), nclasses(1)
+{
+	for (int i = 0; i < 256; i++)
+		this->classes[i] = 0;
+
+	this->newNode();
+}
+
+
+int NameMatcher::newNode()
+{
+	NODE n;
+	n.any = -1;
+	n.star = -1;
+	n.loop = false;
+	n.accept = false;
+
+	this->nodes.push_back(n);
+	return (int)this->nodes.size() - 1;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Insert a pattern in the trie, patterns share their common prefixes       */
+/*--------------------------------------------------------------------------*/
+void NameMatcher::add(const string& pattern)
+{
+	if (pattern == "*")
+		this->all = true;
+
+	int n = 0;
+
+	for (size_t i = 0; i < pattern.size(); i++)
+	{
+		unsigned char c = (unsigned char)pattern[i];
+
+		if (c == '*')
+		{
+			// Consecutive stars are the same star
+			if (this->nodes[n].loop)
+				continue;
+
+			if (this->nodes[n].star == -1)
+			{
+				int s = this->newNode();
+				this->nodes[s].loop = true;
+				this->nodes[n].star = s;
+			}
+
+			n = this->nodes[n].star;
+		}
+		else if (c == '?')
+		{
+			if (this->nodes[n].any == -1)
+			{
+				int s = this->newNode();
+				this->nodes[n].any = s;
+			}
+
+			n = this->nodes[n].any;
+		}
+		else
+		{
+			auto e = this->nodes[n].next.find(c);
+			if (e == this->nodes[n].next.end())
+			{
+				int s = this->newNode();
+				this->nodes[n].next[c] = s;
+
+				if (this->classes[c] == 0)
+					this->classes[c] = this->nclasses++;
+
+				n = s;
+			}
+			else
+			{
+				n = e->second;
+			}
+		}
+	}
+
+	this->nodes[n].accept = true;
+
+	// The alphabet or the NFA changed, so the DFA is rebuilt from scratch
+	this->states.clear();
+	this->sets.clear();
+	this->accepting.clear();
+	this->table.clear();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Load patterns from a file, one per line, # starts a comment              */
+/*--------------------------------------------------------------------------*/
+int NameMatcher::load(const string& path)
+{
+	ifstream f(path.c_str());
+
+	if (!f)
+	{
+		error("Unable to open pattern file " + path);
+		return 1;
+	}
+
+	string line;
+	while (getline(f, line))
+	{
+		size_t b = line.find_first_not_of(" \t\r");
+		if (b == string::npos || line[b] == '#')
+			continue;
+
+		size_t e = line.find_last_not_of(" \t\r");
+		this->add(line.substr(b, e - b + 1));
+	}
+
+	return 0;
+}
+
+
+bool NameMatcher::empty() const
+{
+	return this->nodes.size() == 1 && !this->nodes[0].accept;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Stars match the empty string, so entering a node also enters its star    */
+/*--------------------------------------------------------------------------*/
+void NameMatcher::closure(vector<int>& s) const
+{
+	for (size_t i = 0; i < s.size(); i++)
+	{
+		int t = this->nodes[s[i]].star;
+		if (t != -1 && find(s.begin(), s.end(), t) == s.end())
+			s.push_back(t);
+	}
+
+	sort(s.begin(), s.end());
+}
+
+
+int NameMatcher::getState(vector<int>& s)
+{
+	auto e = this->states.find(s);
+	if (e != this->states.end())
+		return e->second;
+
+	if ((int)this->sets.size() >= MAX_DFA_STATES)
+		return -1;
+
+	bool accept = false;
+	for (int n : s)
+		accept = accept || this->nodes[n].accept;
+
+	int d = (int)this->sets.size();
+	this->states[s] = d;
+	this->sets.push_back(s);
+	this->accepting.push_back(accept);
+	this->table.resize(this->table.size() + this->nclasses, -2);
+
+	return d;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Advance the DFA state d through c, -1 is the dead state                  */
+/*--------------------------------------------------------------------------*/
+int NameMatcher::step(int d, unsigned char c)
+{
+	int k = this->classes[c];
+	int& t = this->table[d * this->nclasses + k];
+
+	if (t != -2)
+		return t;
+
+	vector<int> s;
+
+	for (int n : this->sets[d])
+	{
+		const NODE& node = this->nodes[n];
+
+		// Class 0 groups every character that no pattern spells
+		if (k != 0)
+		{
+			auto e = node.next.find(c);
+			if (e != node.next.end())
+				s.push_back(e->second);
+		}
+
+		if (node.any != -1)
+			s.push_back(node.any);
+
+		if (node.loop)
+			s.push_back(n);
+	}
+
+	sort(s.begin(), s.end());
+	s.erase(unique(s.begin(), s.end()), s.end());
+	this->closure(s);
+
+	int r = s.empty() ? -1 : this->getState(s);
+
+	// Careful, getState may have moved the table
+	if (r != -1 || s.empty())
+		this->table[d * this->nclasses + k] = r;
+
+	return r == -1 && !s.empty() ? -3 : r;
+}
+
+
+bool NameMatcher::matches(const string& name)
+{
+	if (this->all)
+		return true;
+
+	if (this->sets.empty())
+	{
+		vector<int> s(1, 0);
+		this->closure(s);
+		this->getState(s);
+	}
+
+	int d = 0;
+	size_t i = 0;
+
+	for (; i < name.size(); i++)
+	{
+		int t = this->step(d, (unsigned char)name[i]);
+
+		if (t == -1)
+			return false;
+
+		if (t == -3)
+			break;
+
+		d = t;
+	}
+
+	if (i == name.size())
+		return this->accepting[d];
+
+	// Out of DFA states, finish the match on the NFA
+
+	vector<int> s = this->sets[d];
+
+	for (; i < name.size() && !s.empty(); i++)
+	{
+		unsigned char c = (unsigned char)name[i];
+		vector<int> t;
+
+		for (int n : s)
+		{
+			const NODE& node = this->nodes[n];
+
+			auto e = node.next.find(c);
+			if (e != node.next.end())
+				t.push_back(e->second);
+
+			if (node.any != -1)
+				t.push_back(node.any);
+
+			if (node.loop)
+				t.push_back(n);
+		}
+
+		sort(t.begin(), t.end());
+		t.erase(unique(t.begin(), t.end()), t.end());
+		this->closure(t);
+		s.swap(t);
+	}
+
+	for (int n : s)
+		if (this->nodes[n].accept)
+			return true;
+
+	return false;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* An empty select list selects everything                                  */
+/*--------------------------------------------------------------------------*/
+bool FilterAccepts(NAMEFILTER* filter, const string& name)
+{
+	if (filter == NULL)
+		return true;
+
+	if (!filter->select.empty() && !filter->select.matches(name))
+		return false;
+
+	return filter->exclude.empty() || !filter->exclude.matches(name);
+}
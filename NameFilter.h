@@ -0,0 +1,73 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/* Set of glob patterns (* and ?) compiled into a single automaton, the     */
+/* DFA is built lazily from the NFA so it is not safe to share between      */
+/* threads, make a copy instead                                             */
+/*--------------------------------------------------------------------------*/
+class NameMatcher
+{
+private:
+
+	struct NODE
+	{
+		map<unsigned char, int> next;
+		int any;
+		int star;
+		bool loop;
+		bool accept;
+	};
+
+	vector<NODE> nodes;
+	bool all;
+
+	// Lazy DFA over compressed character classes
+
+	int classes[256];
+	int nclasses;
+
+	map<vector<int>, int> states;
+	vector<vector<int> > sets;
+	vector<bool> accepting;
+	vector<int> table;
+
+	int newNode();
+	void closure(vector<int>& s) const;
+	int getState(vector<int>& s);
+	int step(int d, unsigned char c);
+
+public:
+
+	NameMatcher();
+
+	void add(const string& pattern);
+	int load(const string& path);
+
+	bool empty() const;
+	bool matches(const string& name);
+};
+
+/*--------------------------------------------------------------------------*/
+/* Methods are accepted when selected and not excluded                      */
+/*--------------------------------------------------------------------------*/
+struct NAMEFILTER
+{
+	NameMatcher select;
+	NameMatcher exclude;
+};
+
+bool FilterAccepts(NAMEFILTER* filter, const string& name);
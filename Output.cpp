@@ -0,0 +1,661 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Refactoring.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "Crowbar.h"
+#include "Output.h"
+#include "Trace.h"
+#include "Pipeline.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+
+/*--------------------------------------------------------------------------*/
+/* Read a whole file, false if it could not be read                         */
+/*--------------------------------------------------------------------------*/
+static bool readFile(const string& path, string* content)
+{
+	ifstream f(path.c_str(), ios::in | ios::binary);
+	if (!f)
+		return false;
+
+	stringstream ss;
+	ss << f.rdbuf();
+	*content = ss.str();
+	return true;
+}
+
+
+static string hashResult(MD5& h)
+{
+	MD5::MD5Result r;
+	h.final(r);
+
+	SmallString<32> s;
+	MD5::stringifyResult(r, s);
+	return s.str().str();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* MD5 of a content as an hexadecimal string                                */
+/*--------------------------------------------------------------------------*/
+string HashContent(const string& content)
+{
+	MD5 h;
+	h.update(StringRef(content));
+	return hashResult(h);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* MD5 of a file read in blocks, false if it could not be read              */
+/*--------------------------------------------------------------------------*/
+static bool hashFile(const string& path, string* hash)
+{
+	ifstream f(path.c_str(), ios::in | ios::binary);
+	if (!f)
+		return false;
+
+	MD5 h;
+	char buffer[65536];
+
+	while (f)
+	{
+		f.read(buffer, sizeof(buffer));
+		h.update(StringRef(buffer, (size_t)f.gcount()));
+	}
+
+	*hash = hashResult(h);
+	return true;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* The file a target really is, a symlink is followed so the link is kept   */
+/* and the file it points to is rewritten                                   */
+/*--------------------------------------------------------------------------*/
+static string resolveTarget(const string& path)
+{
+	char* real = realpath(path.c_str(), NULL);
+
+	// Not written yet
+	if (real == NULL)
+		return path;
+
+	string r(real);
+	free(real);
+
+	return r;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Put a temporary file in place of its target. It takes the mode and the   */
+/* owner of the file it replaces, and a file with other hard links is       */
+/* written through instead so every name sees the new content               */
+/*--------------------------------------------------------------------------*/
+static bool replaceFile(const string& tmp, const string& path)
+{
+	struct stat st;
+
+	if (stat(path.c_str(), &st) != 0)
+		return rename(tmp.c_str(), path.c_str()) == 0;
+
+	if (st.st_nlink > 1)
+	{
+		string content;
+		bool ok = readFile(tmp, &content);
+
+		unlink(tmp.c_str());
+
+		if (!ok)
+			return false;
+
+		ofstream f(path.c_str(), ios::out | ios::binary | ios::trunc);
+		f << content;
+		f.close();
+
+		return !f.fail();
+	}
+
+	// Only root can give the file to another user, the mode is kept
+	// either way
+
+	if (chmod(tmp.c_str(), st.st_mode & 07777) != 0)
+		return false;
+
+	int owned = chown(tmp.c_str(), st.st_uid, st.st_gid);
+	(void)owned;
+
+	return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Temporary file next to a target, in its directory                        */
+/*--------------------------------------------------------------------------*/
+static string tempPath(const string& path)
+{
+	StringRef dir = sys::path::parent_path(path);
+	if (!dir.empty())
+		sys::fs::create_directories(dir);
+
+	stringstream ss;
+	ss << path << ".crowbar-tmp." << getpid();
+	return ss.str();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write a file only if its content changes, through a temporary file so    */
+/* readers never see it half written                                        */
+/*--------------------------------------------------------------------------*/
+int WriteIfChanged(const string& _path, const string& content)
+{
+	string current;
+	if (readFile(_path, &current) && current == content)
+		return 0;
+
+	string path = resolveTarget(_path);
+	string tmp = tempPath(path);
+
+	ofstream f(tmp.c_str(), ios::out | ios::binary | ios::trunc);
+	f << content;
+	f.close();
+
+	if (!f || !replaceFile(tmp, path))
+	{
+		unlink(tmp.c_str());
+		error("Unable to write " + path);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+OutputStage::OutputStage(const string& outdir, int writers) :
+	outdir(outdir),
+	writers(writers)
+{
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Absolute path without . and .. components, the tools may name the same   */
+/* file either way                                                          */
+/*--------------------------------------------------------------------------*/
+static string normalizePath(const string& path)
+{
+	string abs = getAbsolutePath(path);
+	vector<string> parts;
+	stringstream ss(abs);
+	string part;
+
+	while (getline(ss, part, '/'))
+	{
+		if (part.empty() || part == ".")
+			continue;
+
+		if (part == "..")
+		{
+			if (!parts.empty())
+				parts.pop_back();
+		}
+		else
+		{
+			parts.push_back(part);
+		}
+	}
+
+	string result;
+	for (auto& p : parts)
+		result += "/" + p;
+
+	return result.empty() ? "/" : result;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Key of a file, a file on the disk keeps the first path it was seen       */
+/* through, so links and other spellings of it share its content            */
+/*--------------------------------------------------------------------------*/
+string OutputStage::canonical(const string& path)
+{
+	string p = normalizePath(path);
+	sys::fs::UniqueID id;
+
+	// Generated files are not on the disk, their path is the key
+	if (sys::fs::getUniqueID(p, id))
+		return p;
+
+	auto a = this->aliases.find(id);
+	if (a != this->aliases.end())
+		return a->second;
+
+	this->aliases[id] = p;
+	return p;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* File as changed so far, read from the disk the first time                */
+/*--------------------------------------------------------------------------*/
+OutputStage::OUTPUTFILE* OutputStage::getFile(const string& _path)
+{
+	string path = this->canonical(_path);
+
+	auto f = this->files.find(path);
+	if (f != this->files.end())
+		return &f->second;
+
+	OUTPUTFILE file;
+
+	if (!readFile(path, &file.content))
+	{
+		error("Unable to read " + path);
+		return NULL;
+	}
+
+	file.input = HashContent(file.content);
+
+	OUTPUTPIECE all = { 0, 0, file.content.size() };
+	file.pieces.push_back(all);
+
+	return &(this->files[path] = file);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Where a file goes, the output directory mirrors the paths below the      */
+/* working directory                                                        */
+/*--------------------------------------------------------------------------*/
+string OutputStage::getTarget(const string& path)
+{
+	if (this->outdir.empty())
+		return path;
+
+	SmallString<256> cwd;
+	sys::fs::current_path(cwd);
+
+	string base = normalizePath(cwd.str().str()) + "/";
+	string rel = normalizePath(path);
+
+	if (rel.compare(0, base.size(), base) == 0)
+		rel = rel.substr(base.size());
+	else if (!rel.empty() && rel[0] == '/')
+		rel = rel.substr(1);
+
+	return this->outdir + "/" + rel;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Move the pieces copied from the input past the replacements applied to   */
+/* a file, in offset order, the text they replace is no longer a copy       */
+/*--------------------------------------------------------------------------*/
+static void remapPieces(vector<OUTPUTPIECE>& pieces,
+		const vector<const Replacement*>& rs)
+{
+	vector<OUTPUTPIECE> moved;
+	int64_t delta = 0;
+	size_t r = 0;
+
+	for (auto& p : pieces)
+	{
+		size_t s = p.at, e = p.at + p.length, from = p.from;
+
+		while (s < e)
+		{
+			while (r < rs.size() && 
+					rs[r]->getOffset() + rs[r]->getLength() <= s)
+			{
+				delta += (int64_t)rs[r]->getReplacementText().size() - 
+					(int64_t)rs[r]->getLength();
+				r++;
+			}
+
+			size_t o = r < rs.size() ? rs[r]->getOffset() : e;
+
+			if (o > s)
+			{
+				// Text ahead of the next replacement is still a copy
+				size_t end = min(o, e);
+				OUTPUTPIECE c = { (size_t)(s + delta), from, end - s };
+				moved.push_back(c);
+
+				from += end - s;
+				s = end;
+				continue;
+			}
+
+			size_t end = min(o + rs[r]->getLength(), e);
+			from += end - s;
+			s = end;
+		}
+	}
+
+	pieces.swap(moved);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Apply the replacements of a phase to the contents, from the end of each  */
+/* file so the offsets of the others are still valid                        */
+/*--------------------------------------------------------------------------*/
+int OutputStage::apply(const Replacements& replacements)
+{
+	std::map<string, vector<const Replacement*> > byfile;
+
+	for (auto& r : replacements)
+	{
+		if (!r.isApplicable())
+		{
+			error("Failed to apply replacements!");
+			continue;
+		}
+
+		byfile[this->canonical(r.getFilePath().str())].push_back(&r);
+	}
+
+	int result = 0;
+
+	for (auto& f : byfile)
+	{
+		TraceSpan span("rewrite", "output", f.first);
+		OUTPUTFILE* file = this->getFile(f.first);
+
+		if (file == NULL)
+		{
+			result = 1;
+			continue;
+		}
+
+		auto& rs = f.second;
+
+		stable_sort(rs.begin(), rs.end(),
+			[](const Replacement* a, const Replacement* b) {
+				return a->getOffset() > b->getOffset();
+			});
+
+		string& s = file->content;
+		size_t limit = s.size();
+		vector<const Replacement*> applied;
+
+		for (auto r : rs)
+		{
+			size_t offset = r->getOffset();
+			size_t length = r->getLength();
+
+			// Overlapping replacements can't both be right
+			if (offset + length > limit)
+			{
+				error("Failed to apply replacements!");
+				result = 1;
+				continue;
+			}
+
+			s.replace(offset, length, r->getReplacementText().str());
+			limit = offset;
+
+			applied.push_back(r);
+		}
+
+		reverse(applied.begin(), applied.end());
+		remapPieces(file->pieces, applied);
+	}
+
+	return result;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Add a file generated by a phase                                          */
+/*--------------------------------------------------------------------------*/
+void OutputStage::write(const string& path, const string& content)
+{
+	OUTPUTFILE& file = this->files[this->canonical(path)];
+	file.content = content;
+	file.input.clear();
+	file.pieces.clear();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Files whose content is not the one they had before the phases            */
+/*--------------------------------------------------------------------------*/
+void OutputStage::getChanged(vector<string>* paths)
+{
+	for (auto& f : this->files)
+	{
+		if (f.second.input.empty() ||
+				HashContent(f.second.content) != f.second.input)
+			paths->push_back(f.first);
+	}
+
+	for (auto& f : this->streamed)
+	{
+		if (f.second.first != f.second.second)
+			paths->push_back(f.first);
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Contents of the changed files and what was copied from their inputs      */
+/*--------------------------------------------------------------------------*/
+void OutputStage::getMaps(vector<OUTPUTMAP>* maps)
+{
+	for (auto& f : this->files)
+	{
+		if (!f.second.input.empty() &&
+				HashContent(f.second.content) == f.second.input)
+			continue;
+
+		OUTPUTMAP m;
+		m.path = f.first;
+		m.target = this->getTarget(f.first);
+		m.content = &f.second.content;
+		m.pieces = &f.second.pieces;
+		m.generated = f.second.input.empty();
+		maps->push_back(m);
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write a file straight to its target in source order, the new content is  */
+/* never kept in memory and the target is only replaced if it changes       */
+/*--------------------------------------------------------------------------*/
+int OutputStage::stream(const string& _path, const STREAMWRITER& writer)
+{
+	TraceSpan span("write", "output", _path);
+
+	string path = this->canonical(_path);
+	OUTPUTFILE* file = this->getFile(path);
+
+	if (file == NULL)
+		return 1;
+
+	string target = resolveTarget(this->getTarget(path));
+	string tmp = tempPath(target);
+
+	ofstream f(tmp.c_str(), ios::out | ios::binary | ios::trunc);
+	writer(f, file->content);
+	f.close();
+
+	string output, current;
+
+	if (!f || !hashFile(tmp, &output))
+	{
+		unlink(tmp.c_str());
+		error("Unable to write " + target);
+		return 1;
+	}
+
+	if (hashFile(target, &current) && current == output)
+	{
+		unlink(tmp.c_str());
+	}
+	else if (!replaceFile(tmp, target))
+	{
+		unlink(tmp.c_str());
+		error("Unable to write " + target);
+		return 1;
+	}
+
+	this->streamed[path] = make_pair(file->input, output);
+	this->files.erase(path);
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Let a tool see the files as changed so far                               */
+/*--------------------------------------------------------------------------*/
+void OutputStage::mapFiles(ClangTool& tool)
+{
+	// The tool keeps references to the contents, so nothing can be
+	// applied until it is done
+
+	for (auto& f : this->files)
+		tool.mapVirtualFile(f.first, f.second.content);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write the files whose target changed and add them, along with the        */
+/* untouched sources, to the manifest entries                               */
+/*--------------------------------------------------------------------------*/
+int OutputStage::commit(const vector<string>& sources, const string& manifest)
+{
+	int result = 0;
+
+	// The untouched sources are copied to the output directory too
+	// and they belong in the manifest anyway
+
+	if (!this->outdir.empty() || !manifest.empty())
+	{
+		for (auto& source : sources)
+		{
+			string path = this->canonical(source);
+
+			if (this->streamed.find(path) == this->streamed.end() &&
+					this->getFile(path) == NULL)
+				result = 1;
+		}
+	}
+
+	stringstream entries;
+
+	for (auto& f : this->streamed)
+	{
+		entries << this->getTarget(f.first) << ',' << f.second.first << ','
+			<< f.second.second << '\n';
+	}
+
+	// The files are written by other threads while the hashes of the
+	// next ones are computed
+
+	FileWriter writer(this->writers);
+
+	for (auto& f : this->files)
+	{
+		string target = this->getTarget(f.first);
+		writer.write(target, &f.second.content);
+
+		entries << target << ','
+			<< (f.second.input.empty() ? "-" : f.second.input) << ','
+			<< HashContent(f.second.content) << '\n';
+	}
+
+	if (writer.finish())
+		result = 1;
+
+	if (manifest.empty())
+		return result;
+
+	// Workers append their entries to the same file, a single write
+	// keeps the lines of different processes apart
+
+	string part = manifest + ".part";
+	string s = entries.str();
+
+	int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+	if (fd < 0 || ::write(fd, s.data(), s.size()) != (ssize_t)s.size())
+	{
+		error("Unable to write " + part);
+		result = 1;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return result;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Sort the entries added by commit and write the manifest if it changed,   */
+/* the header goes first                                                    */
+/*--------------------------------------------------------------------------*/
+int FinishManifest(const string& manifest, const string& header)
+{
+	string part = manifest + ".part";
+	string content;
+
+	readFile(part, &content);
+	unlink(part.c_str());
+
+	vector<string> lines;
+	stringstream ss(content);
+	string line;
+
+	while (getline(ss, line))
+	{
+		if (!line.empty())
+			lines.push_back(line);
+	}
+
+	sort(lines.begin(), lines.end());
+	lines.erase(unique(lines.begin(), lines.end()), lines.end());
+
+	stringstream out;
+	out << header;
+
+	for (auto& l : lines)
+		out << l << '\n';
+
+	return WriteIfChanged(manifest, out.str());
+}
@@ -0,0 +1,98 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Refactoring.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ostream>
+#include <functional>
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// Writes the new content of a file given the current one
+typedef function<void(ostream&, StringRef)> STREAMWRITER;
+
+// Text of a file copied from its input, the rest was written by the phases
+struct OUTPUTPIECE
+{
+	size_t at;
+	size_t from;
+	size_t length;
+};
+
+// Where the content of a changed file came from, pieces in content order
+struct OUTPUTMAP
+{
+	string path;
+	string target;
+	const string* content;
+	const vector<OUTPUTPIECE>* pieces;
+	bool generated;
+};
+
+/*--------------------------------------------------------------------------*/
+/* Contents of the files changed by the phases. Nothing is written until    */
+/* commit, the later phases see the changes through virtual files and a     */
+/* file is only written if its target does not have the same content        */
+/*--------------------------------------------------------------------------*/
+class OutputStage
+{
+private:
+
+	struct OUTPUTFILE
+	{
+		string content;
+
+		// Hash of the file before any phase, empty for generated files
+		string input;
+
+		vector<OUTPUTPIECE> pieces;
+	};
+
+	string outdir;
+	map<string, OUTPUTFILE> files;
+
+	// Threads writing the files on commit, 0 writes them in order
+	int writers;
+
+	// Files already written by stream, with their input and output hashes
+	map<string, pair<string, string> > streamed;
+
+	// First path each file on the disk was seen through
+	map<sys::fs::UniqueID, string> aliases;
+
+	string canonical(const string& path);
+	OUTPUTFILE* getFile(const string& path);
+	string getTarget(const string& path);
+
+public:
+
+	OutputStage(const string& outdir, int writers);
+
+	int apply(const Replacements& replacements);
+	void write(const string& path, const string& content);
+	void mapFiles(ClangTool& tool);
+	int stream(const string& path, const STREAMWRITER& writer);
+	void getChanged(vector<string>* paths);
+	void getMaps(vector<OUTPUTMAP>* maps);
+
+	int commit(const vector<string>& sources, const string& manifest);
+};
+
+string HashContent(const string& content);
+int WriteIfChanged(const string& path, const string& content);
+int FinishManifest(const string& manifest, const string& header);
@@ -0,0 +1,214 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/Basic/LangOptions.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <unordered_set>
+#include <algorithm>
+
+#include "Crowbar.h"
+#include "Prefilter.h"
+#include "Output.h"
+#include "Trace.h"
+#include "Pipeline.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// The tools are told about a new translation unit deep inside their
+// actions, so the running prefetcher is kept here. Any thread running
+// a tool may look at it while the main thread sets or clears it
+static atomic<Prefetcher*> activePrefetcher(NULL);
+
+
+Prefetcher::Prefetcher(const vector<string>& sources, int ahead,
+		bool headers, const LangOptions& lopt) :
+	sources(sources),
+	ahead(ahead > 0 ? (size_t)ahead : 0),
+	headers(headers),
+	lopt(lopt),
+	position(0),
+	stopped(false)
+{
+	if (this->ahead == 0 || sources.empty())
+		return;
+
+	for (size_t i = 0; i < this->sources.size(); i++)
+	{
+		this->sources[i] = getAbsolutePath(this->sources[i]);
+		this->index[this->sources[i]] = i;
+	}
+
+	this->reader = thread(&Prefetcher::run, this);
+	activePrefetcher = this;
+}
+
+
+Prefetcher::~Prefetcher()
+{
+	Prefetcher* self = this;
+	activePrefetcher.compare_exchange_strong(self, NULL);
+
+	{
+		lock_guard<mutex> g(this->lock);
+		this->stopped = true;
+		this->changed.notify_all();
+	}
+
+	if (this->reader.joinable())
+		this->reader.join();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Read each file once, never more than ahead units past the parser         */
+/*--------------------------------------------------------------------------*/
+void Prefetcher::run()
+{
+	unordered_set<string> visited;
+
+	for (size_t i = 0; i < this->sources.size(); i++)
+	{
+		{
+			unique_lock<mutex> g(this->lock);
+			this->changed.wait(g, [&]() {
+				return this->stopped || i < this->position + this->ahead;
+			});
+
+			if (this->stopped)
+				return;
+		}
+
+		TraceSpan span("prefetch", "io", this->sources[i]);
+
+		vector<string> pending(1, this->sources[i]);
+
+		while (!pending.empty())
+		{
+			string p = pending.back();
+			pending.pop_back();
+
+			if (!visited.insert(p).second)
+				continue;
+
+			ifstream f(p.c_str(), ios::in | ios::binary);
+
+			// Missing files are a problem for the parser
+			if (!f)
+				continue;
+
+			stringstream ss;
+			ss << f.rdbuf();
+
+			if (this->headers)
+				FindLocalIncludes(ss.str(), p, this->lopt, INCLUDEPATHS(), 
+						&pending, NULL);
+		}
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* The parser started a translation unit, let the reader move on            */
+/*--------------------------------------------------------------------------*/
+void Prefetcher::advance(const string& file)
+{
+	auto i = this->index.find(file);
+	if (i == this->index.end())
+		return;
+
+	lock_guard<mutex> g(this->lock);
+	this->position = max(this->position, i->second + 1);
+	this->changed.notify_all();
+}
+
+
+bool PrefetchOn()
+{
+	return activePrefetcher != NULL;
+}
+
+
+void PrefetchAdvance(const string& file)
+{
+	Prefetcher* p = activePrefetcher.load();
+
+	if (p != NULL)
+		p->advance(file);
+}
+
+
+FileWriter::FileWriter(int nthreads) :
+	queue(nthreads > 0 ? 2 * (size_t)nthreads : 1),
+	failed(0)
+{
+	for (int t = 0; t < nthreads; t++)
+	{
+		this->threads.push_back(thread([this]() {
+			pair<string, const string*> job;
+
+			while (this->queue.pop(&job))
+			{
+				TraceSpan span("write", "output", job.first);
+
+				if (WriteIfChanged(job.first, *job.second))
+					this->failed++;
+			}
+		}));
+	}
+}
+
+
+FileWriter::~FileWriter()
+{
+	this->finish();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Queue a file, it is written right away without any thread                */
+/*--------------------------------------------------------------------------*/
+void FileWriter::write(const string& path, const string* content)
+{
+	if (this->threads.empty())
+	{
+		TraceSpan span("write", "output", path);
+
+		if (WriteIfChanged(path, *content))
+			this->failed++;
+
+		return;
+	}
+
+	this->queue.push(make_pair(path, content));
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Wait for the queued files, non zero if any of them failed                */
+/*--------------------------------------------------------------------------*/
+int FileWriter::finish()
+{
+	this->queue.close();
+
+	for (auto& t : this->threads)
+		t.join();
+
+	this->threads.clear();
+
+	return this->failed > 0 ? 1 : 0;
+}
+
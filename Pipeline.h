@@ -0,0 +1,140 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Basic/LangOptions.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+using namespace clang;
+using namespace std;
+
+/*--------------------------------------------------------------------------*/
+/* Queue of bounded capacity, push waits while it is full and pop while it  */
+/* is empty, pop fails once the queue is closed and drained                 */
+/*--------------------------------------------------------------------------*/
+template <typename T>
+class BoundedQueue
+{
+private:
+
+	mutex lock;
+	condition_variable changed;
+	deque<T> items;
+	size_t capacity;
+	bool closed;
+
+public:
+
+	BoundedQueue(size_t capacity) :
+		capacity(capacity > 0 ? capacity : 1),
+		closed(false)
+	{
+	}
+
+	void push(T item)
+	{
+		unique_lock<mutex> g(this->lock);
+		this->changed.wait(g, [this]() {
+			return this->closed || this->items.size() < this->capacity;
+		});
+
+		if (this->closed)
+			return;
+
+		this->items.push_back(move(item));
+		this->changed.notify_all();
+	}
+
+	bool pop(T* item)
+	{
+		unique_lock<mutex> g(this->lock);
+		this->changed.wait(g, [this]() {
+			return this->closed || !this->items.empty();
+		});
+
+		if (this->items.empty())
+			return false;
+
+		*item = move(this->items.front());
+		this->items.pop_front();
+		this->changed.notify_all();
+		return true;
+	}
+
+	void close()
+	{
+		lock_guard<mutex> g(this->lock);
+		this->closed = true;
+		this->changed.notify_all();
+	}
+};
+
+/*--------------------------------------------------------------------------*/
+/* Reads the sources, and the local headers they include, up to some        */
+/* translation units ahead of the parser, so their contents are already in  */
+/* the page cache when the tools open them                                  */
+/*--------------------------------------------------------------------------*/
+class Prefetcher
+{
+private:
+
+	vector<string> sources;
+	unordered_map<string, size_t> index;
+	size_t ahead;
+	bool headers;
+	LangOptions lopt;
+
+	mutex lock;
+	condition_variable changed;
+	size_t position;
+	bool stopped;
+	thread reader;
+
+	void run();
+
+public:
+
+	Prefetcher(const vector<string>& sources, int ahead, bool headers,
+			const LangOptions& lopt);
+	~Prefetcher();
+
+	void advance(const string& file);
+};
+
+bool PrefetchOn();
+void PrefetchAdvance(const string& file);
+
+/*--------------------------------------------------------------------------*/
+/* Threads writing the output files while the next ones are prepared, the   */
+/* contents must live until finish                                          */
+/*--------------------------------------------------------------------------*/
+class FileWriter
+{
+private:
+
+	BoundedQueue<pair<string, const string*> > queue;
+	vector<thread> threads;
+	atomic<int> failed;
+
+public:
+
+	FileWriter(int nthreads);
+	~FileWriter();
+
+	void write(const string& path, const string* content);
+	int finish();
+};
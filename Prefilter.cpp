@@ -0,0 +1,362 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Lex/Lexer.h"
+#include "clang/Basic/LangOptions.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/Support/FileSystem.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <unordered_set>
+#include <vector>
+#include <string.h>
+
+#include "Crowbar.h"
+#include "Prefilter.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+
+/*--------------------------------------------------------------------------*/
+/* Identifiers that may follow the parameter list of a prototype            */
+/*--------------------------------------------------------------------------*/
+static bool isPrototypeSuffix(StringRef id)
+{
+	return id == "__attribute__" || id == "__attribute" || 
+		id == "asm" || id == "__asm" || id == "__asm__" || 
+		id == "const" || id == "volatile" || id == "throw" || 
+		id == "noexcept" || id == "override" || id == "final";
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Skip a directive, keeping the name of an include                         */
+/*--------------------------------------------------------------------------*/
+static void skipDirective(Lexer& lexer, Token& tok, vector<INCLUDE>* includes)
+{
+	bool include = false;
+	const char* angle = NULL;
+
+	while (!lexer.LexFromRawLexer(tok) && !tok.isAtStartOfLine())
+	{
+		if (tok.is(tok::raw_identifier) && 
+				tok.getRawIdentifier() == "include")
+			include = true;
+		else if (!include || includes == NULL)
+			continue;
+		else if (tok.is(tok::string_literal))
+		{
+			string s(tok.getLiteralData(), tok.getLength());
+			INCLUDE i = { s.substr(1, s.size() - 2), false };
+			includes->push_back(i);
+			include = false;
+		}
+		else if (tok.is(tok::less))
+			angle = lexer.getBufferLocation();
+		else if (tok.is(tok::greater) && angle != NULL)
+		{
+			// The raw lexer splits <a/b.h> into tokens, the name is
+			// whatever lies between the brackets
+			const char* end = lexer.getBufferLocation() - 1;
+			INCLUDE i = { string(angle, end - angle), true };
+			includes->push_back(i);
+			include = false;
+		}
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Find the file of an include in a file, false if no search directory has  */
+/* it                                                                       */
+/*--------------------------------------------------------------------------*/
+bool ResolveInclude(const INCLUDE& i, const string& path, 
+		const INCLUDEPATHS& paths, string* resolved)
+{
+	if (!i.name.empty() && i.name[0] == '/')
+	{
+		*resolved = i.name;
+		return sys::fs::exists(i.name);
+	}
+
+	vector<string> dirs;
+
+	if (!i.angled)
+	{
+		size_t slash = path.rfind('/');
+		dirs.push_back(slash == string::npos ? "" : path.substr(0, slash + 1));
+		
+		for (auto& d : paths.quoted)
+			dirs.push_back(d + "/");
+	}
+
+	for (auto& d : paths.angled)
+		dirs.push_back(d + "/");
+
+	for (auto& d : dirs)
+	{
+		if (sys::fs::exists(d + i.name))
+		{
+			*resolved = d + i.name;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Scan a buffer for a K&R header, that is a top level ')' followed by a    */
+/* declaration ending in ';' before any '{', '=' or '}'. Only the raw       */
+/* lexer is used, so macros and includes are not expanded and a few false   */
+/* positives are expected, which only cost a regular parse                  */
+/*--------------------------------------------------------------------------*/
+static bool scanKNRHeaders(StringRef buffer, const LangOptions& lopt, 
+		vector<INCLUDE>* includes)
+{
+	Lexer lexer(SourceLocation(), lopt, buffer.begin(), buffer.begin(), 
+			buffer.end());
+
+	Token tok;
+	int parens = 0, braces = 0;
+
+	// 0 outside any candidate, 1 right after a top level ')', 2 inside 
+	// what may be the parameter declarations, counting their tokens
+	int state = 0, tokens = 0;
+	bool found = false;
+
+	while (!found && !lexer.LexFromRawLexer(tok))
+	{
+		// Skip the whole directive, the include is only needed 
+		// to follow the headers
+
+		while (tok.is(tok::hash) && tok.isAtStartOfLine())
+			skipDirective(lexer, tok, includes);
+
+		if (tok.is(tok::eof))
+			break;
+
+		if (state == 1)
+		{
+			state = (braces == 0 && tok.is(tok::raw_identifier) && 
+				!isPrototypeSuffix(tok.getRawIdentifier())) ? 2 : 0;
+			tokens = 0;
+		}
+
+		switch (tok.getKind())
+		{
+		case tok::l_paren:
+			parens++;
+			break;
+
+		case tok::r_paren:
+			if (parens > 0 && --parens == 0 && braces == 0 && state == 0)
+				state = 1;
+			break;
+
+		case tok::l_brace:
+			braces++;
+			state = 0;
+			break;
+
+		case tok::r_brace:
+			if (braces > 0)
+				braces--;
+			state = 0;
+			break;
+
+		case tok::equal:
+			state = 0;
+			break;
+
+		case tok::semi:
+			// A lone identifier before the ';' is usually a macro
+			// after a prototype, K&R needs at least a type and a name
+			if (state == 2 && parens == 0)
+			{
+				found = tokens >= 2;
+				state = 0;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		tokens++;
+	}
+
+	return found;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Check if a source buffer has any K&R method header                       */
+/*--------------------------------------------------------------------------*/
+bool HasKNRHeaders(StringRef buffer, const LangOptions& lopt)
+{
+	return scanKNRHeaders(buffer, lopt, NULL);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Take the search directories of the first compile command of a source,    */
+/* relative ones are relative to the directory of the command               */
+/*--------------------------------------------------------------------------*/
+void GetIncludePaths(CompilationDatabase& compilations, const string& source,
+		INCLUDEPATHS* paths)
+{
+	vector<CompileCommand> commands = compilations.getCompileCommands(
+			getAbsolutePath(source));
+
+	if (commands.empty())
+		return;
+
+	const CompileCommand& c = commands[0];
+	const vector<string>& args = c.CommandLine;
+
+	static const char* flags[] = { "-iquote", "-I", "-isystem", "-idirafter" };
+
+	// -I comes before -isystem and -idirafter whatever the order of the
+	// arguments, each group keeps its own order
+
+	vector<string> groups[4];
+
+	for (size_t a = 0; a < args.size(); a++)
+	{
+		for (int f = 0; f < 4; f++)
+		{
+			size_t n = strlen(flags[f]);
+
+			if (args[a].compare(0, n, flags[f]) != 0)
+				continue;
+
+			string dir = args[a].substr(n);
+
+			if (dir.empty() && a + 1 < args.size())
+				dir = args[++a];
+
+			if (dir.empty())
+				break;
+
+			if (dir[0] != '/')
+				dir = c.Directory + "/" + dir;
+
+			groups[f].push_back(dir);
+			break;
+		}
+	}
+
+	paths->quoted = groups[0];
+
+	for (int f = 1; f < 4; f++)
+		paths->angled.insert(paths->angled.end(), groups[f].begin(), 
+				groups[f].end());
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Check if a source file, and optionally the headers it includes, has any  */
+/* K&R method header. A quoted include that can't be found may be anything, */
+/* so it counts as K&R, angled ones not in the search paths are the         */
+/* system headers                                                           */
+/*--------------------------------------------------------------------------*/
+bool HasKNRHeaders(const string& path, const LangOptions& lopt, bool headers,
+		const INCLUDEPATHS& paths)
+{
+	vector<string> pending(1, path);
+	unordered_set<string> visited;
+
+	while (!pending.empty())
+	{
+		string p = pending.back();
+		pending.pop_back();
+
+		if (!visited.insert(p).second)
+			continue;
+
+		ifstream f(p.c_str(), ios::binary);
+
+		// A missing source is a problem for the parser, not for us
+		if (!f)
+			continue;
+
+		stringstream ss;
+		ss << f.rdbuf();
+		string buffer = ss.str();
+
+		vector<INCLUDE> includes;
+		if (scanKNRHeaders(buffer, lopt, headers ? &includes : NULL))
+			return true;
+
+		for (auto& i : includes)
+		{
+			string resolved;
+
+			if (ResolveInclude(i, p, paths, &resolved))
+				pending.push_back(resolved);
+			else if (!i.angled)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* List the includes of a buffer as they are written                        */
+/*--------------------------------------------------------------------------*/
+void FindIncludes(StringRef buffer, const LangOptions& lopt, 
+		vector<INCLUDE>* includes)
+{
+	Lexer lexer(SourceLocation(), lopt, buffer.begin(), buffer.begin(), 
+			buffer.end());
+
+	Token tok;
+
+	while (!lexer.LexFromRawLexer(tok))
+	{
+		while (tok.is(tok::hash) && tok.isAtStartOfLine())
+			skipDirective(lexer, tok, includes);
+
+		if (tok.is(tok::eof))
+			break;
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* List the includes of a buffer that can be found in the search paths,     */
+/* the names of the others go to unresolved                                 */
+/*--------------------------------------------------------------------------*/
+void FindLocalIncludes(StringRef buffer, const string& path, 
+		const LangOptions& lopt, const INCLUDEPATHS& paths, 
+		vector<string>* includes, vector<string>* unresolved)
+{
+	vector<INCLUDE> found;
+	FindIncludes(buffer, lopt, &found);
+
+	for (auto& i : found)
+	{
+		string resolved;
+
+		if (ResolveInclude(i, path, paths, &resolved))
+			includes->push_back(resolved);
+		else if (unresolved != NULL)
+			unresolved->push_back(i.name);
+	}
+}
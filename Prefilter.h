@@ -0,0 +1,50 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Basic/LangOptions.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <vector>
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// Include search directories of a compile command, in the order the 
+// compiler looks into them. Quoted includes are looked up next to the
+// including file, then in quoted and angled, angled ones only in angled
+struct INCLUDEPATHS
+{
+	vector<string> quoted;
+	vector<string> angled;
+};
+
+// An include as written, with or without the angle brackets
+struct INCLUDE
+{
+	string name;
+	bool angled;
+};
+
+void GetIncludePaths(CompilationDatabase& compilations, const string& source,
+		INCLUDEPATHS* paths);
+void FindIncludes(StringRef buffer, const LangOptions& lopt, 
+		vector<INCLUDE>* includes);
+bool ResolveInclude(const INCLUDE& i, const string& path, 
+		const INCLUDEPATHS& paths, string* resolved);
+bool HasKNRHeaders(StringRef buffer, const LangOptions& lopt);
+bool HasKNRHeaders(const string& path, const LangOptions& lopt, bool headers,
+		const INCLUDEPATHS& paths);
+void FindLocalIncludes(StringRef buffer, const string& path, 
+		const LangOptions& lopt, const INCLUDEPATHS& paths, 
+		vector<string>* includes, vector<string>* unresolved);
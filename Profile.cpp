@@ -0,0 +1,59 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <stdlib.h>
+
+#include "Crowbar.h"
+#include "Profile.h"
+
+using namespace std;
+
+
+/*--------------------------------------------------------------------------*/
+/* Load name,count lines, the counts of repeated names are added so dumps   */
+/* of several runs can be simply concatenated                               */
+/*--------------------------------------------------------------------------*/
+int LoadProfile(const string& path, PROFILE* profile)
+{
+	ifstream f(path.c_str());
+
+	if (!f)
+	{
+		error("Unable to open profile " + path);
+		return 1;
+	}
+
+	string line;
+	while (getline(f, line))
+	{
+		if (line.empty() || line[0] == '#' || line[0] == '!')
+			continue;
+
+		size_t c = line.rfind(',');
+		if (c == string::npos || c == 0)
+			continue;
+
+		(*profile)[line.substr(0, c)] += strtoll(line.c_str() + c + 1, NULL, 10);
+	}
+
+	return 0;
+}
+
+
+int64 ProfileCount(const PROFILE* profile, const string& name)
+{
+	if (profile == NULL)
+		return 0;
+
+	auto p = profile->find(name);
+	return p == profile->end() ? 0 : p->second;
+}
@@ -0,0 +1,22 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+typedef int64_t int64;
+
+// Number of calls of each method, copies appear with their own rN_ names
+typedef unordered_map<string, int64> PROFILE;
+
+int LoadProfile(const string& path, PROFILE* profile);
+int64 ProfileCount(const PROFILE* profile, const string& name);
@@ -21,13 +21,20 @@
 #include <string>
 #include <iostream>
 #include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <set>
 #include <stdexcept>
 #include <sstream>
+#include <vector>
 #include <stdlib.h>
 #include <math.h> 
 
 #include "Crowbar.h"
 #include "CallTree.h"
+#include "LocationCache.h"
+#include "Reservoir.h"
+#include "Trace.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -41,17 +48,64 @@ using namespace std;
 /*--------------------------------------------------------------------------*/
 int random(int l, int u);
 
-/*--------------------------------------------------------------------------*/
-/* Convert a location to the absolute position inside the source file       */
-/*--------------------------------------------------------------------------*/
-void getAbsoluteLocation(const FullSourceLoc& l, int64* pBegin, int64* pEnd,
-		const LangOptions& lopt);
+// Value of each parameter of a specialized copy, empty for the ones
+// that are kept
+typedef unordered_map<string, vector<string> > SPECIALIZATIONS;
+
 
 /*--------------------------------------------------------------------------*/
-/* Convert a location to the absolute position inside the source file       */
+/* Spans that remove the items with a value from a comma separated list,    */
+/* a single span covers the whole list when none is kept                    */
 /*--------------------------------------------------------------------------*/
-void getAbsoluteLocation(const FullSourceLoc& lb, const FullSourceLoc& le, 
-		int64* pBegin, int64* pEnd, const LangOptions& lopt);
+static vector<FILERANGE> removeItems(const vector<FILERANGE>& items, 
+		const vector<string>& values)
+{
+	vector<FILERANGE> spans;
+	int last = -1;
+
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (values[i].empty())
+			last = (int)i;
+	}
+
+	FILERANGE r;
+
+	if (last < 0)
+	{
+		r.begin = items.front().begin;
+		r.end = items.back().end;
+		spans.push_back(r);
+		return spans;
+	}
+
+	// An item takes the separator after it, the ones after the last 
+	// kept item take the separator before them
+
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (values[i].empty())
+			continue;
+
+		if ((int)i < last)
+		{
+			r.begin = items[i].begin;
+			r.end = items[i + 1].begin;
+		}
+		else
+		{
+			r.begin = items[last].end;
+			r.end = items.back().end;
+			spans.push_back(r);
+			break;
+		}
+
+		spans.push_back(r);
+	}
+
+	return spans;
+}
+
 
 /*--------------------------------------------------------------------------*/
 /* Matcher for the calls                                                    */
@@ -62,38 +116,191 @@ private:
 
 	const LangOptions* lopt;
 	const CALLTREE* tree;
-	const unordered_map<int64, CALLSITE*> callmap;
+	// Selected calls by CallSiteKey, a call is found by the number it
+	// has in its definition since the calls may have been collected 
+	// from the original sources
+	const unordered_map<string, CALLSITE*> selected;
+	CallCounter counter;
+	const SPECIALIZATIONS specializations;
 	Replacements* replacements;
+	LocationCache locations;
+
+	// Edits of each specialized copy, kept until every call and
+	// declaration was seen since a single one that can't be changed
+	// leaves the whole copy as it is
+	map<string, vector<Replacement> > edits;
+	set<string> failed;
+
+	// The constant arguments are left out of the call, the parameter
+	// list of the copy shrinks to match
+
+	void specializeCall(const CallExpr* md, const string& newname, 
+			SourceManager &sm)
+	{
+		auto spec = this->specializations.find(newname);
+
+		if (spec == this->specializations.end())
+			return;
 
-	int runRE(const DeclRefExpr *md, SourceManager &sm)
+		if (md->getNumArgs() != spec->second.size())
+		{
+			this->failed.insert(newname);
+			return;
+		}
+
+		vector<FILERANGE> args;
+
+		for (unsigned i = 0; i < md->getNumArgs(); i++)
+		{
+			const Expr* a = md->getArg(i);
+
+			SourceLocation b = sm.getExpansionLoc(a->getLocStart());
+			SourceLocation e = sm.getExpansionRange(a->getLocEnd()).second;
+			e = this->locations.getLocForEndOfToken(FullSourceLoc(e, sm), sm);
+
+			FILERANGE r;
+			r.begin = (int64)sm.getFileOffset(b);
+			r.end = (int64)sm.getFileOffset(e);
+			args.push_back(r);
+		}
+
+		string file = sm.getFilename(sm.getExpansionLoc(md->getLocStart())).str();
+
+		for (auto& r : removeItems(args, spec->second))
+		{
+			this->edits[newname].push_back(Replacement(file, 
+				(unsigned)r.begin, (unsigned)(r.end - r.begin), ""));
+		}
+	}
+
+	// The removed parameters become locals of the same type and name
+	// initialized with the constant, so the body is left as it is
+
+	int runFD(const FunctionDecl *md, SourceManager &sm)
 	{
-		DeclarationNameInfo info = md->getNameInfo();
+		auto spec = this->specializations.find(md->getNameAsString());
+		if (spec == this->specializations.end())
+			return 0;
+
+		// A declaration that can't be rewritten would keep the
+		// parameters the calls no longer pass
+
+		SourceLocation l = md->getLocation();
+		const vector<string>& values = spec->second;
+
+		if (l.isMacroID() || sm.isInSystemHeader(l) || 
+				(this->tree->mainonly && !sm.isInMainFile(l)) ||
+				md->getNumParams() != values.size())
+		{
+			this->failed.insert(spec->first);
+			return 0;
+		}
+
+		vector<FILERANGE> params;
+		stringstream decls;
+		bool none = true;
+
+		PrintingPolicy pp(*this->lopt);
+
+		for (unsigned i = 0; i < md->getNumParams(); i++)
+		{
+			const ParmVarDecl* p = md->getParamDecl(i);
+			SourceLocation b = p->getLocStart(), e = p->getLocEnd();
+
+			// The calls only pass constants to such parameters, but a
+			// redeclaration may still be different
+			if (b.isMacroID() || e.isMacroID() || (!values[i].empty() && 
+					(p->hasDefaultArg() || 
+					 p->getType()->isVariablyModifiedType() ||
+					 p->getOriginalType()->isVariablyModifiedType())))
+			{
+				this->failed.insert(spec->first);
+				return 0;
+			}
+
+			FILERANGE r;
+			this->locations.getAbsoluteLocation(FullSourceLoc(b, sm), 
+					FullSourceLoc(e, sm), &r.begin, &r.end);
+			params.push_back(r);
+
+			if (values[i].empty())
+			{
+				none = false;
+			}
+			else if (!p->getName().empty())
+			{
+				decls << endl << '\t' << p->getType().getAsString(pp) << ' ' << 
+					p->getName().str() << " = " << values[i] << ';';
+			}
+		}
+
+		string file = sm.getFilename(l).str();
+		vector<Replacement>& edits = this->edits[spec->first];
+
+		for (auto& r : removeItems(params, values))
+		{
+			edits.push_back(Replacement(file, (unsigned)r.begin,
+				(unsigned)(r.end - r.begin), none ? "void" : ""));
+		}
+
+		if (md->isThisDeclarationADefinition() && md->hasBody())
+		{
+			SourceLocation brace = md->getBody()->getLocStart().
+				getLocWithOffset(1);
+
+			edits.push_back(Replacement(sm, 
+				CharSourceRange::getCharRange(brace, brace), decls.str()));
+		}
+
+		return 0;
+	}
+
+	int runCE(const CallExpr *md, const FunctionDecl* caller, 
+			SourceManager &sm)
+	{
+		if (md->getDirectCallee() == 0)
+			return 0;
+
+		// The call is numbered whether it was selected or not
+
+		string file = sm.getFilename(sm.getExpansionLoc(md->getLocStart())).str();
+		int ordinal = this->counter.next(md, caller, file);
+
+		if (ordinal < 0)
+			return 0;
+
+		auto call = this->selected.find(CallSiteKey(file, 
+			caller == 0 ? string() : caller->getNameAsString(), ordinal));
+
+		if (call == this->selected.end())
+		{
+			// The call was not selected to be redirected
+			return 0;
+		}
+
+		// Only a call by name can be renamed
+
+		const DeclRefExpr* ref = dyn_cast<DeclRefExpr>(
+				md->getCallee()->IgnoreImpCasts());
+
+		if (ref == NULL)
+			return 0;
+
+		DeclarationNameInfo info = ref->getNameInfo();
 		std::string name = info.getAsString();
-		
-		// Maybe it's calling external code, if it has no 
-		// local body then the call is irrelevant
-		auto method = this->tree->methods.find(name);
-		if (method == this->tree->methods.end())
+
+		if (name != call->second->callee->name)
 			return 0;
 			
 		int64 begin, end;
-		getAbsoluteLocation(FullSourceLoc(md->getLocStart(), sm), 
-				FullSourceLoc(md->getLocEnd(), sm),
-				&begin, &end, *this->lopt);
+		this->locations.getAbsoluteLocation(FullSourceLoc(ref->getLocStart(), sm), 
+				FullSourceLoc(ref->getLocEnd(), sm),
+				&begin, &end);
 
 		stringstream ss;
 		ss << begin << '-' << end;
 		string sloc = ss.str();
 
-		auto call = this->callmap.find(begin);
-		if (call == this->callmap.end())
-		{
-			// The call was not selected to be redirected or
-			// it is a reference to the function without 
-			// being a call
-			return 0;
-		}
-
 		int r = call->second->redirect;
 		if (r == 0) return 0;
 
@@ -106,6 +313,8 @@ private:
 		string newname = ss.str();
 		this->replacements->insert(Replacement(sm, range, newname));
 
+		this->specializeCall(md, newname, sm);
+
 		cout << name << ',' << sloc << ',' << r << endl;
 
 		return 0;
@@ -114,35 +323,72 @@ private:
 public:
 
 	TreeRedirector(const LangOptions* lopt, const CALLTREE* tree, 
-			const unordered_map<int64, CALLSITE*> callmap, 
-			Replacements* repl) : 
+			const unordered_map<string, CALLSITE*> selected, 
+			const SPECIALIZATIONS& specializations, Replacements* repl) : 
 		lopt(lopt),
 		tree(tree),
-		callmap(callmap),
-		replacements(repl)
+		selected(selected),
+		specializations(specializations),
+		replacements(repl),
+		locations(lopt)
+	{
+	}
+
+	virtual void onStartOfTranslationUnit()
+	{
+		this->locations.clear();
+		this->counter.clear();
+	}
+
+	// Apply the specializations whose calls and declarations could all
+	// be changed, the others are left whole
+
+	void finish()
 	{
+		map<string, vector<string> > sorted(this->specializations.begin(), 
+				this->specializations.end());
+
+		for (auto& spec : sorted)
+		{
+			if (this->failed.count(spec.first) > 0)
+			{
+				error("Unable to specialize " + spec.first);
+				continue;
+			}
+
+			for (auto& r : this->edits[spec.first])
+				this->replacements->insert(r);
+
+			stringstream sl;
+			sl << "!specialize," << spec.first;
+
+			for (size_t i = 0; i < spec.second.size(); i++)
+			{
+				if (!spec.second[i].empty())
+					sl << ',' << i << '=' << spec.second[i];
+			}
+
+			cout << sl.str() << endl;
+		}
 	}
 
 	virtual void run(const MatchFinder::MatchResult &Result) 
 	{
 		SourceManager &sm = Result.Context->getSourceManager();
-		if (const DeclRefExpr *md = Result.Nodes.getNodeAs<clang::DeclRefExpr>("id"))
-			this->runRE(md, sm);
+		if (const CallExpr *md = Result.Nodes.getNodeAs<clang::CallExpr>("id"))
+			this->runCE(md, Result.Nodes.getNodeAs<clang::FunctionDecl>("caller"), 
+					sm);
+		else if (const FunctionDecl *md = Result.Nodes.getNodeAs<clang::FunctionDecl>("id"))
+			this->runFD(md, sm);
 	}
 };
 
 /*--------------------------------------------------------------------------*/
-/* Redirect calls in the tree                                               */
+/* Select up to maxredirect calls of each method                            */
 /*--------------------------------------------------------------------------*/
-int RedirectCallTree(RefactoringTool& tool, const LangOptions* lopt, 
-		const CALLTREE* tree, int seed, int maxredirect)
+static void selectPerMethod(const CALLTREE* tree, int maxredirect, 
+		bool rngcompat, unordered_map<int64, CALLSITE*>& callmap)
 {
-	srand(seed);
-
-	unordered_map<int64, CALLSITE*> callmap;
-
-	Replacements& replacements = tool.getReplacements();
-
 	for (auto& m : tree->methods)
 	{
 		vector<CALLSITE*> calls;
@@ -153,22 +399,26 @@ int RedirectCallTree(RefactoringTool& tool, const LangOptions* lopt,
 			calls.push_back(c);
 		}
 
+		// The calls of methods that were not repeated are not even
+		// collected, but they used to go through the same draws
+
+		int ncalls = (int)m.second->calls.size();
+
+		if (rngcompat)
+			ncalls += m.second->skipped;
+
 		int reps = m.second->repeats;
-		int redirs;
-	   
-		if (maxredirect < 0)
-		{
-			redirs = (int)round((double)maxredirect / 100.0 * 
-					(double)m.second->calls.size());
-		}
-		else
-		{
-			redirs = (maxredirect > (int)m.second->calls.size()) ?
-				(int)m.second->calls.size() : maxredirect;
-		}
+		int redirs = (int)ResolveLimit(maxredirect, ncalls);
 
 		for (int i = 0; i < redirs; i++)
 		{
+			if (calls.empty())
+			{
+				rand();
+				rand();
+				continue;
+			}
+
 			int p = random(0, (int)calls.size()-1);
 			int r = random(0, reps);
 
@@ -181,15 +431,232 @@ int RedirectCallTree(RefactoringTool& tool, const LangOptions* lopt,
 			calls.erase(e);
 		}
 	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Select up to maxredirect calls over the whole tree, with a reservoir so  */
+/* only the selected calls are kept aside                                   */
+/*--------------------------------------------------------------------------*/
+static void selectTotal(const CALLTREE* tree, int seed, int maxredirect, 
+		unordered_map<int64, CALLSITE*>& callmap)
+{
+	int64 ncalls = 0;
+
+	for (auto& m : tree->methods)
+	{
+		for (auto& c : m.second->calls)
+			c->redirect = 0;
+
+		ncalls += (int64)m.second->calls.size();
+	}
+
+	int64 redirs = ResolveLimit(maxredirect, ncalls);
+
+	// The calls are weighted by the number of copies of the callee, the
+	// id of a call does not depend on the order the tree is walked
+
+	Reservoir reservoir((size_t)redirs, (uint64_t)seed);
+
+	for (auto& m : tree->methods)
+	{
+		uint64_t h = HashString(m.second->name, 0);
+
+		for (auto& c : m.second->calls)
+		{
+			// The number of the call in its definition, not its offset,
+			// so the calls collected from the original sources get the
+			// same ids
+
+			uint64_t id = HashString(c->file, h);
+			id = HashString(c->from, id);
+			id = HashNumber((uint64_t)c->ordinal, id);
+
+			reservoir.offer(id, (double)m.second->repeats, c);
+		}
+	}
+
+	// Every selected call goes to one of the copies
+
+	for (auto& item : reservoir.getItems())
+	{
+		CALLSITE* c = (CALLSITE*)item.data;
+		uint64_t r = HashNumber(item.id, ~(uint64_t)seed);
+
+		c->redirect = 1 + (int)(r % (uint64_t)c->callee->repeats);
+		callmap[c->location.begin] = c;
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Specialize the parameters of each copy to which every redirected call    */
+/* passes the same constant                                                 */
+/*--------------------------------------------------------------------------*/
+static void specializeCallSites(const CALLTREE* tree, 
+		SPECIALIZATIONS& specializations)
+{
+	for (auto& m : tree->methods)
+	{
+		unordered_map<int, vector<string> > copies;
+
+		for (auto& c : m.second->calls)
+		{
+			if (c->redirect == 0)
+				continue;
+
+			auto v = copies.find(c->redirect);
+
+			if (v == copies.end())
+			{
+				copies[c->redirect] = c->constants;
+				continue;
+			}
+
+			vector<string>& values = v->second;
+
+			for (size_t i = 0; i < values.size(); i++)
+			{
+				if (c->constants.size() != values.size() || 
+						c->constants[i] != values[i])
+					values[i].clear();
+			}
+		}
+
+		for (auto& v : copies)
+		{
+			stringstream ss;
+			ss << 'r' << v.first << '_' << m.second->name;
+
+			bool any = false;
+
+			for (auto& value : v.second)
+				any = any || !value.empty();
+
+			if (any)
+				specializations[ss.str()] = v.second;
+		}
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Copy of a callee bound to a copy of a caller, it only depends on their   */
+/* names, so the repetition knows it before any call is selected            */
+/*--------------------------------------------------------------------------*/
+int AffinityCopy(const METHOD* caller, int clone, const METHOD* callee, 
+		int seed)
+{
+	uint64_t h = HashString(caller->name, (uint64_t)seed);
+	h = HashNumber((uint64_t)clone, h);
+	h = HashString(callee->name, h);
+
+	return 1 + (int)(h % (uint64_t)callee->repeats);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Send the selected calls of each copy of a caller to the copy of the      */
+/* callee bound to it, along with every other call it makes to the callee   */
+/*--------------------------------------------------------------------------*/
+static void bindCallSites(const CALLTREE* tree, int seed, 
+		unordered_map<int64, CALLSITE*>& callmap)
+{
+	for (auto& m : tree->methods)
+	{
+		METHOD* callee = m.second;
+
+		// Copies of the callers with a selected call
+		unordered_map<METHOD*, unordered_set<int> > bound;
+
+		for (auto& c : callee->calls)
+		{
+			if (c->caller != NULL && c->redirect > 0)
+				bound[c->caller].insert(c->clone);
+		}
+
+		for (auto& c : callee->calls)
+		{
+			if (c->caller == NULL)
+				continue;
+
+			auto b = bound.find(c->caller);
+
+			if (b == bound.end() || b->second.count(c->clone) == 0)
+				continue;
+
+			c->redirect = AffinityCopy(c->caller, c->clone, callee, seed);
+			callmap[c->location.begin] = c;
+		}
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Choose the calls to redirect and the copy each one goes to               */
+/*--------------------------------------------------------------------------*/
+void SelectCallSites(const CALLTREE* tree, int seed, int maxredirect, 
+		RedirectMode mode, RedirectPolicy policy, bool rngcompat, 
+		unordered_map<int64, CALLSITE*>& callmap)
+{
+	srand(seed);
+
+	TraceSpan span("selection", "redirect");
+
+	if (mode == RM_Total)
+		selectTotal(tree, seed, maxredirect, callmap);
+	else
+		selectPerMethod(tree, maxredirect, rngcompat, callmap);
+
+	if (policy == RP_Affinity)
+		bindCallSites(tree, seed, callmap);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Redirect calls in the tree                                               */
+/*--------------------------------------------------------------------------*/
+int RedirectCallTree(RefactoringTool& tool, const LangOptions* lopt, 
+		const CALLTREE* tree, int seed, int maxredirect, RedirectMode mode, 
+		RedirectPolicy policy, bool rngcompat)
+{
+	unordered_map<int64, CALLSITE*> callmap;
+
+	Replacements& replacements = tool.getReplacements();
+
+	SelectCallSites(tree, seed, maxredirect, mode, policy, rngcompat, 
+			callmap);
+
+	SPECIALIZATIONS specializations;
+
+	if (tree->specialize)
+		specializeCallSites(tree, specializations);
+
+	unordered_map<string, CALLSITE*> selected;
+
+	for (auto& m : tree->methods)
+	{
+		for (auto c : m.second->calls)
+		{
+			if (c->redirect != 0)
+				selected[CallSiteKey(c->file, c->from, c->ordinal)] = c;
+		}
+	}
 
 	MatchFinder matchFinder;
-	TreeRedirector treeRedirector(lopt, tree, callmap, &replacements);
+	TreeRedirector treeRedirector(lopt, tree, selected, specializations, 
+			&replacements);
 
-	StatementMatcher refMatcher = declRefExpr().bind("id");
-	matchFinder.addMatcher(refMatcher, &treeRedirector);
+	// Calls bound to their enclosing definition, if any, they are
+	// found by their number in it
+	matchFinder.addMatcher(CallerMatcher(), &treeRedirector);
 
-	assert_tool(tool.runAndSave(newFrontendActionFactory(&matchFinder).get()));
+	if (!specializations.empty())
+		matchFinder.addMatcher(functionDecl().bind("id"), &treeRedirector);
+
+	assert_tool(tool.run(newTracedActionFactory(&matchFinder, "redirect").get()));
+
+	treeRedirector.finish();
 
 	return 0;
 }
-
@@ -36,5 +36,25 @@ using namespace clang::tooling;
 using namespace llvm;
 using namespace std;
 
+enum RedirectMode
+{
+	RM_Total,
+	RM_PerMethod,
+};
+
+enum RedirectPolicy
+{
+	RP_Random,
+	RP_Affinity,
+};
+
+int AffinityCopy(const METHOD* caller, int clone, const METHOD* callee, 
+		int seed);
+
+void SelectCallSites(const CALLTREE* tree, int seed, int maxredirect, 
+		RedirectMode mode, RedirectPolicy policy, bool rngcompat, 
+		unordered_map<int64, CALLSITE*>& callmap);
+
 int RedirectCallTree(RefactoringTool& tool, const LangOptions* lopt, 
-		const CALLTREE* tree, int seed, int maxredirect);
+		const CALLTREE* tree, int seed, int maxredirect, RedirectMode mode, 
+		RedirectPolicy policy, bool rngcompat);
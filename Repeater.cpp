@@ -21,6 +21,10 @@
 #include <string>
 #include <iostream>
 #include <unordered_map>
+#include <map>
+#include <set>
+#include <vector>
+#include <algorithm>
 #include <stdexcept>
 #include <sstream>
 #include <stdlib.h>
@@ -28,6 +32,12 @@
 
 #include "Crowbar.h"
 #include "CallTree.h"
+#include "CallGraph.h"
+#include "Profile.h"
+#include "Repeater.h"
+#include "Redirector.h"
+#include "LocationCache.h"
+#include "Trace.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -35,6 +45,17 @@ using namespace clang::tooling;
 using namespace llvm;
 using namespace std;
 
+// A copy of a method, 0 is the original
+typedef pair<const METHOD*, int> COPY;
+
+// Copies moved away from their original and the ones written right
+// after each copy, in order
+struct COPYPLACEMENT
+{
+	set<COPY> moved;
+	map<COPY, vector<COPY> > after;
+};
+
 
 /*--------------------------------------------------------------------------*/
 /* Random within range                                                      */
@@ -46,6 +67,225 @@ int random(int l, int u)
 }
 
 
+/*--------------------------------------------------------------------------*/
+/* Placement attributes of a definition                                     */
+/*--------------------------------------------------------------------------*/
+static string getAttributes(const CLONEOPTIONS* copts, const METHOD* m, 
+		const string& name)
+{
+	stringstream ss;
+	bool first = true;
+
+	if (copts->policies[m->kind] == MP_Inlinable)
+		return "";
+
+	auto add = [&](const string& a) {
+		ss << (first ? "__attribute__((" : ", ") << a;
+		first = false;
+	};
+
+	if (copts->profile != NULL)
+	{
+		if (ProfileCount(copts->profile, name) >= copts->hot)
+			add("hot");
+		else
+			add("cold");
+	}
+	else if (copts->cold)
+	{
+		add("cold");
+	}
+
+	if (copts->noinline)
+		add("noinline");
+
+	if (!copts->section.empty())
+		add("section(\"" + copts->section + "\")");
+
+	if (!first)
+		ss << ")) ";
+
+	return ss.str();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Counter of each copy, a relaxed atomic in a section of its own that the  */
+/* runtime in CrowbarCounters.c dumps as a profile at exit                  */
+/*--------------------------------------------------------------------------*/
+static const char* counterMacro =
+	"#ifndef CROWBAR_COUNT\n"
+	"#define CROWBAR_COUNT(n) do { static struct { const char* name; "
+	"unsigned long long count; } c __attribute__((section(\"crowbar_counters\"), "
+	"used, aligned(16))) = { #n, 0 }; "
+	"__atomic_fetch_add(&c.count, 1, __ATOMIC_RELAXED); } while (0)\n"
+	"#endif\n";
+
+static bool counted(const CLONEOPTIONS* copts, const METHOD* m)
+{
+	// An inline definition with external linkage can't have statics
+	return copts->counters && m->body < m->post.size() && 
+		m->post[m->body] == '{' && !(m->inlined && !m->internal);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write the text of a copy after its name                                  */
+/*--------------------------------------------------------------------------*/
+static void writeBody(ostream& out, const CLONEOPTIONS* copts, 
+		const METHOD* m, int i)
+{
+	if (!counted(copts, m))
+	{
+		out << m->post;
+		return;
+	}
+
+	out.write(m->post.data(), m->body + 1);
+	out << " CROWBAR_COUNT(";
+
+	if (i > 0)
+		out << "r" << i << "_";
+
+	out << m->name << ");";
+	out.write(m->post.data() + m->body + 1, m->post.size() - m->body - 1);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write the copies placed after a copy, and the ones placed after them     */
+/*--------------------------------------------------------------------------*/
+static void writePlaced(ostream& out, const COPY& host, 
+		const CLONEOPTIONS* copts, const COPYPLACEMENT* placement)
+{
+	if (placement == NULL)
+		return;
+
+	auto a = placement->after.find(host);
+	if (a == placement->after.end())
+		return;
+
+	for (auto& c : a->second)
+	{
+		stringstream sn;
+		sn << "r" << c.second << "_" << c.first->name;
+
+		out << getAttributes(copts, c.first, sn.str()) << c.first->pre 
+			<< sn.str();
+		writeBody(out, copts, c.first, c.second);
+		out << endl;
+
+		writePlaced(out, c, copts, placement);
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write a definition followed by its copies, the body of each copy (0 is   */
+/* the original) is written by the callback                                 */
+/*--------------------------------------------------------------------------*/
+void WriteRepetitions(ostream& out, const METHOD* m, 
+		const CLONEOPTIONS* copts, const BODYWRITER& body, 
+		const COPYPLACEMENT* placement)
+{
+	if (copts->original)
+		out << getAttributes(copts, m, m->name);
+
+	out << m->pre << m->name;
+	body(out, 0);
+	out << endl;
+
+	writePlaced(out, COPY(m, 0), copts, placement);
+
+	for (int i = 1; i <= m->repeats; i++)
+	{
+		if (placement != NULL && placement->moved.count(COPY(m, i)) > 0)
+			continue;
+
+		stringstream sn;
+		sn << "r" << i << "_" << m->name;
+
+		out << getAttributes(copts, m, sn.str()) << m->pre << sn.str();
+		body(out, i);
+		out << endl;
+
+		writePlaced(out, COPY(m, i), copts, placement);
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Find the copy of a caller that calls each copy the most, once the calls  */
+/* are bound by the affinity redirection, and place the copy after it       */
+/*--------------------------------------------------------------------------*/
+static void placeCopies(const CALLTREE* tree, int seed, 
+		COPYPLACEMENT* placement)
+{
+	const CALLGRAPH& g = tree->graph;
+
+	// Calls from each copy of a caller to each copy of a callee
+	map<COPY, map<COPY, int64> > weights;
+
+	for (size_t i = 0; i < g.nodes.size(); i++)
+	{
+		const METHOD* caller = g.nodes[i];
+
+		for (int e = g.offsets[i]; e < g.offsets[i+1]; e++)
+		{
+			const METHOD* callee = g.nodes[g.callees[e]];
+
+			// Only a definition further down the same file can take
+			// the copy, anything its body uses is already declared
+
+			if (callee == caller || callee->repeats == 0 || 
+					callee->file != caller->file ||
+					callee->location.begin >= caller->location.begin)
+				continue;
+
+			for (int c = 0; c <= caller->repeats; c++)
+			{
+				int k = AffinityCopy(caller, c, callee, seed);
+				weights[COPY(callee, k)][COPY(caller, c)] += g.sites[e];
+			}
+		}
+	}
+
+	// The ties go to the smallest id and copy, so the placement does
+	// not depend on the order of the maps
+
+	for (auto& w : weights)
+	{
+		const COPY* host = NULL;
+		int64 best = 0;
+
+		for (auto& h : w.second)
+		{
+			if (host == NULL || h.second > best || (h.second == best && 
+					(h.first.first->id < host->first->id || 
+					(h.first.first == host->first && 
+					h.first.second < host->second))))
+			{
+				host = &h.first;
+				best = h.second;
+			}
+		}
+
+		placement->moved.insert(w.first);
+		placement->after[*host].push_back(w.first);
+	}
+
+	for (auto& a : placement->after)
+	{
+		sort(a.second.begin(), a.second.end(), 
+			[](const COPY& x, const COPY& y) {
+				if (x.first->id != y.first->id)
+					return x.first->id < y.first->id;
+				return x.second < y.second;
+			});
+	}
+}
+
+
 /*--------------------------------------------------------------------------*/
 /* Matcher for the methods                                                  */
 /*--------------------------------------------------------------------------*/
@@ -55,7 +295,13 @@ private:
 
 	const LangOptions* lopt;
 	const CALLTREE* tree;
+	const CLONEOPTIONS* copts;
+	const COPYPLACEMENT* placement;
 	Replacements* replacements;
+	LocationCache locations;
+
+	// Files of the translation unit that already define the counters
+	set<FileID> counters;
 
 	int runFD(const FunctionDecl *md, SourceManager &sm)
 	{
@@ -71,12 +317,12 @@ private:
 		auto m = method->second;
 
 		if (m->repeats == 0)
-			return 0;
+			return this->runHostFD(md, sm, m);
 		
 		DeclarationNameInfo info = md->getNameInfo();
 
 		FullSourceLoc b(md->getLocStart(), sm), _e(md->getLocEnd(), sm);
-		FullSourceLoc e(clang::Lexer::getLocForEndOfToken(_e, 0, sm, *this->lopt), sm);
+		FullSourceLoc e(this->locations.getLocForEndOfToken(_e, sm), sm);
 
 		stringstream ss;
 		string pre, post;
@@ -87,11 +333,11 @@ private:
 			// to scramble the calls after... bummer...
 			
 			FullSourceLoc b(md->getLocStart(), sm), _e(md->getLocEnd(), sm);
-			FullSourceLoc e(clang::Lexer::getLocForEndOfToken(_e, 0, sm, *this->lopt), sm);
+			FullSourceLoc e(this->locations.getLocForEndOfToken(_e, sm), sm);
 			
 			SourceRange nameRange = SourceRange(info.getLoc());
 			FullSourceLoc d(nameRange.getBegin(), sm), _f(nameRange.getEnd(), sm);
-			FullSourceLoc f(clang::Lexer::getLocForEndOfToken(_f, 0, sm, *this->lopt), sm);
+			FullSourceLoc f(this->locations.getLocForEndOfToken(_f, sm), sm);
 
 			string start(sm.getCharacterData(b), sm.getCharacterData(d)-sm.getCharacterData(b));
 			string end(sm.getCharacterData(f), sm.getCharacterData(e)-sm.getCharacterData(f));
@@ -101,6 +347,16 @@ private:
 
 			//pre = "A";
 			//post = "A";
+
+			// Declarations in headers can't be touched, so the new ones
+			// go right after the include that brought them in
+
+			if (this->tree->mainonly && !sm.isInMainFile(md->getLocation()))
+				return this->runHeaderFD(md, sm, m, pre, post);
+
+			if (this->copts->prototypes == PM_Minimal && 
+					!this->needsDeclarations(md, sm, m))
+				return 0;
 		}
 		else
 		{
@@ -128,7 +384,7 @@ private:
 				SourceLocation ne = p->getLocEnd();
 
 				FullSourceLoc b(bs, sm), _e(ne, sm);
-				FullSourceLoc e(clang::Lexer::getLocForEndOfToken(_e, 0, sm, *this->lopt), sm);
+				FullSourceLoc e(this->locations.getLocForEndOfToken(_e, sm), sm);
 			
 				string sparam(sm.getCharacterData(b), sm.getCharacterData(e)-sm.getCharacterData(b));
 				sp << sparam;
@@ -141,29 +397,67 @@ private:
 			SourceLocation ne = info.getLocEnd();
 
 			FullSourceLoc _b(ne, sm), e(bs, sm);
-			FullSourceLoc b(clang::Lexer::getLocForEndOfToken(_b, 0, sm, *this->lopt), sm);
+			FullSourceLoc b(this->locations.getLocForEndOfToken(_b, sm), sm);
 
 			string prototype(sm.getCharacterData(b), sm.getCharacterData(e)-sm.getCharacterData(b));
 
-			// Furiously generate prototypes
+			// The parameter declarations of K&R can't be in a prototype
+			if (!m->proto.empty())
+				prototype = m->proto;
+
+			// Furiously generate prototypes, or only when the method is
+			// recursive since the copies follow the original, a copy of a
+			// cycle may be reached through the other methods before it is
+			// defined
 			
 			//pre = "B";
 			//post = "B";
 
-			ss << pre << name << prototype << ";" << endl;
+			// The counter macro goes before the first definition of
+			// each file that uses it
+
+			FileID file = sm.getFileID(sm.getExpansionLoc(md->getLocation()));
+
+			if (this->copts->counters && this->counters.insert(file).second)
+				ss << endl << counterMacro;
+
+			bool all = this->copts->prototypes == PM_All;
+
+			if (all)
+				ss << pre << name << prototype << ";" << endl;
+
+			bool self = all || m->recursive;
+
 			for (int i = 1; i <= m->repeats; i++)
 			{
+				// The copies placed after their caller are called
+				// before they are defined
+
+				if (!self && this->placement->moved.count(COPY(m, i)) == 0)
+					continue;
+
 				ss << pre << "r" << i << "_" <<
 					name << prototype << ";" << endl;
 			}
 		}
 
-		ss << pre << name << post << endl;
-		for (int i = 1; i <= m->repeats; i++)
+		if (!md->isThisDeclarationADefinition())
 		{
-			ss << pre << "r" << i << "_" << 
-				name << post << endl;
+			ss << pre << name << post << endl;
+			for (int i = 1; i <= m->repeats; i++)
+				ss << pre << "r" << i << "_" << name << post << endl;
+		}
+		else if (!this->copts->stream)
+		{
+			const CLONEOPTIONS* copts = this->copts;
+
+			WriteRepetitions(ss, m, copts, [m, copts](ostream& out, int i) {
+					writeBody(out, copts, m, i);
+				}, this->placement);
 		}
+
+		// When streaming, only the prototypes replace the definition,
+		// the copies are written along with the file
 	
 		CharSourceRange range = CharSourceRange::
 			getTokenRange(SourceRange(b, e));
@@ -173,13 +467,115 @@ private:
 		return 0;
 	}
 
+	// A method that is not repeated may still be the caller some copies
+	// are placed after
+
+	int runHostFD(const FunctionDecl *md, SourceManager &sm, 
+			const METHOD* m)
+	{
+		if (!md->isThisDeclarationADefinition() || 
+				this->placement->after.count(COPY(m, 0)) == 0)
+			return 0;
+
+		FullSourceLoc _e(md->getLocEnd(), sm);
+		FullSourceLoc e(this->locations.getLocForEndOfToken(_e, sm), sm);
+
+		stringstream ss;
+		ss << endl;
+
+		FileID file = sm.getFileID(sm.getExpansionLoc(md->getLocation()));
+
+		if (this->copts->counters && this->counters.insert(file).second)
+			ss << counterMacro;
+
+		writePlaced(ss, COPY(m, 0), this->copts, this->placement);
+
+		string s = ss.str();
+		s.erase(s.size() - 1);
+
+		this->replacements->insert(Replacement(sm, 
+			CharSourceRange::getCharRange(e, e), s));
+
+		return 0;
+	}
+
+	// A declaration only needs the copies if some call can see it before
+	// the copies are defined, headers may be seen by any other file
+
+	bool needsDeclarations(const FunctionDecl *md, SourceManager &sm, 
+			const METHOD* m)
+	{
+		SourceLocation l = sm.getExpansionLoc(md->getLocation());
+
+		if (!sm.isInMainFile(l))
+			return true;
+
+		string file = sm.getFilename(l).str();
+
+		auto c = m->firstcalls.find(file);
+		if (c == m->firstcalls.end())
+			return false;
+
+		return file != m->file || c->second < m->location.begin;
+	}
+
+	int runHeaderFD(const FunctionDecl *md, SourceManager &sm, 
+			const METHOD* m, const string& pre, const string& post)
+	{
+		FileID f = sm.getFileID(sm.getExpansionLoc(md->getLocation()));
+		SourceLocation inc = sm.getIncludeLoc(f);
+
+		while (inc.isValid() && !sm.isInMainFile(inc))
+			inc = sm.getIncludeLoc(sm.getFileID(inc));
+
+		if (inc.isInvalid())
+			return 0;
+
+		// Skip to the end of the include line
+
+		const char* p = sm.getCharacterData(inc);
+		const char* q = p;
+
+		while (*q != '\0' && *q != '\n')
+			q++;
+
+		stringstream ss;
+		ss << endl;
+
+		for (int i = 1; i <= m->repeats; i++)
+		{
+			ss << pre << "r" << i << "_" << 
+				m->name << post << endl;
+		}
+
+		string s = ss.str();
+		s.erase(s.size() - 1);
+
+		SourceLocation eol = inc.getLocWithOffset((int)(q - p));
+		this->replacements->insert(Replacement(sm, 
+			CharSourceRange::getCharRange(eol, eol), s));
+
+		return 0;
+	}
+
 public:
 
-	TreeRepeater(const LangOptions* lopt, const CALLTREE* tree, Replacements* repl) : 
+	TreeRepeater(const LangOptions* lopt, const CALLTREE* tree, 
+			const CLONEOPTIONS* copts, const COPYPLACEMENT* placement, 
+			Replacements* repl) : 
 		lopt(lopt),
 		tree(tree),
-		replacements(repl)
+		copts(copts),
+		placement(placement),
+		replacements(repl),
+		locations(lopt)
+	{
+	}
+
+	virtual void onStartOfTranslationUnit()
 	{
+		this->locations.clear();
+		this->counters.clear();
 	}
 
 	virtual void run(const MatchFinder::MatchResult &Result) 
@@ -195,7 +591,8 @@ public:
 /* Repeat the methods in the tree                                           */
 /*--------------------------------------------------------------------------*/
 int RepeatCallTree(RefactoringTool& tool, const LangOptions* lopt, 
-		const CALLTREE* tree, int seed, int maxselect, int maxrepeat)
+		CALLTREE* tree, int seed, int maxselect, int maxrepeat, 
+		int64 maxcallsites, const CLONEOPTIONS* copts)
 {
 	srand(seed);
 
@@ -203,24 +600,21 @@ int RepeatCallTree(RefactoringTool& tool, const LangOptions* lopt,
 
 	Replacements& replacements = tool.getReplacements();
 
+	TraceSpan span("selection", "repeat");
+
 	for (auto& m : tree->methods)
 	{
 		m.second->repeats = 0;
-		methods.push_back(m.second);
-	}
 
-	if (maxselect < 0)
-	{
-		maxselect = (int)round((double)maxselect / 100.0 * 
-				(double)tree->methods.size());
-	}
-	else
-	{
-		maxselect = (maxselect > (int)tree->methods.size()) ? 
-			tree->methods.size() : maxselect;
+		if (copts->policies[m.second->kind] != MP_Skip)
+			methods.push_back(m.second);
 	}
 
-	for (int i = 0; i < maxselect; i++)
+	// The percentage is taken over the methods the policies let through
+
+	maxselect = (int)ResolveLimit(maxselect, (int64)methods.size());
+
+	for (int i = 0; i < maxselect && !methods.empty(); i++)
 	{
 		int p = random(0, (int)methods.size()-1);
 		int r = random(0, maxrepeat);
@@ -232,13 +626,46 @@ int RepeatCallTree(RefactoringTool& tool, const LangOptions* lopt,
 		methods.erase(e);
 	}
 
+	// Each copy of a caller repeats its call sites, so the number of
+	// calls can explode before the redirection even starts
+
+	if (maxcallsites > 0)
+	{
+		int64 predicted = PredictCallSites(tree);
+		int64 bounded = BoundCallTree(tree, maxcallsites);
+
+		if (bounded != predicted)
+		{
+			stringstream ss;
+			ss << "bounded " << predicted << " call sites to " << bounded;
+			message(ss.str());
+		}
+	}
+
+	COPYPLACEMENT placement;
+
+	if (copts->placement == CP_Caller)
+		placeCopies(tree, copts->reseed, &placement);
+
+	span.end();
+
+	// K&R definitions left alone by the repetition still need their
+	// header fixed, the repeated ones already use the converted text
+
+	for (auto& f : tree->knrfixes)
+	{
+		if (f.first == NULL || f.first->repeats == 0)
+			replacements.insert(f.second);
+	}
+
 	MatchFinder matchFinder;
-	TreeRepeater treeRepeater(lopt, tree, &replacements);
+	TreeRepeater treeRepeater(lopt, tree, copts, &placement, 
+			&replacements);
 
 	DeclarationMatcher methodMatcher = functionDecl().bind("id");
 	matchFinder.addMatcher(methodMatcher, &treeRepeater);
 
-	assert_tool(tool.runAndSave(newFrontendActionFactory(&matchFinder).get()));
+	assert_tool(tool.run(newTracedActionFactory(&matchFinder, "repeat").get()));
 
 	return 0;
 }
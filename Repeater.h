@@ -24,10 +24,12 @@
 #include <unordered_map>
 #include <stdexcept>
 #include <sstream>
+#include <functional>
 #include <stdlib.h>
 
 #include "Crowbar.h"
 #include "CallTree.h"
+#include "Profile.h"
 
 using namespace clang;
 using namespace clang::ast_matchers;
@@ -35,5 +37,68 @@ using namespace clang::tooling;
 using namespace llvm;
 using namespace std;
 
+enum PrototypeMode
+{
+	PM_Minimal,
+	PM_All,
+};
+
+enum ClonePlacement
+{
+	CP_Original,
+	CP_Caller,
+};
+
+enum MethodPolicy
+{
+	MP_Free,
+	MP_Inlinable,
+	MP_Skip,
+};
+
+struct CLONEOPTIONS
+{
+	// Placement attributes for the definitions of the copies
+	bool cold;
+	bool noinline;
+	string section;
+
+	// Decorate the original method as well
+	bool original;
+
+	// With a profile, methods called at least hot times are marked 
+	// hot and the others cold instead
+	const PROFILE* profile;
+	int64 hot;
+
+	// Which prototypes and declarations of the copies are written
+	PrototypeMode prototypes;
+
+	// The definitions are left for the streaming writer
+	bool stream;
+
+	// Count the calls of the original and of each copy at run time
+	bool counters;
+
+	// Write each copy after the copy of its main caller that is bound
+	// to it, by the affinity redirection seeded with reseed
+	ClonePlacement placement;
+	int reseed;
+
+	// What each class of method is allowed, skipped methods are never
+	// repeated and inlinable ones get none of the attributes above
+	MethodPolicy policies[MC_Count];
+};
+
+struct COPYPLACEMENT;
+
+// Writes the body of a copy of a method, 0 is the original
+typedef function<void(ostream&, int)> BODYWRITER;
+
+void WriteRepetitions(ostream& out, const METHOD* m, 
+		const CLONEOPTIONS* copts, const BODYWRITER& body, 
+		const COPYPLACEMENT* placement = NULL);
+
 int RepeatCallTree(RefactoringTool& tool, const LangOptions* lopt, 
-		const CALLTREE* tree, int seed, int maxselect, int maxrepeat);
+		CALLTREE* tree, int seed, int maxselect, int maxrepeat, 
+		int64 maxcallsites, const CLONEOPTIONS* copts);
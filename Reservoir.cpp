@@ -0,0 +1,110 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+#include "Reservoir.h"
+
+using namespace std;
+
+
+/*--------------------------------------------------------------------------*/
+/* FNV-1a, stable across runs and platforms unlike std::hash                */
+/*--------------------------------------------------------------------------*/
+uint64_t HashString(const string& s, uint64_t h)
+{
+	h ^= 14695981039346656037ULL;
+
+	for (unsigned char c : s)
+	{
+		h ^= c;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* splitmix64 finalizer over the running hash                               */
+/*--------------------------------------------------------------------------*/
+uint64_t HashNumber(uint64_t v, uint64_t h)
+{
+	uint64_t z = h + v + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+
+static bool keyGreater(const RESERVOIRITEM& a, const RESERVOIRITEM& b)
+{
+	// Ties are broken by the id so the sample never depends on the
+	// order the items were offered
+	return a.key > b.key || (a.key == b.key && a.id > b.id);
+}
+
+
+Reservoir::Reservoir(size_t k, uint64_t seed) : 
+	k(k),
+	seed(seed)
+{
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* log(u)/w orders the items like u^(1/w) without losing precision          */
+/*--------------------------------------------------------------------------*/
+double Reservoir::getKey(uint64_t id, double weight) const
+{
+	uint64_t h = HashNumber(id, this->seed);
+	double u = ((double)(h >> 11) + 0.5) / 9007199254740992.0;
+	return log(u) / weight;
+}
+
+
+void Reservoir::offer(uint64_t id, double weight, void* data)
+{
+	if (weight <= 0.0 || this->k == 0)
+		return;
+
+	RESERVOIRITEM item;
+	item.key = this->getKey(id, weight);
+	item.id = id;
+	item.data = data;
+
+	this->offer(item);
+}
+
+
+void Reservoir::offer(const RESERVOIRITEM& item)
+{
+	if (this->heap.size() < this->k)
+	{
+		this->heap.push_back(item);
+		push_heap(this->heap.begin(), this->heap.end(), keyGreater);
+		return;
+	}
+
+	if (this->k == 0 || !keyGreater(item, this->heap.front()))
+		return;
+
+	pop_heap(this->heap.begin(), this->heap.end(), keyGreater);
+	this->heap.back() = item;
+	push_heap(this->heap.begin(), this->heap.end(), keyGreater);
+}
+
+
+const vector<RESERVOIRITEM>& Reservoir::getItems() const
+{
+	return this->heap;
+}
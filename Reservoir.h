@@ -0,0 +1,52 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+struct RESERVOIRITEM
+{
+	double key;
+	uint64_t id;
+	void* data;
+};
+
+/*--------------------------------------------------------------------------*/
+/* Weighted sample of k items out of a stream (A-Res). The keys depend only */
+/* on the item id, the seed and the weight, so the sample does not depend   */
+/* on the order the items are offered                                       */
+/*--------------------------------------------------------------------------*/
+class Reservoir
+{
+private:
+
+	size_t k;
+	uint64_t seed;
+
+	// Min-heap on the key, the root is the first item to go
+	vector<RESERVOIRITEM> heap;
+
+public:
+
+	Reservoir(size_t k, uint64_t seed);
+
+	double getKey(uint64_t id, double weight) const;
+
+	void offer(uint64_t id, double weight, void* data);
+	void offer(const RESERVOIRITEM& item);
+
+	const vector<RESERVOIRITEM>& getItems() const;
+};
+
+uint64_t HashString(const string& s, uint64_t h);
+uint64_t HashNumber(uint64_t v, uint64_t h);
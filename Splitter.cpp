@@ -0,0 +1,649 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Refactoring.h"
+#include "clang/AST/ASTContext.h"
+#include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <sstream>
+#include <algorithm>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+#include "LocationCache.h"
+#include "Output.h"
+#include "Trace.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+struct CLONEMOVE
+{
+	string name;
+	string text;
+	string prototype;
+	int64 begin, end;
+};
+
+struct SPLITFILE
+{
+	string path;
+	string directives;
+
+	// Outermost #if ... #endif blocks, a copy inside one of them 
+	// would lose its condition in a sibling
+	vector<FILERANGE> conditionals;
+
+	vector<CLONEMOVE> moves;
+
+	// Declarations of the copies inside the file, removed if 
+	// the copy is moved
+	multimap<string, FILERANGE> decls;
+
+	// Prototypes of the file's own methods called from the 
+	// moved copies
+	map<string, string> externs;
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Tell if some line of the text is a preprocessor directive                */
+/*--------------------------------------------------------------------------*/
+static bool hasDirective(const string& text)
+{
+	bool start = true;
+
+	for (char c : text)
+	{
+		if (c == '\n')
+			start = true;
+		else if (start && c == '#')
+			return true;
+		else if (c != ' ' && c != '\t' && c != '\r')
+			start = false;
+	}
+
+	return false;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Tell if a definition can live outside its file: everything it refers to  */
+/* must be declared somewhere else, or be a non-static method of the file   */
+/* that can be prototyped in the generated header                           */
+/*--------------------------------------------------------------------------*/
+class MovableChecker : public RecursiveASTVisitor<MovableChecker>
+{
+private:
+
+	SourceManager& sm;
+	const FunctionDecl* fd;
+	unsigned body, bodyend;
+
+	bool fileLocal(const Decl* d)
+	{
+		for (const Decl* r : d->redecls())
+		{
+			if (!sm.isInMainFile(sm.getExpansionLoc(r->getLocation())))
+				return false;
+		}
+
+		return true;
+	}
+
+public:
+
+	bool movable;
+	set<const FunctionDecl*> externs;
+
+	MovableChecker(SourceManager& sm, const FunctionDecl* fd) :
+		sm(sm),
+		fd(fd),
+		movable(true)
+	{
+		const Stmt* b = fd->getBody();
+		body = sm.getFileOffset(sm.getExpansionLoc(b->getLocStart()));
+		bodyend = sm.getFileOffset(sm.getExpansionLoc(b->getLocEnd()));
+	}
+
+	bool VisitDeclRefExpr(DeclRefExpr* e)
+	{
+		const ValueDecl* d = e->getDecl();
+
+		if (const VarDecl* v = dyn_cast<VarDecl>(d))
+		{
+			if (v->getDeclContext() == fd || v->isLocalVarDecl() || 
+					isa<ParmVarDecl>(v))
+				return true;
+		}
+
+		if (!this->fileLocal(d))
+			return true;
+
+		const FunctionDecl* f = dyn_cast<FunctionDecl>(d);
+
+		if (f != NULL && f->isExternallyVisible())
+		{
+			this->externs.insert(f);
+			return true;
+		}
+
+		this->movable = false;
+		return false;
+	}
+
+	bool VisitTagTypeLoc(TagTypeLoc tl)
+	{
+		if (this->fileLocal(tl.getDecl()))
+			this->movable = false;
+
+		return this->movable;
+	}
+
+	bool VisitTypedefTypeLoc(TypedefTypeLoc tl)
+	{
+		if (this->fileLocal(tl.getTypedefNameDecl()))
+			this->movable = false;
+
+		return this->movable;
+	}
+
+	bool VisitStmt(Stmt* s)
+	{
+		SourceLocation l = s->getLocStart();
+
+		if (!l.isMacroID())
+			return true;
+
+		// Macro arguments are spelled inside the body, but the
+		// macro itself can't be defined in the file
+
+		SourceLocation sp = sm.getSpellingLoc(l);
+
+		if (sm.isInMainFile(sp))
+		{
+			unsigned o = sm.getFileOffset(sp);
+			if (o < body || o > bodyend)
+				this->movable = false;
+		}
+
+		return this->movable;
+	}
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Matcher for the repetitions                                              */
+/*--------------------------------------------------------------------------*/
+class TreeSplitter : public MatchFinder::MatchCallback
+{
+private:
+
+	const LangOptions* lopt;
+	unordered_map<string, const METHOD*> clones;
+	map<string, SPLITFILE> files;
+	LocationCache locations;
+
+	int64 tokenEnd(SourceLocation l, SourceManager& sm)
+	{
+		SourceLocation e = this->locations.getLocForEndOfToken(l, sm);
+		return (int64)sm.getFileOffset(e);
+	}
+
+	string prototypeOf(const FunctionDecl* md, SourceManager &sm)
+	{
+		SourceLocation b = sm.getExpansionLoc(md->getLocStart());
+		int64 begin = sm.getFileOffset(b);
+		int64 end;
+
+		if (md->hasBody() && md->isThisDeclarationADefinition())
+		{
+			SourceLocation bs = sm.getExpansionLoc(md->getBody()->getLocStart());
+			end = sm.getFileOffset(bs);
+		}
+		else
+		{
+			end = this->tokenEnd(sm.getExpansionLoc(md->getLocEnd()), sm);
+		}
+
+		string s(sm.getCharacterData(b), (size_t)(end - begin));
+
+		size_t t = s.find_last_not_of(" \t\r\n");
+		return s.substr(0, t + 1) + ";";
+	}
+
+	SPLITFILE& getFile(SourceManager &sm)
+	{
+		FileID main = sm.getMainFileID();
+		string path = sm.getFileEntryForID(main)->getName();
+
+		SPLITFILE& f = this->files[path];
+
+		if (f.path.empty())
+		{
+			f.path = path;
+			f.directives = this->getDirectives(sm.getBufferData(main));
+			f.conditionals = this->getConditionals(sm.getBufferData(main));
+		}
+
+		return f;
+	}
+
+	// Keep every preprocessor line, including the conditionals, so 
+	// the copies see the same headers as the original
+
+	string getDirectives(StringRef buffer)
+	{
+		stringstream ss;
+		bool continued = false;
+
+		size_t p = 0;
+		while (p < buffer.size())
+		{
+			size_t e = buffer.find('\n', p);
+			if (e == StringRef::npos)
+				e = buffer.size();
+
+			StringRef line = buffer.substr(p, e - p);
+			StringRef t = line.ltrim(" \t");
+
+			if (continued || t.startswith("#"))
+			{
+				ss << line.str() << endl;
+				continued = line.rtrim("\r").endswith("\\");
+			}
+
+			p = e + 1;
+		}
+
+		return ss.str();
+	}
+
+	// The lines from each outermost #if, #ifdef or #ifndef to its #endif
+
+	vector<FILERANGE> getConditionals(StringRef buffer)
+	{
+		vector<FILERANGE> blocks;
+		FILERANGE r = { 0, 0 };
+		int depth = 0;
+		bool continued = false;
+
+		size_t p = 0;
+		while (p < buffer.size())
+		{
+			size_t e = buffer.find('\n', p);
+			if (e == StringRef::npos)
+				e = buffer.size();
+
+			StringRef line = buffer.substr(p, e - p);
+			StringRef t = line.ltrim(" \t");
+
+			if (!continued && t.startswith("#"))
+			{
+				StringRef d = t.substr(1).ltrim(" \t");
+
+				if (d.startswith("if"))
+				{
+					if (depth++ == 0)
+						r.begin = (int64)p;
+				}
+				else if (d.startswith("endif") && depth > 0)
+				{
+					if (--depth == 0)
+					{
+						r.end = (int64)e;
+						blocks.push_back(r);
+					}
+				}
+			}
+
+			continued = line.rtrim("\r").endswith("\\");
+			p = e + 1;
+		}
+
+		// An unterminated block runs to the end of the file
+
+		if (depth > 0)
+		{
+			r.end = (int64)buffer.size();
+			blocks.push_back(r);
+		}
+
+		return blocks;
+	}
+
+	bool inConditional(const SPLITFILE& f, int64 offset)
+	{
+		for (auto& r : f.conditionals)
+		{
+			if (offset >= r.begin && offset < r.end)
+				return true;
+		}
+
+		return false;
+	}
+
+	// The range of a definition or declaration along with the ';' of
+	// a declaration and the end of the line
+
+	FILERANGE getRange(const FunctionDecl *md, SourceManager &sm, bool decl)
+	{
+		FILERANGE r;
+		r.begin = sm.getFileOffset(sm.getExpansionLoc(md->getLocStart()));
+		r.end = this->tokenEnd(sm.getExpansionLoc(md->getLocEnd()), sm);
+
+		StringRef buffer = sm.getBufferData(sm.getMainFileID());
+
+		size_t e = (size_t)r.end;
+
+		if (decl)
+		{
+			size_t s = buffer.find_first_not_of(" \t\r\n", e);
+			if (s != StringRef::npos && buffer[s] == ';')
+				e = s + 1;
+		}
+
+		size_t s = buffer.find_first_not_of(" \t\r", e);
+		if (s != StringRef::npos && buffer[s] == '\n')
+			e = s + 1;
+
+		r.end = (int64)e;
+		return r;
+	}
+
+	int runFD(const FunctionDecl *md, SourceManager &sm)
+	{
+		if (md->isImplicit())
+			return 0;
+
+		if (!sm.isInMainFile(sm.getExpansionLoc(md->getLocation())))
+			return 0;
+
+		string name = md->getNameAsString();
+
+		auto clone = this->clones.find(name);
+		if (clone == this->clones.end())
+			return 0;
+
+		SPLITFILE& f = this->getFile(sm);
+
+		if (!md->isThisDeclarationADefinition())
+		{
+			f.decls.insert(make_pair(name, this->getRange(md, sm, true)));
+			return 0;
+		}
+
+		// Static and inline methods must stay where they are
+
+		if (md->getStorageClass() == SC_Static || md->isInlineSpecified())
+			return 0;
+
+		MovableChecker checker(sm, md);
+		checker.TraverseDecl(const_cast<FunctionDecl*>(md));
+
+		if (!checker.movable)
+			return 0;
+
+		CLONEMOVE m;
+		m.name = name;
+
+		FILERANGE r = this->getRange(md, sm, false);
+		m.begin = r.begin;
+		m.end = r.end;
+
+		StringRef buffer = sm.getBufferData(sm.getMainFileID());
+		m.text = buffer.substr((size_t)r.begin, (size_t)(r.end - r.begin)).str();
+
+		// Directives inside the body would be evaluated in another context,
+		// and the siblings don't repeat the conditionals around it
+		if (hasDirective(m.text) || this->inConditional(f, r.begin))
+			return 0;
+
+		// The prototypes of the file's methods go to the header too
+
+		for (const FunctionDecl* e : set<const FunctionDecl*>(checker.externs))
+		{
+			TypeSourceInfo* si = e->getTypeSourceInfo();
+			if (si != NULL)
+				checker.TraverseTypeLoc(si->getTypeLoc());
+		}
+
+		if (!checker.movable)
+			return 0;
+
+		m.prototype = this->prototypeOf(md, sm);
+
+		for (const FunctionDecl* e : checker.externs)
+		{
+			string ename = e->getNameAsString();
+			if (f.externs.find(ename) == f.externs.end())
+				f.externs[ename] = this->prototypeOf(e, sm);
+		}
+
+		f.moves.push_back(m);
+		return 0;
+	}
+
+public:
+
+	TreeSplitter(const LangOptions* lopt, const CALLTREE* tree) : 
+		lopt(lopt),
+		locations(lopt)
+	{
+		for (auto& m : tree->methods)
+		{
+			for (int i = 1; i <= m.second->repeats; i++)
+			{
+				stringstream ss;
+				ss << 'r' << i << '_' << m.second->name;
+				this->clones[ss.str()] = m.second;
+			}
+		}
+	}
+
+	map<string, SPLITFILE>& getFiles()
+	{
+		return this->files;
+	}
+
+	virtual void onStartOfTranslationUnit()
+	{
+		this->locations.clear();
+	}
+
+	virtual void run(const MatchFinder::MatchResult &Result) 
+	{
+		SourceManager &sm = Result.Context->getSourceManager();
+		if (const FunctionDecl *md = Result.Nodes.getNodeAs<clang::FunctionDecl>("id"))
+			this->runFD(md, sm);
+	}
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Name of a generated sibling of path                                      */
+/*--------------------------------------------------------------------------*/
+static size_t extensionOf(const string& path)
+{
+	size_t slash = path.rfind('/');
+	size_t dot = path.rfind('.');
+
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = path.size();
+
+	return dot;
+}
+
+static string siblingPath(const string& path, const string& suffix)
+{
+	return path.substr(0, extensionOf(path)) + suffix;
+}
+
+static string baseName(const string& path)
+{
+	size_t slash = path.rfind('/');
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write the header and the siblings of a file, the moved copies go to the  */
+/* smallest sibling so far                                                  */
+/*--------------------------------------------------------------------------*/
+static int writeSplit(SPLITFILE& f, int nsplit, Replacements& replacements, 
+		OutputStage* output, map<string, string>* siblings)
+{
+	string header = siblingPath(f.path, ".crowbar.h");
+
+	set<string> moved;
+	vector<FILERANGE> removed;
+
+	for (auto& m : f.moves)
+	{
+		FILERANGE r = { m.begin, m.end };
+		removed.push_back(r);
+		moved.insert(m.name);
+	}
+
+	// The prototypes of the moved copies now come from the header
+
+	for (auto& d : f.decls)
+	{
+		if (moved.find(d.first) != moved.end())
+			removed.push_back(d.second);
+	}
+
+	sort(removed.begin(), removed.end(), 
+		[](const FILERANGE& a, const FILERANGE& b) { 
+			return a.begin < b.begin; 
+		});
+
+	// The include takes the place of the first thing removed, an
+	// insertion at the same offset would be removed along with it
+
+	for (size_t i = 0; i < removed.size(); i++)
+	{
+		string text = (i == 0) ? 
+			"#include \"" + baseName(header) + "\"\n" : "";
+
+		replacements.insert(Replacement(f.path, (unsigned)removed[i].begin, 
+			(unsigned)(removed[i].end - removed[i].begin), text));
+	}
+
+	// Header
+
+	string guard = "CROWBAR_" + baseName(header);
+	for (auto& c : guard)
+		c = isalnum((unsigned char)c) ? (char)toupper((unsigned char)c) : '_';
+
+	stringstream h;
+	h << "#ifndef " << guard << endl 
+	  << "#define " << guard << endl << endl;
+
+	for (auto& e : f.externs)
+		h << e.second << endl;
+
+	for (auto& m : f.moves)
+		h << m.prototype << endl;
+
+	h << endl << "#endif" << endl;
+
+	output->write(header, h.str());
+
+	cout << "!split," << header << endl;
+
+	// Siblings
+
+	vector<string> bodies(nsplit);
+	vector<int64> sizes(nsplit, 0);
+
+	for (auto& m : f.moves)
+	{
+		int k = (int)(min_element(sizes.begin(), sizes.end()) - sizes.begin());
+		bodies[k] += m.text + "\n";
+		sizes[k] += (int64)m.text.size();
+	}
+
+	for (int k = 0; k < nsplit; k++)
+	{
+		if (sizes[k] == 0)
+			continue;
+
+		// The siblings are compiled as the same language as the source
+
+		string ext = f.path.substr(extensionOf(f.path));
+
+		stringstream ss;
+		ss << ".crowbar" << (k + 1) << (ext.empty() ? ".c" : ext);
+		string sibling = siblingPath(f.path, ss.str());
+
+		stringstream s;
+		s << f.directives << endl
+		  << "#include \"" << baseName(header) << "\"" << endl << endl
+		  << bodies[k];
+
+		output->write(sibling, s.str());
+		(*siblings)[sibling] = f.path;
+
+		cout << "!split," << sibling << endl;
+	}
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Move the repetitions to sibling translation units, and tell the source   */
+/* each sibling came from                                                   */
+/*--------------------------------------------------------------------------*/
+int SplitCallTree(RefactoringTool& tool, const LangOptions* lopt, 
+		const CALLTREE* tree, int nsplit, OutputStage* output, 
+		map<string, string>* siblings)
+{
+	MatchFinder matchFinder;
+	TreeSplitter treeSplitter(lopt, tree);
+
+	DeclarationMatcher methodMatcher = functionDecl().bind("id");
+	matchFinder.addMatcher(methodMatcher, &treeSplitter);
+
+	assert_tool(tool.run(newTracedActionFactory(&matchFinder, "split").get()));
+
+	Replacements& replacements = tool.getReplacements();
+
+	for (auto& f : treeSplitter.getFiles())
+	{
+		if (f.second.moves.empty())
+			continue;
+
+		assert_phase(writeSplit(f.second, nsplit, replacements, output, 
+				siblings));
+	}
+
+	return 0;
+}
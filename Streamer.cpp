@@ -0,0 +1,270 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Refactoring.h"
+
+#include <string>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+#include "Repeater.h"
+#include "Redirector.h"
+#include "Output.h"
+#include "Streamer.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// A redirected call, it only applies to the copy clone of the text
+// that encloses it (0 for the original source)
+struct STREAMEDIT
+{
+	int64 offset;
+	int clone;
+	int redirect;
+	const METHOD* callee;
+};
+
+typedef vector<STREAMEDIT>::const_iterator EDITITER;
+
+
+/*--------------------------------------------------------------------------*/
+/* Give each copy of a repeated caller its own call sites, in the order     */
+/* they would be found in the repeated source                               */
+/*--------------------------------------------------------------------------*/
+static void expandCallSites(CALLTREE* tree)
+{
+	for (auto& m : tree->methods)
+	{
+		vector<CALLSITE*>& calls = m.second->calls;
+		vector<CALLSITE*> expanded;
+
+		// The calls of a caller are always together, its body is
+		// matched in one go
+
+		for (size_t i = 0; i < calls.size(); )
+		{
+			METHOD* caller = calls[i]->caller;
+			size_t j = i + 1;
+
+			while (caller != NULL && j < calls.size() &&
+					calls[j]->caller == caller)
+				j++;
+
+			expanded.insert(expanded.end(), calls.begin() + i,
+					calls.begin() + j);
+
+			for (int k = 1; caller != NULL && k <= caller->repeats; k++)
+			{
+				for (size_t c = i; c < j; c++)
+				{
+					CALLSITE* s = new CALLSITE(*calls[c]);
+					s->clone = k;
+
+					stringstream ss;
+					ss << 'r' << k << '_' << s->from;
+					s->from = ss.str();
+
+					expanded.push_back(s);
+				}
+			}
+
+			i = j;
+		}
+
+		calls.swap(expanded);
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Write a text that ends at end in the source with the edits of a copy,    */
+/* the text may have been rewritten before its tail, so the edits are       */
+/* placed from the end and skipped if the name is not there                 */
+/*--------------------------------------------------------------------------*/
+static void writeRange(ostream& out, StringRef text, int64 end,
+		EDITITER b, EDITITER e, int clone)
+{
+	size_t p = 0;
+
+	for (auto i = b; i != e; ++i)
+	{
+		if (i->clone != clone)
+			continue;
+
+		const string& name = i->callee->name;
+		int64 back = end - i->offset;
+
+		if (back < (int64)name.size() || back > (int64)text.size())
+			continue;
+
+		size_t q = text.size() - (size_t)back;
+
+		if (q < p || text.substr(q, name.size()) != name)
+			continue;
+
+		out.write(text.data() + p, q - p);
+		out << 'r' << i->redirect << '_' << name;
+		p = q + name.size();
+	}
+
+	out.write(text.data() + p, text.size() - p);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Redirect the calls of the original sources and write the repeated files  */
+/* in source order, one copy of a method at a time                          */
+/*--------------------------------------------------------------------------*/
+int StreamCallTree(ClangTool& tool, const LangOptions* lopt,
+		CALLTREE* tree, const Replacements& replacements, int seed,
+		int maxredirect, RedirectMode mode, RedirectPolicy policy,
+		bool rngcompat,
+		const CLONEOPTIONS* copts, OutputStage* output)
+{
+	unordered_map<string, vector<STREAMEDIT> > edits;
+
+	if (maxredirect != 0)
+	{
+		// The copies are never parsed, their calls are the ones of
+		// the original method
+
+		assert_phase(BuildCallTreeCalls(tool, lopt, tree));
+		expandCallSites(tree);
+
+		unordered_map<int64, CALLSITE*> callmap;
+		SelectCallSites(tree, seed, maxredirect, mode, policy, rngcompat,
+				callmap);
+
+		for (auto& m : tree->methods)
+		{
+			for (auto c : m.second->calls)
+			{
+				if (c->redirect == 0)
+					continue;
+
+				bool copied = c->caller != NULL && c->caller->repeats > 0;
+
+				STREAMEDIT e;
+				e.offset = c->location.begin;
+				e.clone = c->clone;
+				e.redirect = c->redirect;
+				e.callee = m.second;
+
+				edits[copied ? c->caller->file : c->file].push_back(e);
+
+				cout << m.second->name << ',' << c->location.begin << '-'
+					<< c->location.end << ',' << c->redirect << endl;
+			}
+		}
+	}
+
+	// The replacement of a repeated definition only has its prototypes,
+	// the copies are written right after them
+
+	std::map<pair<string, int64>, const METHOD*> definitions;
+
+	for (auto& m : tree->methods)
+	{
+		if (m.second->repeats > 0)
+		{
+			definitions[make_pair(m.second->file,
+				m.second->location.begin)] = m.second;
+		}
+	}
+
+	std::map<string, vector<const Replacement*> > byfile;
+
+	for (auto& r : replacements)
+		byfile[r.getFilePath().str()].push_back(&r);
+
+	for (auto& e : edits)
+		byfile[e.first];
+
+	int result = 0;
+
+	for (auto& f : byfile)
+	{
+		auto& rs = f.second;
+		auto& es = edits[f.first];
+
+		stable_sort(rs.begin(), rs.end(),
+			[](const Replacement* a, const Replacement* b) {
+				return a->getOffset() < b->getOffset();
+			});
+
+		stable_sort(es.begin(), es.end(),
+			[](const STREAMEDIT& a, const STREAMEDIT& b) {
+				return a.offset < b.offset;
+			});
+
+		STREAMWRITER writer = [&](ostream& out, StringRef content) {
+			size_t pos = 0;
+			EDITITER e = es.begin();
+
+			for (auto r : rs)
+			{
+				size_t offset = r->getOffset();
+				size_t end = offset + r->getLength();
+
+				// Overlapping replacements can't both be right
+				if (offset < pos || end > content.size())
+				{
+					error("Failed to apply replacements!");
+					result = 1;
+					continue;
+				}
+
+				EDITITER b = e;
+				while (e != es.end() && e->offset < (int64)offset)
+					++e;
+
+				writeRange(out, content.slice(pos, offset), offset, b, e, 0);
+
+				b = e;
+				while (e != es.end() && e->offset < (int64)end)
+					++e;
+
+				auto d = definitions.find(make_pair(f.first, (int64)offset));
+
+				if (d == definitions.end())
+				{
+					writeRange(out, r->getReplacementText(), end, b, e, 0);
+				}
+				else
+				{
+					const METHOD* m = d->second;
+					out << r->getReplacementText().str();
+
+					WriteRepetitions(out, m, copts, [&](ostream& o, int i) {
+						writeRange(o, m->post, m->location.end, b, e, i);
+					});
+				}
+
+				pos = end;
+			}
+
+			writeRange(out, content.substr(pos), content.size(),
+					e, es.end(), 0);
+		};
+
+		if (output->stream(f.first, writer))
+			result = 1;
+	}
+
+	return result;
+}
@@ -0,0 +1,29 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/Tooling/Refactoring.h"
+
+#include "CallTree.h"
+#include "Repeater.h"
+#include "Redirector.h"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+class OutputStage;
+
+int StreamCallTree(ClangTool& tool, const LangOptions* lopt,
+		CALLTREE* tree, const Replacements& replacements, int seed,
+		int maxredirect, RedirectMode mode, RedirectPolicy policy,
+		bool rngcompat,
+		const CLONEOPTIONS* copts, OutputStage* output);
@@ -0,0 +1,687 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <algorithm>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "Crowbar.h"
+#include "CallTree.h"
+#include "Output.h"
+#include "Reservoir.h"
+#include "SymbolIndex.h"
+
+using namespace clang;
+using namespace llvm;
+using namespace std;
+
+// Content of a file before the phases, by line
+struct ORIGINAL
+{
+	string path;
+	string text;
+	vector<size_t> starts;
+
+	// Lines of each text by hash, in order
+	unordered_map<uint64_t, vector<int> > lines;
+};
+
+// Original line of a transformed line, file is -1 if it has none
+struct LINEREF
+{
+	int file;
+	int line;
+	SymbolRunKind kind;
+};
+
+
+static void findLines(StringRef text, vector<size_t>* starts)
+{
+	starts->push_back(0);
+
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		if (text[i] == '\n' && i + 1 < text.size())
+			starts->push_back(i + 1);
+	}
+}
+
+
+static StringRef lineAt(StringRef text, const vector<size_t>& starts,
+		size_t line)
+{
+	size_t b = starts[line];
+	size_t e = line + 1 < starts.size() ? starts[line + 1] : text.size();
+
+	if (e > b && text[e - 1] == '\n')
+		e--;
+
+	return text.slice(b, e);
+}
+
+
+static int lineOf(const vector<size_t>& starts, size_t offset)
+{
+	return (int)(upper_bound(starts.begin(), starts.end(), offset) -
+		starts.begin()) - 1;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Original of a file, read from the disk the first time, the targets are   */
+/* only written on commit                                                   */
+/*--------------------------------------------------------------------------*/
+static int loadOriginal(const string& path, vector<ORIGINAL>& originals,
+		unordered_map<string, int>& byPath)
+{
+	auto o = byPath.find(path);
+	if (o != byPath.end())
+		return o->second;
+
+	ifstream f(path.c_str(), ios::in | ios::binary);
+
+	if (!f)
+		return -1;
+
+	stringstream ss;
+	ss << f.rdbuf();
+
+	originals.push_back(ORIGINAL());
+	ORIGINAL& orig = originals.back();
+	orig.path = path;
+	orig.text = ss.str();
+	findLines(orig.text, &orig.starts);
+
+	for (size_t i = 0; i < orig.starts.size(); i++)
+	{
+		string line = lineAt(orig.text, orig.starts, i).str();
+		orig.lines[HashString(line, 0)].push_back((int)i);
+	}
+
+	return byPath[path] = (int)originals.size() - 1;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Line of the pool with the same text, preferring the range of the text    */
+/* that was replaced, then the lines after the previous match               */
+/*--------------------------------------------------------------------------*/
+static LINEREF findLine(StringRef text, const vector<ORIGINAL>& originals,
+		const vector<int>& pool, int local, int la, int lb,
+		const LINEREF& prev)
+{
+	uint64_t h = HashString(text.str(), 0);
+	LINEREF after = { -1, -1, SR_Approximate };
+	LINEREF first = after;
+
+	for (int f : pool)
+	{
+		const ORIGINAL& orig = originals[f];
+
+		auto c = orig.lines.find(h);
+		if (c == orig.lines.end())
+			continue;
+
+		const vector<int>& ls = c->second;
+
+		auto same = [&](int l) {
+			return lineAt(orig.text, orig.starts, l) == text;
+		};
+
+		if (f == local)
+		{
+			for (auto l = lower_bound(ls.begin(), ls.end(), la);
+					l != ls.end() && *l <= lb; ++l)
+			{
+				if (same(*l))
+				{
+					LINEREF r = { f, *l, SR_Exact };
+					return r;
+				}
+			}
+		}
+
+		if (after.file < 0 && f == prev.file)
+		{
+			for (auto l = upper_bound(ls.begin(), ls.end(), prev.line);
+					l != ls.end() && after.file < 0; ++l)
+			{
+				if (same(*l))
+					after = { f, *l, SR_Exact };
+			}
+		}
+
+		for (auto l = ls.begin(); l != ls.end() && first.file < 0; ++l)
+		{
+			if (same(*l))
+				first = { f, *l, SR_Exact };
+		}
+	}
+
+	return after.file >= 0 ? after : first;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Map the lines of a text written by a phase, the copies of a method are   */
+/* the original lines but for the ones with a renamed call or name, which   */
+/* take the place of the lines around them                                  */
+/*--------------------------------------------------------------------------*/
+static void alignLines(StringRef content, const vector<size_t>& starts,
+		size_t b, size_t e, const vector<ORIGINAL>& originals,
+		const vector<int>& pool, int local, int la, int lb,
+		vector<LINEREF>& refs)
+{
+	LINEREF prev = { -1, -1, SR_Generated };
+
+	for (size_t t = b; t < e; t++)
+	{
+		StringRef text = lineAt(content, starts, t);
+		LINEREF r = { -1, -1, SR_Generated };
+
+		if (prev.file >= 0)
+		{
+			const ORIGINAL& orig = originals[prev.file];
+
+			if (prev.line + 1 < (int)orig.starts.size() &&
+					lineAt(orig.text, orig.starts, prev.line + 1) == text)
+			{
+				r = prev;
+				r.line++;
+			}
+		}
+
+		if (r.file < 0)
+			r = findLine(text, originals, pool, local, la, lb, prev);
+
+		if (r.file >= 0)
+			prev = r;
+
+		refs[t] = r;
+	}
+
+	// The lines without a match are placed by their neighbours
+
+	for (size_t t = b; t < e; t++)
+	{
+		if (refs[t].file >= 0)
+			continue;
+
+		size_t n = t + 1;
+		while (n < e && refs[n].file < 0)
+			n++;
+
+		if (n < e && refs[n].line >= (int)(n - t))
+		{
+			refs[t] = refs[n];
+			refs[t].line -= (int)(n - t);
+			refs[t].kind = SR_Approximate;
+		}
+		else if (t > b && refs[t - 1].file >= 0 &&
+				refs[t - 1].kind != SR_Generated)
+		{
+			const ORIGINAL& orig = originals[refs[t - 1].file];
+
+			refs[t] = refs[t - 1];
+			refs[t].line = min(refs[t].line + 1,
+					(int)orig.starts.size() - 1);
+			refs[t].kind = SR_Approximate;
+		}
+		else if (local >= 0)
+		{
+			refs[t].file = local;
+			refs[t].line = la;
+			refs[t].kind = SR_Generated;
+		}
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Original line of every line of a changed file                            */
+/*--------------------------------------------------------------------------*/
+static void mapLines(const OUTPUTMAP& m, const vector<size_t>& starts,
+		const vector<ORIGINAL>& originals, const vector<int>& pool,
+		int local, vector<LINEREF>& refs)
+{
+	StringRef content = *m.content;
+	const vector<OUTPUTPIECE>& pieces = *m.pieces;
+	size_t p = 0;
+
+	refs.resize(starts.size());
+
+	for (size_t i = 0; i < starts.size(); )
+	{
+		size_t c = starts[i];
+
+		while (p < pieces.size() && pieces[p].at + pieces[p].length <= c)
+			p++;
+
+		if (local >= 0 && p < pieces.size() && pieces[p].at <= c)
+		{
+			const ORIGINAL& orig = originals[local];
+			size_t from = pieces[p].from + (c - pieces[p].at);
+			int l = lineOf(orig.starts, from);
+
+			LINEREF r = { local, l, SR_Approximate };
+
+			if (orig.starts[l] == from &&
+					lineAt(orig.text, orig.starts, l) ==
+					lineAt(content, starts, i))
+				r.kind = SR_Exact;
+
+			refs[i++] = r;
+			continue;
+		}
+
+		// Lines written by the phases up to the next copied piece,
+		// they replaced the original text between the pieces
+
+		size_t j = i + 1;
+		size_t next = p < pieces.size() ? pieces[p].at : content.size();
+
+		while (j < starts.size() && starts[j] < next)
+			j++;
+
+		int la = 0, lb = 0;
+
+		if (local >= 0)
+		{
+			const ORIGINAL& orig = originals[local];
+			size_t a = p > 0 ? pieces[p - 1].from + pieces[p - 1].length : 0;
+			size_t b = p < pieces.size() ? pieces[p].from : orig.text.size();
+
+			la = lineOf(orig.starts, a);
+			lb = lineOf(orig.starts, b);
+		}
+
+		alignLines(content, starts, i, j, originals, pool, local, la, lb,
+				refs);
+		i = j;
+	}
+}
+
+
+static bool isIdent(char c)
+{
+	return isalnum((unsigned char)c) || c == '_';
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Copies defined in a file, an rN_ name of a repeated method followed by   */
+/* its parameters and a body. Placement, splitting and specialization move  */
+/* or change the copies, so they are taken from what is written             */
+/*--------------------------------------------------------------------------*/
+static void findCopies(StringRef text, const CALLTREE* tree,
+		set<pair<const METHOD*, int> >* copies)
+{
+	size_t i = 0;
+
+	while (i < text.size())
+	{
+		if (!isIdent(text[i]))
+		{
+			i++;
+			continue;
+		}
+
+		size_t j = i;
+		while (j < text.size() && isIdent(text[j]))
+			j++;
+
+		StringRef word = text.slice(i, j);
+		i = j;
+
+		if (word.size() < 4 || word[0] != 'r' || 
+				!isdigit((unsigned char)word[1]))
+			continue;
+
+		size_t u = word.find('_');
+		if (u == StringRef::npos)
+			continue;
+
+		int copy = atoi(word.slice(1, u).str().c_str());
+
+		auto m = tree->methods.find(word.substr(u + 1).str());
+		if (m == tree->methods.end() || copy < 1 || copy > m->second->repeats)
+			continue;
+
+		// The parameters, then the body
+
+		size_t k = j;
+		while (k < text.size() && isspace((unsigned char)text[k]))
+			k++;
+
+		if (k >= text.size() || text[k] != '(')
+			continue;
+
+		int depth = 0;
+
+		for (; k < text.size(); k++)
+		{
+			if (text[k] == '(')
+				depth++;
+			else if (text[k] == ')' && --depth == 0)
+				break;
+		}
+
+		k++;
+		while (k < text.size() && isspace((unsigned char)text[k]))
+			k++;
+
+		if (k < text.size() && text[k] == '{')
+			copies->insert(make_pair(m->second, copy));
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Add the clone names and line maps of the changed files to the part of    */
+/* the index, workers append theirs to the same file                        */
+/*--------------------------------------------------------------------------*/
+int AppendSymbolIndex(const string& index, CALLTREE* tree,
+		OutputStage* output)
+{
+	vector<OUTPUTMAP> maps;
+	output->getMaps(&maps);
+
+	vector<ORIGINAL> originals;
+	unordered_map<string, int> byPath;
+
+	vector<int> changed;
+
+	for (auto& m : maps)
+	{
+		if (!m.generated)
+			changed.push_back(loadOriginal(m.path, originals, byPath));
+	}
+
+	if (tree != NULL)
+	{
+		for (auto& m : tree->methods)
+		{
+			if (m.second->repeats > 0)
+				loadOriginal(m.second->file, originals, byPath);
+		}
+	}
+
+	stringstream out;
+	set<pair<const METHOD*, int> > copies;
+
+	for (size_t k = 0; k < maps.size(); k++)
+	{
+		const OUTPUTMAP& m = maps[k];
+
+		if (tree != NULL)
+			findCopies(*m.content, tree, &copies);
+
+		// A generated file is made of text from any of the others
+		int local = m.generated ? -1 : byPath[m.path];
+		vector<int> pool = m.generated ? changed : vector<int>(1, local);
+
+		if (local < 0 && !m.generated)
+			continue;
+
+		vector<size_t> starts;
+		findLines(*m.content, &starts);
+
+		vector<LINEREF> refs;
+		mapLines(m, starts, originals, pool, local, refs);
+
+		out << "F," << m.target << '\n';
+
+		for (size_t i = 0; i < refs.size(); i++)
+		{
+			const LINEREF& r = refs[i];
+
+			// Exact lines go on with the run of the previous one
+
+			if (i > 0 && r.kind == SR_Exact &&
+					refs[i - 1].kind == SR_Exact &&
+					refs[i - 1].file == r.file &&
+					refs[i - 1].line + 1 == r.line)
+				continue;
+
+			string file = r.file < 0 ? "" : originals[r.file].path;
+			size_t offset = r.file < 0 ? 0 :
+				originals[r.file].starts[r.line];
+
+			out << "R," << i + 1 << ',' << starts[i] << ','
+				<< (r.file < 0 ? 0 : r.line + 1) << ',' << offset << ','
+				<< (int)r.kind << ',' << file << '\n';
+		}
+	}
+
+	for (auto& c : copies)
+	{
+		const METHOD* mt = c.first;
+
+		auto o = byPath.find(mt->file);
+		if (o == byPath.end() || o->second < 0)
+			continue;
+
+		int line = lineOf(originals[o->second].starts,
+				(size_t)mt->location.begin) + 1;
+
+		out << "S," << c.second << ',' << line << ",r" << c.second << '_'
+			<< mt->name << ',' << mt->name << ',' << mt->file << '\n';
+	}
+
+	// Workers append their part to the same file, a single write
+	// keeps the lines of different processes apart
+
+	string part = index + ".part";
+	string s = out.str();
+
+	int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+	int result = 0;
+
+	if (fd < 0 || ::write(fd, s.data(), s.size()) != (ssize_t)s.size())
+	{
+		error("Unable to write " + part);
+		result = 1;
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return result;
+}
+
+
+// Strings of the index, each one is stored once
+class StringTable
+{
+private:
+
+	map<string, uint32_t> offsets;
+
+public:
+
+	string data;
+
+	uint32_t add(const string& s)
+	{
+		auto o = this->offsets.find(s);
+		if (o != this->offsets.end())
+			return o->second;
+
+		uint32_t offset = (uint32_t)this->data.size();
+		this->data.append(s.c_str(), s.size() + 1);
+		this->offsets[s] = offset;
+		return offset;
+	}
+};
+
+
+// Words are written little endian whatever the host is
+
+static void putWord(string& out, uint32_t w)
+{
+	for (int i = 0; i < 4; i++)
+		out.push_back((char)((w >> (8 * i)) & 0xff));
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Turn the part of the index into the binary index, the files and symbols  */
+/* are sorted so they can be searched in place                              */
+/*--------------------------------------------------------------------------*/
+int FinishSymbolIndex(const string& index)
+{
+	string part = index + ".part";
+	ifstream f(part.c_str(), ios::in | ios::binary);
+
+	// Runs of each file and the symbols by clone, a file is only kept
+	// the first time it is found
+	map<string, vector<SYMINDEXRUN> > files;
+	map<string, vector<SYMINDEXSYMBOL> > symbols;
+	StringTable strings;
+
+	strings.add("");
+
+	vector<SYMINDEXRUN>* runs = NULL;
+	string line;
+
+	while (getline(f, line))
+	{
+		if (line.compare(0, 2, "F,") == 0)
+		{
+			string path = line.substr(2);
+			runs = files.find(path) == files.end() ? &files[path] : NULL;
+			continue;
+		}
+
+		char* p = &line[0] + 2;
+		uint32_t v[5];
+
+		int n = line.compare(0, 2, "R,") == 0 ? 5 :
+			line.compare(0, 2, "S,") == 0 ? 2 : 0;
+
+		if (n == 0)
+			continue;
+
+		for (int i = 0; i < n; i++)
+		{
+			v[i] = (uint32_t)strtoul(p, &p, 10);
+			p += *p == ',' ? 1 : 0;
+		}
+
+		if (n == 5)
+		{
+			if (runs == NULL)
+				continue;
+
+			SYMINDEXRUN r = { v[0], v[1], strings.add(p), v[2], v[3], v[4] };
+			runs->push_back(r);
+			continue;
+		}
+
+		// Clone and original names never have commas, the file may
+		char* c1 = strchr(p, ',');
+		char* c2 = c1 == NULL ? NULL : strchr(c1 + 1, ',');
+
+		if (c2 == NULL)
+			continue;
+
+		string clone(p, c1);
+		SYMINDEXSYMBOL s = { 0, strings.add(string(c1 + 1, c2)), v[0],
+			strings.add(c2 + 1), v[1] };
+
+		auto& same = symbols[clone];
+		bool known = false;
+
+		for (auto& o : same)
+			known = known || (o.file == s.file && o.line == s.line);
+
+		if (!known)
+			same.push_back(s);
+	}
+
+	f.close();
+	unlink(part.c_str());
+
+	vector<SYMINDEXFILE> ftable;
+	vector<SYMINDEXRUN> rtable;
+	vector<SYMINDEXSYMBOL> stable;
+
+	for (auto& fr : files)
+	{
+		SYMINDEXFILE e = { strings.add(fr.first), (uint32_t)rtable.size(),
+			(uint32_t)fr.second.size() };
+		ftable.push_back(e);
+		rtable.insert(rtable.end(), fr.second.begin(), fr.second.end());
+	}
+
+	for (auto& s : symbols)
+	{
+		uint32_t name = strings.add(s.first);
+
+		for (auto& e : s.second)
+		{
+			e.clone = name;
+			stable.push_back(e);
+		}
+	}
+
+	while (strings.data.size() % 4 != 0)
+		strings.data.push_back('\0');
+
+	string out(SYMINDEX_MAGIC, 4);
+	putWord(out, SYMINDEX_VERSION);
+	putWord(out, (uint32_t)ftable.size());
+	putWord(out, (uint32_t)rtable.size());
+	putWord(out, (uint32_t)stable.size());
+	putWord(out, (uint32_t)strings.data.size());
+
+	for (auto& e : ftable)
+	{
+		putWord(out, e.path);
+		putWord(out, e.first);
+		putWord(out, e.count);
+	}
+
+	for (auto& r : rtable)
+	{
+		putWord(out, r.line);
+		putWord(out, r.offset);
+		putWord(out, r.file);
+		putWord(out, r.origline);
+		putWord(out, r.origoffset);
+		putWord(out, r.kind);
+	}
+
+	for (auto& e : stable)
+	{
+		putWord(out, e.clone);
+		putWord(out, e.original);
+		putWord(out, e.copy);
+		putWord(out, e.file);
+		putWord(out, e.line);
+	}
+
+	out += strings.data;
+
+	return WriteIfChanged(index, out);
+}
@@ -0,0 +1,79 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+using namespace std;
+
+struct CALLTREE;
+class OutputStage;
+
+/*--------------------------------------------------------------------------*/
+/* Layout of the -symbol-index file. Everything is a little endian 32 bit   */
+/* word, so the file can be mapped and searched in place: the header, the   */
+/* files sorted by path, the runs of each file sorted by line, the symbols  */
+/* sorted by clone name and the NUL terminated strings they refer to        */
+/*--------------------------------------------------------------------------*/
+
+#define SYMINDEX_MAGIC "CRBS"
+#define SYMINDEX_VERSION 1
+
+struct SYMINDEXHEADER
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t files;
+	uint32_t runs;
+	uint32_t symbols;
+	uint32_t strings;
+};
+
+// A transformed file, its runs are [first, first + count)
+struct SYMINDEXFILE
+{
+	uint32_t path;
+	uint32_t first;
+	uint32_t count;
+};
+
+enum SymbolRunKind
+{
+	SR_Exact,
+	SR_Approximate,
+	SR_Generated,
+};
+
+// Lines of a transformed file from line on (1-based) and their offset.
+// Exact runs are the same text as the original lines, the others are a
+// single line that was changed or written by the phases
+struct SYMINDEXRUN
+{
+	uint32_t line;
+	uint32_t offset;
+	uint32_t file;
+	uint32_t origline;
+	uint32_t origoffset;
+	uint32_t kind;
+};
+
+// Copy of a method and where the original is defined
+struct SYMINDEXSYMBOL
+{
+	uint32_t clone;
+	uint32_t original;
+	uint32_t copy;
+	uint32_t file;
+	uint32_t line;
+};
+
+int AppendSymbolIndex(const string& index, CALLTREE* tree,
+		OutputStage* output);
+int FinishSymbolIndex(const string& index);
@@ -0,0 +1,322 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Tooling/Tooling.h"
+#include "clang/AST/ASTConsumer.h"
+#include "clang/ASTMatchers/ASTMatchFinder.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "Crowbar.h"
+#include "Trace.h"
+#include "Pipeline.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+bool TraceOn = false;
+
+// Events are kept as JSON objects and appended to the .part file on
+// every flush, so the workers add theirs before exiting and the main
+// process joins them all at the end
+
+static string tracePath;
+static mutex traceLock;
+static string traceEvents;
+static atomic<int> traceThreads(0);
+static thread_local int traceThread = -1;
+
+
+/*--------------------------------------------------------------------------*/
+/* Microseconds of a clock shared by all the processes                      */
+/*--------------------------------------------------------------------------*/
+int64_t TraceNow()
+{
+	auto t = chrono::steady_clock::now().time_since_epoch();
+	return chrono::duration_cast<chrono::microseconds>(t).count();
+}
+
+static int currentThread()
+{
+	if (traceThread < 0)
+		traceThread = traceThreads++;
+
+	return traceThread;
+}
+
+static void escape(stringstream& ss, const string& s)
+{
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			ss << '\\' << c;
+		else if ((unsigned char)c < 0x20)
+			ss << ' ';
+		else
+			ss << c;
+	}
+}
+
+
+void TraceOpen(const string& path)
+{
+	tracePath = path;
+	TraceOn = true;
+
+	unlink((path + ".part").c_str());
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Record a complete ("X") event                                            */
+/*--------------------------------------------------------------------------*/
+void TraceComplete(const char* name, const char* cat, const string& arg,
+		int64_t begin, int64_t end, pid_t pid, int tid)
+{
+	if (!TraceOn)
+		return;
+
+	stringstream ss;
+	ss << "{\"name\":\"" << name << "\",\"cat\":\"" << cat
+	   << "\",\"ph\":\"X\",\"ts\":" << begin << ",\"dur\":" << (end - begin)
+	   << ",\"pid\":" << pid << ",\"tid\":" << tid;
+
+	if (!arg.empty())
+	{
+		ss << ",\"args\":{\"tu\":\"";
+		escape(ss, arg);
+		ss << "\"}";
+	}
+
+	ss << "}\n";
+
+	lock_guard<mutex> g(traceLock);
+	traceEvents += ss.str();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Close the span before it goes out of scope, only the first end counts    */
+/*--------------------------------------------------------------------------*/
+void TraceSpan::end()
+{
+	if (TraceOn && this->name != NULL)
+	{
+		TraceComplete(this->name, this->cat, this->arg, this->begin,
+				TraceNow(), getpid(), currentThread());
+	}
+
+	this->name = NULL;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Append the buffered events to the .part file in a single write           */
+/*--------------------------------------------------------------------------*/
+void TraceFlush()
+{
+	if (!TraceOn)
+		return;
+
+	lock_guard<mutex> g(traceLock);
+
+	if (traceEvents.empty())
+		return;
+
+	string part = tracePath + ".part";
+	int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+	if (fd < 0 || write(fd, traceEvents.data(), traceEvents.size()) !=
+			(ssize_t)traceEvents.size())
+		error("Unable to write the trace to " + part);
+
+	if (fd >= 0)
+		close(fd);
+
+	traceEvents.clear();
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Join the events of every process into the trace file                     */
+/*--------------------------------------------------------------------------*/
+int TraceClose()
+{
+	if (!TraceOn)
+		return 0;
+
+	TraceFlush();
+	TraceOn = false;
+
+	string part = tracePath + ".part";
+	ifstream in(part.c_str());
+	ofstream out(tracePath.c_str(), ios::out | ios::trunc);
+
+	out << "{\"traceEvents\":[";
+
+	string line;
+	bool first = true;
+
+	while (getline(in, line))
+	{
+		if (line.empty())
+			continue;
+
+		out << (first ? "\n" : ",\n") << line;
+		first = false;
+	}
+
+	out << "\n]}\n";
+
+	in.close();
+	unlink(part.c_str());
+
+	if (!out)
+	{
+		error("Unable to write the trace to " + tracePath);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Consumer that times the matching apart from the parsing                  */
+/*--------------------------------------------------------------------------*/
+class TracedConsumer : public ASTConsumer
+{
+private:
+
+	ASTConsumer* consumer;
+	const char* phase;
+	const string& file;
+	int64_t begin;
+
+public:
+
+	TracedConsumer(ASTConsumer* consumer, const char* phase,
+			const string& file, int64_t begin) :
+		consumer(consumer),
+		phase(phase),
+		file(file),
+		begin(begin)
+	{
+	}
+
+	virtual ~TracedConsumer()
+	{
+		delete this->consumer;
+	}
+
+	virtual void HandleTranslationUnit(ASTContext& context)
+	{
+		TraceComplete("parse", this->phase, this->file, this->begin,
+				TraceNow(), getpid(), currentThread());
+
+		TraceSpan span("match", this->phase, this->file);
+		this->consumer->HandleTranslationUnit(context);
+	}
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Action that traces each translation unit it goes through and lets the    */
+/* prefetcher know where the parser is                                      */
+/*--------------------------------------------------------------------------*/
+class TracedAction : public ASTFrontendAction
+{
+private:
+
+	MatchFinder* finder;
+	const char* phase;
+	string file;
+	int64_t begin;
+
+public:
+
+	TracedAction(MatchFinder* finder, const char* phase) :
+		finder(finder),
+		phase(phase),
+		begin(0)
+	{
+	}
+
+	virtual bool BeginSourceFileAction(CompilerInstance& ci, StringRef file)
+	{
+		PrefetchAdvance(file.str());
+
+		this->file = file.str();
+		this->begin = TraceNow();
+		return true;
+	}
+
+	virtual ASTConsumer* CreateASTConsumer(CompilerInstance& ci,
+			StringRef file)
+	{
+		return new TracedConsumer(this->finder->newASTConsumer(),
+				this->phase, this->file, this->begin);
+	}
+
+	virtual void EndSourceFileAction()
+	{
+		TraceComplete("tu", this->phase, this->file, this->begin,
+				TraceNow(), getpid(), currentThread());
+	}
+};
+
+class TracedActionFactory : public FrontendActionFactory
+{
+private:
+
+	MatchFinder* finder;
+	const char* phase;
+
+public:
+
+	TracedActionFactory(MatchFinder* finder, const char* phase) :
+		finder(finder),
+		phase(phase)
+	{
+	}
+
+	virtual FrontendAction* create()
+	{
+		return new TracedAction(this->finder, this->phase);
+	}
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Same as newFrontendActionFactory when tracing is off and nothing is      */
+/* being prefetched                                                         */
+/*--------------------------------------------------------------------------*/
+unique_ptr<FrontendActionFactory> newTracedActionFactory(MatchFinder* finder,
+		const char* phase)
+{
+	if (!TraceOn && !PrefetchOn())
+		return newFrontendActionFactory(finder);
+
+	return unique_ptr<FrontendActionFactory>(
+			new TracedActionFactory(finder, phase));
+}
@@ -0,0 +1,76 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+// The workers use the trace too, they don't need the whole tooling
+
+namespace clang
+{
+	namespace ast_matchers { class MatchFinder; }
+	namespace tooling { class FrontendActionFactory; }
+}
+
+using namespace std;
+
+extern bool TraceOn;
+
+void TraceOpen(const string& path);
+void TraceFlush();
+int TraceClose();
+
+int64_t TraceNow();
+void TraceComplete(const char* name, const char* cat, const string& arg,
+		int64_t begin, int64_t end, pid_t pid, int tid);
+
+/*--------------------------------------------------------------------------*/
+/* Complete event from construction to destruction, it does nothing when    */
+/* tracing is off                                                           */
+/*--------------------------------------------------------------------------*/
+class TraceSpan
+{
+private:
+
+	const char* name;
+	const char* cat;
+	string arg;
+	int64_t begin;
+
+public:
+
+	TraceSpan(const char* name, const char* cat) :
+		name(name),
+		cat(cat),
+		begin(TraceOn ? TraceNow() : 0)
+	{
+	}
+
+	TraceSpan(const char* name, const char* cat, const string& arg) :
+		name(name),
+		cat(cat),
+		begin(TraceOn ? TraceNow() : 0)
+	{
+		if (TraceOn)
+			this->arg = arg;
+	}
+
+	~TraceSpan()
+	{
+		this->end();
+	}
+
+	void end();
+};
+
+unique_ptr<clang::tooling::FrontendActionFactory> newTracedActionFactory(
+		clang::ast_matchers::MatchFinder* finder, const char* phase);
@@ -0,0 +1,363 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include "clang/Tooling/Tooling.h"
+#include "clang/ASTMatchers/ASTMatchFinder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/ADT/SmallString.h"
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <set>
+#include <thread>
+#include <algorithm>
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "Crowbar.h"
+#include "Prefilter.h"
+#include "Output.h"
+#include "Trace.h"
+#include "Workers.h"
+#include "Verifier.h"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// Check running in a child process, its diagnostics are kept in out
+struct VERIFYJOB
+{
+	pid_t pid;
+	int out;
+	string source;
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Compile commands of the sources, and of the files generated by -split,   */
+/* which are compiled as the source they came from                          */
+/*--------------------------------------------------------------------------*/
+class SplitCompilations : public CompilationDatabase
+{
+private:
+
+	CompilationDatabase& compilations;
+
+	// Source of each sibling, by absolute path
+	map<string, string> siblings;
+
+public:
+
+	SplitCompilations(CompilationDatabase& compilations, 
+			const map<string, string>& siblings) :
+		compilations(compilations)
+	{
+		for (auto& s : siblings)
+			this->siblings[getAbsolutePath(s.first)] = s.second;
+	}
+
+	virtual vector<CompileCommand> getCompileCommands(StringRef path) const
+	{
+		auto s = this->siblings.find(getAbsolutePath(path));
+
+		if (s == this->siblings.end())
+			return this->compilations.getCompileCommands(path);
+
+		// The argument naming the source names the sibling instead
+
+		string source = getAbsolutePath(s->second);
+		vector<CompileCommand> commands = 
+			this->compilations.getCompileCommands(source);
+
+		for (auto& c : commands)
+		{
+			for (auto& a : c.CommandLine)
+			{
+				if (a.empty() || a[0] == '-')
+					continue;
+
+				SmallString<256> p(a);
+
+				if (!sys::path::is_absolute(p))
+				{
+					p = c.Directory;
+					sys::path::append(p, a);
+				}
+
+				bool same = false;
+
+				if (!sys::fs::equivalent(p.str(), source, same) && same)
+					a = s->first;
+			}
+		}
+
+		return commands;
+	}
+
+	virtual vector<string> getAllFiles() const
+	{
+		return this->compilations.getAllFiles();
+	}
+
+	virtual vector<CompileCommand> getAllCompileCommands() const
+	{
+		return this->compilations.getAllCompileCommands();
+	}
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Files changed by the phases, by identity on the disk so the same file    */
+/* is found through any path, and by name for the includes that can only    */
+/* be resolved with the search paths of the compiler                        */
+/*--------------------------------------------------------------------------*/
+struct CHANGEDFILES
+{
+	set<sys::fs::UniqueID> ids;
+	set<string> names;
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Whether a source or any header it includes was changed, the includes     */
+/* are lexed from the disk and found with the search paths of the compile   */
+/* command of the source                                                    */
+/*--------------------------------------------------------------------------*/
+static bool dependsOnChanged(CompilationDatabase& compilations, 
+		const string& source, const CHANGEDFILES& changed, 
+		const LangOptions& lopt)
+{
+	INCLUDEPATHS paths;
+	GetIncludePaths(compilations, source, &paths);
+
+	set<sys::fs::UniqueID> visited;
+	vector<string> pending(1, getAbsolutePath(source));
+
+	while (!pending.empty())
+	{
+		string p = pending.back();
+		pending.pop_back();
+
+		sys::fs::UniqueID id;
+
+		if (sys::fs::getUniqueID(p, id))
+			continue;
+
+		if (changed.ids.count(id) > 0)
+			return true;
+
+		if (!visited.insert(id).second)
+			continue;
+
+		ifstream f(p.c_str(), ios::in | ios::binary);
+
+		if (!f)
+			continue;
+
+		stringstream ss;
+		ss << f.rdbuf();
+
+		vector<string> unresolved;
+		FindLocalIncludes(ss.str(), p, lopt, paths, &pending, &unresolved);
+
+		// Includes not in any search path of the command come from the
+		// built-in ones of the compiler, a header with the same name is
+		// enough
+		for (auto& u : unresolved)
+		{
+			if (changed.names.count(sys::path::filename(u).str()) > 0)
+				return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Parse a source with the changes, the diagnostics go to the standard      */
+/* error                                                                    */
+/*--------------------------------------------------------------------------*/
+static int checkSource(CompilationDatabase& compilations, 
+		const string& source, OutputStage* output)
+{
+	ClangTool tool(compilations, vector<string>(1, source));
+	output->mapFiles(tool);
+
+	MatchFinder matchFinder;
+	return tool.run(newTracedActionFactory(&matchFinder, "check").get());
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Fork a process checking a single source, the tools change the working    */
+/* directory of the whole process so they cannot share one. Its standard    */
+/* error goes to a temporary file that is printed when it finishes          */
+/*--------------------------------------------------------------------------*/
+static int spawnCheck(CompilationDatabase& compilations, 
+		const string& source, OutputStage* output, VERIFYJOB* job)
+{
+	int err = ForkCaptured("a check", STDERR_FILENO, [&](int) {
+		return checkSource(compilations, source, output);
+	}, &job->pid, &job->out);
+
+	if (err)
+		return err;
+
+	job->source = source;
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Parse the sources again with the changes to check that they still        */
+/* compile. Only the units that include a changed file are parsed unless    */
+/* the mode says otherwise, each one in its own process so they can be      */
+/* parsed in parallel                                                       */
+/*--------------------------------------------------------------------------*/
+int VerifySources(CompilationDatabase& _compilations, 
+		const vector<string>& sources, const map<string, string>& siblings, 
+		OutputStage* output, VerifyMode mode, int processes, 
+		const LangOptions& lopt)
+{
+	if (mode == VM_None)
+		return 0;
+
+	SplitCompilations compilations(_compilations, siblings);
+	vector<string> selected;
+
+	if (mode == VM_All)
+	{
+		selected = sources;
+	}
+	else
+	{
+		vector<string> paths;
+		output->getChanged(&paths);
+
+		CHANGEDFILES changed;
+
+		for (auto& p : paths)
+		{
+			sys::fs::UniqueID id;
+
+			// Generated files are not on the disk, they are only seen
+			// through the sources that include them
+			if (!sys::fs::getUniqueID(p, id))
+				changed.ids.insert(id);
+
+			changed.names.insert(sys::path::filename(p).str());
+		}
+
+		if (!changed.names.empty())
+		{
+			for (auto& source : sources)
+			{
+				if (dependsOnChanged(compilations, source, changed, lopt))
+					selected.push_back(source);
+			}
+		}
+	}
+
+	// The text moved by -split was never parsed where it is now
+
+	for (auto& s : siblings)
+		selected.push_back(s.first);
+
+	stringstream sm;
+	sm << "verifying " << selected.size() << " of " 
+		<< sources.size() + siblings.size() << " sources";
+	message(sm.str());
+
+	TraceSpan span("verify", "check");
+
+	if (processes <= 0)
+		processes = (int)thread::hardware_concurrency();
+
+	int failed = 0;
+
+	// A single process checks the sources one after the other itself
+
+	if (processes <= 1)
+	{
+		for (auto& source : selected)
+		{
+			int err = checkSource(compilations, source, output);
+
+			if (err)
+			{
+				cerr << "Indeed failed with error " << err << " in " 
+					<< source << endl;
+				failed = err;
+			}
+		}
+
+		return failed;
+	}
+
+	// The virtual files are only read, every child maps its copy of them
+
+	vector<VERIFYJOB> running;
+	size_t next = 0;
+
+	while (next < selected.size() || !running.empty())
+	{
+		while (next < selected.size() && (int)running.size() < processes)
+		{
+			VERIFYJOB job;
+			assert_phase(spawnCheck(compilations, selected[next], output, 
+					&job));
+
+			running.push_back(job);
+			next++;
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid < 0)
+		{
+			error("Lost track of the checks");
+			return 1;
+		}
+
+		auto j = find_if(running.begin(), running.end(), 
+			[pid](const VERIFYJOB& j) { return j.pid == pid; });
+
+		if (j == running.end())
+			continue;
+
+		cerr << ReadCaptured(j->out);
+
+		int err = WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+
+		if (err)
+		{
+			cerr << "Indeed failed with error " << err << " in " 
+				<< j->source << endl;
+			failed = err;
+		}
+
+		close(j->out);
+		running.erase(j);
+	}
+
+	return failed;
+}
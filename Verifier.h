@@ -0,0 +1,34 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Basic/LangOptions.h"
+
+#include <string>
+#include <vector>
+#include <map>
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace std;
+
+class OutputStage;
+
+enum VerifyMode
+{
+	VM_None,
+	VM_Changed,
+	VM_All,
+};
+
+int VerifySources(CompilationDatabase& compilations, 
+		const vector<string>& sources, const map<string, string>& siblings, 
+		OutputStage* output, VerifyMode mode, int processes, 
+		const LangOptions& lopt);
@@ -0,0 +1,426 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#include <string>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "Crowbar.h"
+#include "Workers.h"
+#include "Trace.h"
+#include "Reservoir.h"
+
+using namespace std;
+
+struct TUJOB
+{
+	string source;
+	double expected;
+	int attempts;
+
+	// Copy of the source taken before each attempt, a worker may die 
+	// after saving some of the phases
+	string backup;
+
+	string log;
+	bool done;
+};
+
+struct WORKER
+{
+	pid_t pid;
+	int job;
+	int out;
+	chrono::steady_clock::time_point start;
+};
+
+
+/*--------------------------------------------------------------------------*/
+/* Read a whole file, false if it could not be read                         */
+/*--------------------------------------------------------------------------*/
+static bool readFile(const string& path, string* content)
+{
+	ifstream f(path.c_str(), ios::in | ios::binary);
+	if (!f)
+		return false;
+
+	stringstream ss;
+	ss << f.rdbuf();
+	*content = ss.str();
+	return true;
+}
+
+static bool writeFile(const string& path, const string& content)
+{
+	ofstream f(path.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!f)
+		return false;
+
+	f << content;
+	return (bool)f;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Everything a child wrote to its output file                              */
+/*--------------------------------------------------------------------------*/
+string ReadCaptured(int fd)
+{
+	string content;
+	char buffer[65536];
+
+	lseek(fd, 0, SEEK_SET);
+
+	ssize_t n;
+	while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+		content.append(buffer, (size_t)n);
+
+	return content;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Timings are stored as path,seconds lines                                 */
+/*--------------------------------------------------------------------------*/
+static void loadTimings(const string& path, unordered_map<string, double>& timings)
+{
+	ifstream f(path.c_str());
+	string line;
+
+	while (getline(f, line))
+	{
+		size_t c = line.rfind(',');
+		if (c == string::npos)
+			continue;
+
+		timings[line.substr(0, c)] = atof(line.c_str() + c + 1);
+	}
+}
+
+static void saveTimings(const string& path, 
+		const unordered_map<string, double>& timings)
+{
+	vector<string> paths;
+	for (auto& t : timings)
+		paths.push_back(t.first);
+
+	sort(paths.begin(), paths.end());
+
+	ofstream f(path.c_str(), ios::out | ios::trunc);
+	for (auto& p : paths)
+		f << p << ',' << timings.at(p) << endl;
+
+	if (!f)
+		error("Unable to write the timings to " + path);
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Expected cost of every TU, the sizes of the known TUs give a rate for    */
+/* the ones that were never timed                                           */
+/*--------------------------------------------------------------------------*/
+static void estimateCosts(vector<TUJOB>& jobs, 
+		const unordered_map<string, double>& timings)
+{
+	vector<double> sizes(jobs.size(), 0.0);
+	double ktime = 0.0, ksize = 0.0;
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		struct stat st;
+		if (stat(jobs[i].source.c_str(), &st) == 0)
+			sizes[i] = (double)st.st_size;
+
+		auto t = timings.find(jobs[i].source);
+		if (t != timings.end())
+		{
+			jobs[i].expected = t->second;
+			ktime += t->second;
+			ksize += sizes[i];
+		}
+		else
+		{
+			jobs[i].expected = -1.0;
+		}
+	}
+
+	double rate = (ksize > 0.0) ? ktime / ksize : 1e-6;
+
+	for (size_t i = 0; i < jobs.size(); i++)
+	{
+		if (jobs[i].expected < 0.0)
+			jobs[i].expected = sizes[i] * rate;
+	}
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Fork a child process running a job, one of its standard streams (none if */
+/* stream is negative) goes to an unlinked temporary file that the parent   */
+/* reads back once the child is reaped. The tools change the working        */
+/* directory of the whole process, so this is how they run side by side     */
+/*--------------------------------------------------------------------------*/
+int ForkCaptured(const string& what, int stream, const CHILDJOB& job, 
+		pid_t* pid, int* out)
+{
+	const char* tmpdir = getenv("TMPDIR");
+	string tmpl = string(tmpdir ? tmpdir : "/tmp") + "/crowbar.XXXXXX";
+
+	vector<char> name(tmpl.begin(), tmpl.end());
+	name.push_back('\0');
+
+	int fd = mkstemp(&name[0]);
+	if (fd < 0)
+	{
+		error("Unable to create a temporary file for " + what);
+		return 1;
+	}
+
+	unlink(&name[0]);
+
+	// Nothing buffered can be inherited by the child
+
+	cout.flush();
+	cerr.flush();
+	fflush(NULL);
+	TraceFlush();
+
+	pid_t child = fork();
+
+	if (child < 0)
+	{
+		error("Unable to fork " + what);
+		close(fd);
+		return 1;
+	}
+
+	if (child == 0)
+	{
+		if (stream >= 0)
+			dup2(fd, stream);
+
+		int r = job(fd);
+
+		cout.flush();
+		cerr.flush();
+		fflush(NULL);
+		TraceFlush();
+		_exit(r < 0 || r > 255 ? 1 : r);
+	}
+
+	*pid = child;
+	*out = fd;
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Fork a worker for a single TU, its standard output goes to a temporary   */
+/* file that is merged in order by the coordinator                          */
+/*--------------------------------------------------------------------------*/
+static int spawn(TUJOB& job, int index, TUPROCESSOR& process, WORKER* w)
+{
+	if (!readFile(job.source, &job.backup))
+	{
+		error("Unable to read " + job.source);
+		return 1;
+	}
+
+	int err = ForkCaptured("a worker", STDOUT_FILENO, [&](int) {
+		return process(vector<string>(1, job.source)) == 0 ? 0 : 1;
+	}, &w->pid, &w->out);
+
+	if (err)
+		return err;
+
+	w->job = index;
+	w->start = chrono::steady_clock::now();
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Process each source in its own worker process, the largest expected      */
+/* TUs go first and a free worker always takes the next one in the queue   */
+/*--------------------------------------------------------------------------*/
+int RunWorkers(const vector<string>& sources, int workers, int retries, 
+		const string& timings, const string& quarantine, TUPROCESSOR process)
+{
+	vector<TUJOB> jobs(sources.size());
+
+	for (size_t i = 0; i < sources.size(); i++)
+	{
+		jobs[i].source = sources[i];
+		jobs[i].attempts = 0;
+		jobs[i].done = false;
+	}
+
+	unordered_map<string, double> times;
+
+	if (!timings.empty())
+		loadTimings(timings, times);
+
+	estimateCosts(jobs, times);
+
+	deque<int> queue;
+	for (size_t i = 0; i < jobs.size(); i++)
+		queue.push_back((int)i);
+
+	stable_sort(queue.begin(), queue.end(), [&](int a, int b) {
+		return jobs[a].expected > jobs[b].expected;
+	});
+
+	vector<WORKER> running;
+	vector<string> quarantined;
+	size_t next = 0;
+
+	while (!queue.empty() || !running.empty())
+	{
+		while (!queue.empty() && (int)running.size() < workers)
+		{
+			int j = queue.front();
+			queue.pop_front();
+
+			WORKER w;
+			if (spawn(jobs[j], j, process, &w))
+				return 1;
+
+			running.push_back(w);
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (pid < 0)
+		{
+			error("Lost track of the workers");
+			return 1;
+		}
+
+		auto w = find_if(running.begin(), running.end(), 
+			[pid](const WORKER& w) { return w.pid == pid; });
+
+		if (w == running.end())
+			continue;
+
+		TUJOB& job = jobs[w->job];
+		job.attempts++;
+
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - w->start;
+
+		if (TraceOn)
+		{
+			auto t = chrono::duration_cast<chrono::microseconds>(
+					w->start.time_since_epoch());
+			TraceComplete("worker", "workers", job.source, t.count(),
+					TraceNow(), pid, 0);
+		}
+
+		if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		{
+			job.log = ReadCaptured(w->out);
+			job.done = true;
+			times[job.source] = elapsed.count();
+		}
+		else
+		{
+			// Put the source back the way it was before the attempt
+
+			if (!writeFile(job.source, job.backup))
+				error("Unable to restore " + job.source);
+
+			stringstream ss;
+			ss << job.source << " failed ";
+			
+			if (WIFSIGNALED(status))
+				ss << "with signal " << WTERMSIG(status);
+			else
+				ss << "with error " << WEXITSTATUS(status);
+
+			ss << " (attempt " << job.attempts << ")";
+			error(ss.str());
+
+			if (job.attempts <= retries)
+			{
+				queue.push_front(w->job);
+			}
+			else
+			{
+				quarantined.push_back(job.source);
+				job.done = true;
+			}
+		}
+
+		job.backup.clear();
+		close(w->out);
+		running.erase(w);
+
+		// Logs are merged in the order of the sources
+
+		while (next < jobs.size() && jobs[next].done)
+		{
+			cout << jobs[next].log;
+			jobs[next].log.clear();
+			next++;
+		}
+
+		cout.flush();
+	}
+
+	if (!timings.empty())
+		saveTimings(timings, times);
+
+	if (!quarantine.empty())
+	{
+		ofstream f(quarantine.c_str(), ios::out | ios::trunc);
+		for (auto& q : quarantined)
+			f << q << endl;
+	}
+
+	if (!quarantined.empty())
+	{
+		stringstream ss;
+		ss << quarantined.size() << " translation units were quarantined";
+		error(ss.str());
+		return 4;
+	}
+
+	return 0;
+}
+
+
+/*--------------------------------------------------------------------------*/
+/* Shard of a source, it only depends on the path as given so every agent   */
+/* places the sources the same way whatever the order of its list           */
+/*--------------------------------------------------------------------------*/
+int ShardOf(const string& source, int shards)
+{
+	string path = source;
+
+	while (path.compare(0, 2, "./") == 0)
+		path = path.substr(2);
+
+	return (int)(HashNumber(0, HashString(path, 0)) % (uint64_t)shards);
+}
@@ -0,0 +1,30 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include <sys/types.h>
+
+using namespace std;
+
+typedef function<int(const vector<string>&)> TUPROCESSOR;
+
+// Job of a child process, it gets the descriptor of its output file and
+// returns the exit status
+typedef function<int(int)> CHILDJOB;
+
+int RunWorkers(const vector<string>& sources, int workers, int retries, 
+		const string& timings, const string& quarantine, TUPROCESSOR process);
+int ShardOf(const string& source, int shards);
+int ForkCaptured(const string& what, int stream, const CHILDJOB& job, 
+		pid_t* pid, int* out);
+string ReadCaptured(int fd);
@@ -0,0 +1,92 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* Benchmark kernel: table driven CRC-32 and a bytewise hash over a buffer */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIZE (1 << 20)
+#define ROUNDS 480
+
+static unsigned table[256];
+static unsigned char buffer[SIZE];
+
+static unsigned reflect(unsigned c)
+{
+	int k;
+
+	for (k = 0; k < 8; k++)
+		c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+
+	return c;
+}
+
+static void build(void)
+{
+	unsigned i;
+
+	for (i = 0; i < 256; i++)
+		table[i] = reflect(i);
+}
+
+static unsigned step(unsigned crc, unsigned char b)
+{
+	return table[(crc ^ b) & 0xff] ^ (crc >> 8);
+}
+
+static unsigned crc32(const unsigned char* p, size_t n)
+{
+	unsigned crc = 0xffffffffu;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		crc = step(crc, p[i]);
+
+	return crc ^ 0xffffffffu;
+}
+
+static unsigned fnv(const unsigned char* p, size_t n)
+{
+	unsigned h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		h = (h ^ p[i]) * 16777619u;
+
+	return h;
+}
+
+static void scramble(unsigned char* p, size_t n, unsigned seed)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		p[i] = (unsigned char)(seed >> 24);
+	}
+}
+
+int main(void)
+{
+	unsigned s = 0;
+	int r;
+
+	build();
+
+	for (r = 0; r < ROUNDS; r++)
+	{
+		scramble(buffer, SIZE, (unsigned)r);
+		s ^= crc32(buffer, SIZE);
+		s += fnv(buffer, SIZE);
+	}
+
+	printf("%08x\n", s);
+	return 0;
+}
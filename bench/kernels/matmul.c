@@ -0,0 +1,94 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* Benchmark kernel: dense matrix product with small accessors */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 192
+#define ROUNDS 240
+
+static double a[N * N], b[N * N], c[N * N];
+
+static double get(const double* m, int i, int j)
+{
+	return m[i * N + j];
+}
+
+static void set(double* m, int i, int j, double v)
+{
+	m[i * N + j] = v;
+}
+
+static unsigned next(unsigned* seed)
+{
+	*seed = *seed * 1103515245u + 12345u;
+	return (*seed >> 16) & 0x7fff;
+}
+
+static void fill(double* m, unsigned seed)
+{
+	int i, j;
+
+	for (i = 0; i < N; i++)
+		for (j = 0; j < N; j++)
+			set(m, i, j, (double)next(&seed) / 32768.0);
+}
+
+static double dot(const double* x, const double* y, int i, int j)
+{
+	double s = 0.0;
+	int k;
+
+	for (k = 0; k < N; k++)
+		s += get(x, i, k) * get(y, k, j);
+
+	return s;
+}
+
+static void multiply(const double* x, const double* y, double* z)
+{
+	int i, j;
+
+	for (i = 0; i < N; i++)
+		for (j = 0; j < N; j++)
+			set(z, i, j, dot(x, y, i, j));
+}
+
+static double trace(const double* m)
+{
+	double s = 0.0;
+	int i;
+
+	for (i = 0; i < N; i++)
+		s += get(m, i, i);
+
+	return s;
+}
+
+int main(void)
+{
+	int r;
+	double t = 0.0;
+
+	fill(a, 1);
+
+	for (r = 0; r < ROUNDS; r++)
+	{
+		/* b is overwritten below, refill it so nothing overflows */
+		fill(b, 2 + (unsigned)r);
+		multiply(a, b, c);
+		t += trace(c);
+		multiply(c, a, b);
+		t += trace(b);
+	}
+
+	printf("%.6e\n", t);
+	return 0;
+}
@@ -0,0 +1,102 @@
+/*--------------------------------------------------------------------------*/
+/*                                                                          */
+/* Crowbar Code Refactoring Tool                                            */
+/* author: Caian Benedicto                                                  */
+/* contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)       */
+/*                                                                          */
+/*--------------------------------------------------------------------------*/
+
+/* Benchmark kernel: merge sort of records through a comparison function */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define COUNT 400000
+#define ROUNDS 48
+
+struct record
+{
+	unsigned key;
+	unsigned value;
+};
+
+static struct record items[COUNT], scratch[COUNT];
+
+static unsigned mix(unsigned x)
+{
+	x ^= x >> 16;
+	x *= 0x45d9f3bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static int less(const struct record* x, const struct record* y)
+{
+	if (x->key != y->key)
+		return x->key < y->key;
+
+	return x->value < y->value;
+}
+
+static void merge(struct record* v, struct record* t, int lo, int mid, 
+		int hi)
+{
+	int i = lo, j = mid, k = lo;
+
+	while (i < mid && j < hi)
+		t[k++] = less(&v[j], &v[i]) ? v[j++] : v[i++];
+
+	while (i < mid)
+		t[k++] = v[i++];
+
+	while (j < hi)
+		t[k++] = v[j++];
+
+	memcpy(v + lo, t + lo, (hi - lo) * sizeof(*v));
+}
+
+static void sort(struct record* v, struct record* t, int lo, int hi)
+{
+	int mid;
+
+	if (hi - lo < 2)
+		return;
+
+	mid = lo + (hi - lo) / 2;
+	sort(v, t, lo, mid);
+	sort(v, t, mid, hi);
+	merge(v, t, lo, mid, hi);
+}
+
+static unsigned checksum(const struct record* v, int n)
+{
+	unsigned s = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		s = mix(s + v[i].key) ^ v[i].value;
+
+	return s;
+}
+
+int main(void)
+{
+	unsigned s = 0;
+	int r, i;
+
+	for (r = 0; r < ROUNDS; r++)
+	{
+		for (i = 0; i < COUNT; i++)
+		{
+			items[i].key = mix((unsigned)(i + r * COUNT)) % 100000u;
+			items[i].value = (unsigned)i;
+		}
+
+		sort(items, scratch, 0, COUNT);
+		s ^= checksum(items, COUNT);
+	}
+
+	printf("%u\n", s);
+	return 0;
+}
@@ -0,0 +1,175 @@
+#!/bin/bash
+#----------------------------------------------------------------------------
+#
+# Crowbar Code Refactoring Tool
+# author: Caian Benedicto
+# contact: caianbene@gmail.com (with a [Crowbar] tag in the subject)
+#
+#----------------------------------------------------------------------------
+#
+# Runtime overhead benchmark: every program is transformed by Crowbar over
+# a sweep of -max-select, -max-repeat and -max-redirect, then the original
+# and the transformed versions are compiled with the host compiler and run.
+#
+# usage: run.sh <crowbar> [workdir]
+#
+# Environment:
+#   BENCH_PROGRAMS  extra self-contained C programs (files or directories)
+#   BENCH_SELECT    -max-select values (default "50% 100%")
+#   BENCH_REPEAT    -max-repeat values (default "1 5")
+#   BENCH_REDIRECT  -max-redirect values (default "50% 100%")
+#   BENCH_FLAGS     extra Crowbar options for every run
+#   BENCH_RUNS      runs of each binary, the median counts (default 5)
+#   CC, CFLAGS      host compiler and flags (default cc -O2)
+#
+# The results are written as CSV to the standard output and to
+# <workdir>/results.csv, one line for the original of each program and one
+# for each configuration. Times are in milliseconds, sizes in bytes. The
+# kernels run for a few seconds each at -O2, so the start of the process
+# and the resolution of the clock are lost in the noise.
+#
+#----------------------------------------------------------------------------
+
+set -u
+
+CROWBAR=${1:?usage: run.sh <crowbar> [workdir]}
+WORK=${2:-bench.out}
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+SELECT=${BENCH_SELECT:-50% 100%}
+REPEAT=${BENCH_REPEAT:-1 5}
+REDIRECT=${BENCH_REDIRECT:-50% 100%}
+FLAGS=${BENCH_FLAGS:-}
+RUNS=${BENCH_RUNS:-5}
+
+now()
+{
+	date +%s%N
+}
+
+elapsed()
+{
+	echo $(( ($(now) - $1) / 1000000 ))
+}
+
+# Size of the text section of a binary
+textsize()
+{
+	size "$1" 2>/dev/null | awk 'NR == 2 { print $1 }'
+}
+
+# Compile a source into a binary, the compile time goes to stdout
+build()
+{
+	local t=$(now)
+
+	if ! $CC $CFLAGS -o "$2" "$1" 2>>"$WORK/build.log"; then
+		echo -1
+		return 1
+	fi
+
+	elapsed $t
+}
+
+# Median of RUNS runs, the output of the last run is left in $2
+measure()
+{
+	local times=() t i
+
+	for (( i = 0; i < RUNS; i++ )); do
+		t=$(now)
+		"$1" > "$2" || return 1
+		times+=( $(elapsed $t) )
+	done
+
+	printf '%s\n' "${times[@]}" | sort -n | awk '
+		{ v[NR] = $1 }
+		END { print (NR % 2) ? v[(NR + 1) / 2] : int((v[NR / 2] + v[NR / 2 + 1]) / 2) }'
+}
+
+programs=( "$HERE"/kernels/*.c )
+
+for p in ${BENCH_PROGRAMS:-}; do
+	if [ -d "$p" ]; then
+		programs+=( "$p"/*.c )
+	else
+		programs+=( "$p" )
+	fi
+done
+
+mkdir -p "$WORK"
+: > "$WORK/build.log"
+
+header="program,select,repeat,redirect,crowbar_ms,compile_ms,run_ms,binary_bytes,text_bytes,status"
+echo "$header" | tee "$WORK/results.csv"
+
+report()
+{
+	echo "$1" | tee -a "$WORK/results.csv"
+}
+
+for src in "${programs[@]}"; do
+	name=$(basename "$src" .c)
+	dir="$WORK/$name"
+	mkdir -p "$dir"
+
+	# The original sets the reference output and numbers
+
+	cp "$src" "$dir/original.c"
+	bin="$dir/original"
+
+	if ! ct=$(build "$dir/original.c" "$bin"); then
+		report "$name,,,,,,,,,build-failed"
+		continue
+	fi
+
+	if ! rt=$(measure "$bin" "$dir/original.txt"); then
+		report "$name,,,,,$ct,,,,run-failed"
+		continue
+	fi
+
+	report "$name,,,,0,$ct,$rt,$(stat -c %s "$bin"),$(textsize "$bin"),ok"
+
+	for s in $SELECT; do
+	for r in $REPEAT; do
+	for d in $REDIRECT; do
+		tag="s${s%\%}-r$r-d${d%\%}"
+		row="$name,$s,$r,$d"
+		out="$dir/$tag.c"
+		bin="$dir/$tag"
+
+		cp "$src" "$out"
+
+		t=$(now)
+		if ! "$CROWBAR" -max-select="$s" -max-repeat="$r" \
+				-max-redirect="$d" $FLAGS "$out" -- $CFLAGS \
+				> "$dir/$tag.log" 2>&1; then
+			report "$row,$(elapsed $t),,,,,crowbar-failed"
+			continue
+		fi
+		cb=$(elapsed $t)
+
+		if ! ct=$(build "$out" "$bin"); then
+			report "$row,$cb,,,,,build-failed"
+			continue
+		fi
+
+		if ! rt=$(measure "$bin" "$dir/$tag.txt"); then
+			report "$row,$cb,$ct,,,,run-failed"
+			continue
+		fi
+
+		# The transformation must not change what the program does
+
+		status=ok
+		if ! cmp -s "$dir/original.txt" "$dir/$tag.txt"; then
+			status=output-differs
+		fi
+
+		report "$row,$cb,$ct,$rt,$(stat -c %s "$bin"),$(textsize "$bin"),$status"
+	done
+	done
+	done
+done